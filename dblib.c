@@ -1,822 +1,6631 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <ctype.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include "dblib.h"
 
-// TODO:
-// 1) every func that change node should update its LSM.
-// 2) every such func should have additional mode for recovery
-// 3) cache should be a bit smarter, no additional writings
-// 4) Log should be separate thread or process (how?)
 
+// Checksums
+
+// CRC32C (Castagnoli), the polynomial SSE4.2 computes in hardware.
+// Calls chain: passing the CRC of a prefix continues it over the rest.
+// Picked once at startup by crc32c_init.
+
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_scalar(uint32_t crc, const void *data, size_t size) {
+    const unsigned char *p = (const unsigned char *) data;
+    crc = ~crc;
+    while (size--)
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *data, size_t size) {
+    const unsigned char *p = (const unsigned char *) data;
+    uint64_t wide = ~crc;
+    for (; size >= sizeof(uint64_t); p += sizeof(uint64_t), size -= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        wide = _mm_crc32_u64(wide, word);
+    }
+    crc = (uint32_t) wide;
+    while (size--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return ~crc;
+}
+
+#endif
+
+static uint32_t (*crc32c)(uint32_t, const void *, size_t) = &crc32c_scalar;
+
+void crc32c_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+        crc32c_table[i] = crc;
+    }
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c = &crc32c_sse42;
+#endif
+}
 
 // Read-Write operations
 
+// Positional I/O leaves no shared file position behind, so the file can
+// be accessed from several threads at once.
+
 int dbwrite(struct DB *db, char *src, size_t size, size_t offset) {
-    lseek(db->file, offset, SEEK_SET);
-    ssize_t done = 0, part;
-    do {
-        part = write(db->file, src + done, size - done);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t part = pwrite(db->file, src + done, size - done, offset + done);
+        if (part < 0)
+            return -1;
         done += part;
-    } while (done < size);
+    }
     return 0;
 }
 
+// Reading past the end of the file yields zeroes
 int dbread(struct DB *db, char *dst, const size_t size, const size_t offset) {
-    lseek(db->file, offset, SEEK_SET);
-    ssize_t done = 0, part;
-    do {
-        part = read(db->file, dst + done, size - done);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t part = pread(db->file, dst + done, size - done, offset + done);
+        if (part <= 0) {
+            memset(dst + done, 0, size - done);
+            return -1;
+        }
         done += part;
-    } while (done < size);
+    }
     return 0;
 }
 
-struct Chunk *node_read(struct DB *db, size_t offset) {
-    const size_t size = db->header.main_settings.chunk_size;
-    // Read chunk
-    struct Chunk *node = (struct Chunk *) malloc (sizeof(*node));
-    node->offset = offset;
-    node->raw_data = malloc(size);
-    dbread(db, (char *) node->raw_data, size, offset);
-    // Read chunk_header
-    struct Chunk_Header header = *((struct Chunk_Header *) node->raw_data);
-    node->leaf = header.leaf;
-    node->n = header.n;
-    // Copy childs
-    for (int i = node->n; i >= 0; i--)
-        node->childs[i] = header.childs[i];
-    // Unpack keys and data
-    const char *start = (char *) node->raw_data;
-    const size_t ssize = sizeof(size_t);
-    size_t shift = sizeof(header);
-    for (int i = 0; i < node->n; i++) {
-        size_t elem_len;
-        elem_len = node->keys[i].size = *((size_t *)(start + shift));
-        shift += ssize;
-        node->keys[i].data = (void *)(start + shift);
-        shift += elem_len;
-        elem_len = node->data[i].size = *((size_t *)(start + shift));
-        shift += ssize;
-        node->data[i].data = (void *)(start + shift);
-        shift += elem_len;
+// Drop `done` bytes from the front of an iovec array
+static void iov_consume(struct iovec **iov, int *count, size_t done) {
+    while (*count > 0 && done >= (*iov)->iov_len) {
+        done -= (*iov)->iov_len;
+        (*iov)++;
+        (*count)--;
+    }
+    if (*count > 0) {
+        (*iov)->iov_base = (char *) (*iov)->iov_base + done;
+        (*iov)->iov_len -= done;
     }
-    return node;
 }
 
-// FIXME: node_write should not be after each change
-void node_write(struct DB *db, struct Chunk *node) {
-    const size_t chunk_size = db->header.main_settings.chunk_size;
-    // New header
-    struct Chunk_Header header;
-    header.leaf = node->leaf;
-    header.n = node->n;
-    for (int i = node->n; i >= 0; i--) {
-        header.childs[i] = node->childs[i];
+// Gathered write of adjacent chunks; iov is consumed
+int dbwritev(struct DB *db, struct iovec *iov, int count, size_t offset) {
+    while (count > 0) {
+        ssize_t part = pwritev(db->file, iov, count, offset);
+        if (part < 0)
+            return -1;
+        offset += part;
+        iov_consume(&iov, &count, part);
     }
-    // Additional vars
-    const size_t ssize = sizeof(size_t);
-    size_t shift = sizeof(header);
-    // Allocating new chunk and fill it in proper order
-    char *modified_data = (char *) malloc(chunk_size);
-    *((struct Chunk_Header *) modified_data) = header;
-    for (int i = 0; i < node->n; i++) {
-        size_t elem_len;
-        elem_len = *((size_t *) (modified_data + shift)) = node->keys[i].size;
-        shift += ssize;
-        memcpy(modified_data + shift, node->keys[i].data, elem_len);
-        node->keys[i].data = modified_data + shift;
-        shift += elem_len;
-        elem_len = *((size_t *) (modified_data + shift)) = node->data[i].size;
-        shift += ssize;
-        memcpy(modified_data + shift, node->data[i].data, elem_len);
-        node->data[i].data = modified_data + shift;
-        shift += elem_len;
-    }
-    free(node->raw_data);
-    node->raw_data = (void *) modified_data;
-    dbwrite(db, (char *) node->raw_data, chunk_size, node->offset);
-}
-
-int logwrite(struct Log *log, void *src, size_t size) {
-    ssize_t done = 0, part;
-    do {
-        part = write(log->file, (char *) src + done, size - done);
-        done += part;
-    } while (done < size);
     return 0;
 }
 
-int logread(struct Log *log, void *dst, const size_t size) {
-    ssize_t done = 0, part;
-    do {
-        part = read(log->file, (char *) dst + done, size - done);
-        if (part == 0)
+// Scattered read of adjacent chunks; iov is consumed
+int dbreadv(struct DB *db, struct iovec *iov, int count, size_t offset) {
+    while (count > 0) {
+        ssize_t part = preadv(db->file, iov, count, offset);
+        if (part <= 0) {
+            for (int i = 0; i < count; i++)
+                memset(iov[i].iov_base, 0, iov[i].iov_len);
             return -1;
-        done += part;
-    } while (done < size);
+        }
+        offset += part;
+        iov_consume(&iov, &count, part);
+    }
     return 0;
 }
 
-// Free node
+// Batch of independent transfers, one after another
+int dbsubmit(struct DB *db, struct DB_IO *io, size_t count) {
+    int res = 0;
+    for (size_t i = 0; i < count; i++) {
+        if ((io[i].write ? dbwritev : dbreadv)(db, io[i].iov, io[i].count, io[i].offset))
+            res = -1;
+    }
+    return res;
+}
 
-void node_free(struct Chunk *node) {
-    if (node) {
-        free(node->raw_data);
-        free(node);
+
+// io_uring backend
+
+// Keeps a whole batch of chunk transfers in flight with a single system
+// call, and lets the log writer append and sync in one submission. The
+// ring is set up through raw syscalls; when the kernel lacks io_uring
+// uring_open fails and the synchronous path above stays in use.
+
+#define DB_URING_ENTRIES 64
+#define LOG_URING_ENTRIES 2
+
+struct Uring *uring_open(unsigned int entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+        return NULL;
+    struct Uring *ring = (struct Uring *) malloc(sizeof(*ring));
+    ring->fd = fd;
+    ring->entries = params.sq_entries;
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_size > ring->sq_map_size)
+            ring->sq_map_size = ring->cq_map_size;
+        ring->cq_map_size = ring->sq_map_size;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq_map = ring->sq_map;
+    if (ring->sq_map != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes = (struct io_uring_sqe *) mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                              MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->sqes != MAP_FAILED)
+            munmap(ring->sqes, ring->sqes_size);
+        if (ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+            munmap(ring->cq_map, ring->cq_map_size);
+        if (ring->sq_map != MAP_FAILED)
+            munmap(ring->sq_map, ring->sq_map_size);
+        close(fd);
+        free(ring);
+        return NULL;
     }
+    char *sq = (char *) ring->sq_map, *cq = (char *) ring->cq_map;
+    ring->sq_head = (unsigned int *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned int *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return ring;
 }
 
-void node_destroy(struct DB *db, struct Chunk *node) {
-    dbwrite(db, (char *) &db->header.ff_offset, sizeof(db->header.ff_offset), node->offset);
-    db->header.ff_offset = node->offset;
+void uring_close(struct Uring *ring) {
+    if (ring) {
+        munmap(ring->sqes, ring->sqes_size);
+        if (ring->cq_map != ring->sq_map)
+            munmap(ring->cq_map, ring->cq_map_size);
+        munmap(ring->sq_map, ring->sq_map_size);
+        close(ring->fd);
+        free(ring);
+    }
 }
 
-// Write Ahead Log
+// Queue one request; at most `entries` may be queued between uring_run calls
+static struct io_uring_sqe *uring_prep(struct Uring *ring, int opcode, int fd,
+                                       const struct iovec *iov, int count, size_t offset) {
+    const unsigned int tail = *ring->sq_tail;
+    const unsigned int index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) iov;
+    sqe->len = count;
+    sqe->off = offset;
+    ring->sq_array[index] = index;
+    atomic_store_explicit((_Atomic unsigned int *) ring->sq_tail, tail + 1, memory_order_release);
+    return sqe;
+}
 
-struct Log *log_open(char *filename) {
-    struct Log *log = (struct Log *) malloc(sizeof(*log));
-    log->file = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
-    return log;
+// Submit `count` queued requests, wait for all of them and store each
+// result at res[user_data]
+static int uring_run(struct Uring *ring, unsigned int count, int *res) {
+    unsigned int done = 0;
+    while (done < count) {
+        const unsigned int submit = done ? 0 : count;
+        int ret = (int) syscall(__NR_io_uring_enter, ring->fd, submit, count - done,
+                                IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR)
+            return -1;
+        unsigned int head = *ring->cq_head;
+        const unsigned int tail = atomic_load_explicit((_Atomic unsigned int *) ring->cq_tail,
+                                                       memory_order_acquire);
+        for (; head != tail; head++, done++) {
+            const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            res[cqe->user_data] = cqe->res;
+        }
+        atomic_store_explicit((_Atomic unsigned int *) ring->cq_head, head, memory_order_release);
+    }
+    return 0;
 }
 
-void log_close(struct Log *log) {
-    //TODO: while (log->records_queue) write_all
-    close(log->file);
-    free(log);
+static size_t iov_size(const struct iovec *iov, int count) {
+    size_t size = 0;
+    for (int i = 0; i < count; i++)
+        size += iov[i].iov_len;
+    return size;
 }
 
-void log_write(struct Log *log, struct Record *record) {
-    size_t offset = 0, record_size = sizeof(record->LSN) + sizeof(record->op) + record->key.size;
-    if (record->op != 'd')
-        record_size += record->data.size;
-    char *data = malloc(record_size);
-    memcpy(&(data[offset]), &(record->LSN), sizeof(record->LSN));
-    offset += sizeof(record->LSN);
-    memcpy(&(data[offset]), &(record->op), sizeof(record->op));
-    offset += sizeof(record->op);
-    memcpy(&(data[offset]), record->key.data, record->key.size);
-    offset += sizeof(record->key.size);
-    if (record->op != 'd')
-        memcpy(&(data[offset]), record->data.data, record->data.size);
-    logwrite(log, data, record_size);
-    free(data);
-}
-
-// FIXME
-void log_seek(struct Log *log) {
-    int magic_number = 0xdeadface;
-    size_t buf_size = 1024;
-    size_t latest_pos = 0;
-    __off_t pos = lseek(log->file, -buf_size, SEEK_END);
-    char buf[buf_size];
-    ssize_t size;
-    while ((size = read(log->file, buf, buf_size)) >= sizeof(magic_number)) {
-        for (ssize_t i = size - sizeof(magic_number); i >= 0; i--) {
-            if (memcmp(buf + i, &magic_number, sizeof(magic_number)) == 0) {
-                lseek(log->file, pos + i + sizeof(magic_number), SEEK_SET);
-                return;
-            }
+// All transfers of the batch are in flight at once. Short or failed
+// transfers are finished synchronously.
+int dbsubmit_uring(struct DB *db, struct DB_IO *io, size_t count) {
+    struct Uring *ring = db->uring;
+    int res[DB_URING_ENTRIES];
+    int status = 0;
+    for (size_t base = 0; base < count; base += ring->entries) {
+        const unsigned int batch = count - base < ring->entries ? count - base : ring->entries;
+        for (unsigned int i = 0; i < batch; i++) {
+            const struct DB_IO *op = &io[base + i];
+            struct io_uring_sqe *sqe = uring_prep(ring, op->write ? IORING_OP_WRITEV : IORING_OP_READV,
+                                                  db->file, op->iov, op->count, op->offset);
+            sqe->user_data = i;
+            res[i] = -1;
+        }
+        if (uring_run(ring, batch, res))
+            return dbsubmit(db, io + base, count - base);
+        for (unsigned int i = 0; i < batch; i++) {
+            struct DB_IO *op = &io[base + i];
+            const size_t done = res[i] > 0 ? res[i] : 0;
+            if (done == iov_size(op->iov, op->count))
+                continue;
+            struct iovec *iov = op->iov;
+            int left = op->count;
+            iov_consume(&iov, &left, done);
+            if ((op->write ? dbwritev : dbreadv)(db, iov, left, op->offset + done))
+                status = -1;
         }
-        if (pos == 0)
-            break;
-        pos = lseek(log->file, -size - (buf_size + 1 - sizeof(magic_number)), SEEK_CUR);
     }
-    lseek(log->file, 0, SEEK_SET);
+    return status;
 }
 
-struct Record *log_read_next(struct Log *log) {
-    struct Record *record = (struct Record *) malloc(sizeof(*record));
-    if (logread(log, &(record->LSN), sizeof(record->LSN)) < 0) {
-        free(record);
-        return NULL;
-    }
-    logread(log, &(record->op), sizeof(record->op));
-    logread(log, &(record->key.size), sizeof(record->key.size));
-    record->key.data = malloc(record->key.size);
-    logread(log, record->key.data, record->key.size);
-    if (record->op != 'd') {
-        record->data.data = malloc(record->data.size);
-        logread(log, record->data.data, record->data.size);
+// Memory-mapped mode: clean cached chunks are parsed in place over a
+// read-only shared mapping of the file. A chunk gets a private copy when
+// it is modified and goes back to being a view once written back.
+
+void db_map(struct DB *db) {
+    struct stat file_stat;
+    fstat(db->file, &file_stat);
+    db->map_size = file_stat.st_size;
+    db->map = (char *) mmap(NULL, db->map_size, PROT_READ, MAP_SHARED, db->file, 0);
+    if (db->map == MAP_FAILED) {
+        db->map = NULL;
+        db->map_size = 0;
+    } else {
+        // Tree descents touch pages in no particular order
+        madvise(db->map, db->map_size, MADV_RANDOM);
     }
-    return record;
 }
 
-// FIXME
-void recovery(struct DB *db, char *filename) {
-    struct Log *log = (struct Log *) malloc(sizeof(*log));
-    db->log = NULL;
-    log->file = open(filename, O_RDONLY, S_IRUSR);
-    if (log->file >= 0) {
-        log_seek(log);
-        struct Record *record;
-        while ((record = log_read_next(log))) {
-            db->header.last_LSN = record->LSN;
-            free(record);
-        }
-        /*
-            switch(record->op) {
-                case 'd': {
-                    db->del(db, &(record->key)); // Special del for recovery
-                    break;
-                }
-                case 'i': {
-                    db->put(db, &(record->key), &(record->data)); // Special put for recovery
-                    break;
-                }
-                default:
-                    fprintf(stderr, "ERROR! Wrong operation in log.\n");
-            }
-            free(record);
-        */
-        close(log->file);
+void db_unmap(struct DB *db) {
+    if (db->map) {
+        munmap(db->map, db->map_size);
+        db->map = NULL;
     }
 }
 
-// Cache LRU
+static bool node_mappable(struct DB *db, size_t offset) {
+    return db->map && offset + db->header.main_settings.chunk_size <= db->map_size;
+}
 
-void cache_init(struct DB *db) {
-    db->cache.n = db->header.main_settings.mem_size / db->header.main_settings.chunk_size;
-    db->cache.head = NULL;
+static void op_retire(void *buf);
+
+// Replace a clean private copy with the identical view of the file
+void node_map(struct DB *db, struct Chunk *node) {
+    char *raw = (char *) node->raw_data, *view = db->map + node->offset;
+    for (int i = 0; i < node->n; i++)
+        node->data[i].data = view + ((char *) node->data[i].data - raw);
+    __atomic_store_n(&node->raw_data, view, __ATOMIC_RELEASE);
+    node->view = true;
+    op_retire(raw);
 }
 
-void cache_free(struct DB *db) {
-    struct cache_list_node *curr = db->cache.head;
-    while (curr) {
-        struct cache_list_node *tmp = curr;
-        curr = curr->next;
-        node_free(tmp->node);
-        free(tmp);
-    }
+// Replace a view of the file with an identical private copy, which the
+// checkpoint does not overwrite in place
+static void node_unmap(struct DB *db, struct Chunk *node) {
+    const size_t chunk_size = db->header.main_settings.chunk_size;
+    char *view = (char *) node->raw_data, *raw = (char *) malloc(chunk_size);
+    memcpy(raw, view, chunk_size);
+    for (int i = 0; i < node->n; i++)
+        node->data[i].data = raw + ((char *) node->data[i].data - view);
+    __atomic_store_n(&node->raw_data, raw, __ATOMIC_RELEASE);
+    node->view = false;
 }
 
-void node_add_to_cache(struct DB *db, struct Chunk *node) {
-    size_t count = 0;
-    struct cache_list_node *curr = db->cache.head;
-    struct cache_list_node *prev = NULL;
-    while (curr && curr->next) {
-        prev = curr;
-        curr = curr->next;
-        count++;
-    }
-    if (count >= db->cache.n - 1) {
-        node_free(curr->node);
-        free(curr);
-        prev->next = NULL;
+// Unpack a chunk whose raw_data has been read
+// Slotted chunk layout:
+//   header | childs[n + 1] | slots[n] | prefix | free space | cells
+// Cells are packed at the end of the chunk in slot order, each being
+// suffix.size | data.size | suffix | data, and every key is the common
+// prefix followed by its suffix. Leaves keep childs only when empty, as
+// overflow chunks link their chains through childs[0].
+
+#define CELL_OVERHEAD (sizeof(uint32_t) * 3)
+
+// A value kept in overflow chunks is stored in its cell as a struct
+// Overflow_Ref, and its size carries this flag both in the cell and in
+// memory. Inline values are never larger than a quarter of a chunk.
+#define VALUE_OVERFLOW ((size_t) 1 << 31)
+
+// Bytes a value takes in its cell
+static size_t value_bytes(const struct DBT *value) {
+    return value->size & ~VALUE_OVERFLOW;
+}
+
+static bool node_has_childs(bool leaf, size_t n) {
+    return !leaf || n == 0;
+}
+
+// Grow the entry arrays to hold at least n entries
+void node_reserve(struct Chunk *node, size_t n) {
+    if (n <= node->cap)
+        return;
+    size_t cap = node->cap ? node->cap : 8;
+    while (cap < n)
+        cap *= 2;
+    node->keys = (struct DBT *) realloc(node->keys, cap * sizeof(*node->keys));
+    node->data = (struct DBT *) realloc(node->data, cap * sizeof(*node->data));
+    node->heads = (unsigned int *) realloc(node->heads, cap * sizeof(*node->heads));
+    node->childs = (size_t *) realloc(node->childs, (cap + 1) * sizeof(*node->childs));
+    node->cap = cap;
+}
+
+static pthread_rwlockattr_t latch_attr;
+
+static struct Chunk *node_alloc(size_t offset) {
+    struct Chunk *node = (struct Chunk *) calloc(1, sizeof(*node));
+    node->offset = offset;
+    pthread_rwlock_init(&node->latch, &latch_attr);
+    node_reserve(node, 1);
+    return node;
+}
+
+// The first key bytes after the prefix packed big-endian into an integer,
+// so that unequal heads order keys the same way keycmp does. Missing
+// bytes become zero, the smallest value, as a shorter key sorts first.
+static unsigned int key_head(const char *suffix, size_t size) {
+    unsigned int head = 0;
+    for (size_t i = 0; i < sizeof(head); i++) {
+        head <<= 8;
+        if (i < size)
+            head |= (unsigned char) suffix[i];
     }
-    struct cache_list_node *new_list_node = (struct cache_list_node *) malloc(sizeof(*new_list_node));
-    new_list_node->node = node;
-    new_list_node->next = db->cache.head;
-    db->cache.head = new_list_node;
+    return head;
 }
 
-struct Chunk *node_get(struct DB *db, size_t offset) {
-    size_t count = 0;
-    struct cache_list_node *curr = db->cache.head;
-    struct cache_list_node *prev = NULL;
-    // Searching for cached page
-    while (curr) {
-        if (curr->node->offset == offset) {
-            if (prev) {
-                prev->next = curr->next;
-                curr->next = db->cache.head;
-                db->cache.head = curr;
-            }
-            return curr->node;
-        } else if (curr->next) {
-            prev = curr;
-            curr = curr->next;
-            count++;
-        } else {
-            break;
-        }
+static void node_set_heads(struct Chunk *node) {
+    for (int i = 0; i < node->n; i++)
+        node->heads[i] = key_head((char *) node->keys[i].data + node->prefix,
+                                  node->keys[i].size - node->prefix);
+}
+
+// Length of the common prefix of two keys
+static size_t key_lcp(const struct DBT *a, const struct DBT *b) {
+    const size_t min_len = a->size < b->size ? a->size : b->size;
+    const char *str_a = (char *) a->data, *str_b = (char *) b->data;
+    size_t i = 0;
+    while (i < min_len && str_a[i] == str_b[i])
+        i++;
+    return i;
+}
+
+// Make a node changed in place by node_insert or node_remove searchable
+// again before it is written
+static void node_reindex(struct Chunk *node) {
+    node->prefix = node->n > 0 ? key_lcp(&node->keys[0], &node->keys[node->n - 1]) : 0;
+    node_set_heads(node);
+}
+
+// Bytes that entries [from, to) take as one chunk. Keys are sorted, so
+// the first and the last share the common prefix of all of them.
+size_t entries_size(const struct DBT *keys, const struct DBT *data, int from, int to, bool leaf) {
+    size_t size = sizeof(struct Chunk_Header);
+    if (node_has_childs(leaf, to - from))
+        size += (to - from + 1) * sizeof(size_t);
+    if (to == from)
+        return size;
+    const size_t prefix = key_lcp(&keys[from], &keys[to - 1]);
+    size += prefix;
+    for (int i = from; i < to; i++)
+        size += CELL_OVERHEAD + keys[i].size - prefix + value_bytes(&data[i]);
+    return size;
+}
+
+size_t node_size(struct Chunk *node) {
+    return entries_size(node->keys, node->data, 0, node->n, node->leaf);
+}
+
+// Unpack a chunk whose raw_data has been read
+static void node_parse(struct Chunk *node) {
+    // Read chunk_header
+    struct Chunk_Header header = *((struct Chunk_Header *) node->raw_data);
+    node->leaf = header.leaf;
+    node->n = header.n;
+    node->prefix = header.prefix;
+    node->LSN = header.LSN;
+    node->prev = header.prev;
+    node->next = header.next;
+    node->dirty = false;
+    node_reserve(node, node->n);
+    const char *start = (char *) node->raw_data;
+    size_t shift = sizeof(header);
+    // Copy childs
+    if (node_has_childs(node->leaf, node->n)) {
+        memcpy(node->childs, start + shift, (node->n + 1) * sizeof(size_t));
+        shift += (node->n + 1) * sizeof(size_t);
     }
-    // Deleting rear element
-    // db->cache.n - 1 > 0 (curr != NULL, prev != NULL)
-    if (count >= db->cache.n - 1) {
-        node_free(curr->node);
-        free(curr);
-        prev->next = NULL;
+    // Unpack data and find where suffixes are
+    const char *slots = start + shift;
+    const char *prefix = slots + node->n * sizeof(uint32_t);
+    size_t keys_size = 0;
+    for (int i = 0; i < node->n; i++) {
+        uint32_t cell, suffix_len, data_len;
+        memcpy(&cell, slots + i * sizeof(uint32_t), sizeof(cell));
+        memcpy(&suffix_len, start + cell, sizeof(suffix_len));
+        memcpy(&data_len, start + cell + sizeof(uint32_t), sizeof(data_len));
+        node->keys[i].size = node->prefix + suffix_len;
+        keys_size += node->keys[i].size;
+        // Suffix position until keys are expanded
+        node->keys[i].data = (void *) (start + cell + 2 * sizeof(uint32_t));
+        node->data[i].size = data_len;
+        node->data[i].data = (void *) (start + cell + 2 * sizeof(uint32_t) + suffix_len);
+    }
+    // Expand keys
+    node->keybuf = (char *) malloc(keys_size + 1);
+    char *key = node->keybuf;
+    for (int i = 0; i < node->n; i++) {
+        memcpy(key, prefix, node->prefix);
+        memcpy(key + node->prefix, node->keys[i].data, node->keys[i].size - node->prefix);
+        node->keys[i].data = key;
+        key += node->keys[i].size;
     }
-    // Add new head
-    struct cache_list_node *new_list_node = (struct cache_list_node *) malloc(sizeof(*new_list_node));
-    new_list_node->node = node_read(db, offset);
-    new_list_node->next = db->cache.head;
-    db->cache.head = new_list_node;
-    return new_list_node->node;
+    node_set_heads(node);
 }
 
-// Basic operations on nodes
+// CRC32C of a chunk image past its crc field
+static uint32_t chunk_crc(struct DB *db, const char *raw) {
+    const size_t skip = sizeof(((struct Chunk_Header *) raw)->crc);
+    return crc32c(0, raw + skip, db->header.main_settings.chunk_size - skip);
+}
 
-struct Chunk *node_create(struct DB *db) {
-    struct Chunk *node = (struct Chunk *) malloc(sizeof(*node));
-    size_t next_free;
-    dbread(db, (char *) &next_free, sizeof(next_free), db->header.ff_offset);
-    node->offset = db->header.ff_offset;
-    node->n = 0;
-    node->leaf = true;
-    node->LSN = db->header.last_LSN;
-    node->raw_data = malloc(db->header.main_settings.chunk_size);
-    db->header.ff_offset = next_free;
-    node_add_to_cache(db, node);
-    return node;
+// Called on a finished image before anyone else can see it
+static void chunk_seal(struct DB *db, char *raw) {
+    ((struct Chunk_Header *) raw)->crc = chunk_crc(db, raw);
 }
 
-void node_shift_left(struct Chunk *node, int index, int step, bool with_pointers) {
-    const int edge = node->n;
-    if (index < edge - step) {
-        for (int i = index; i < edge - step; i++) {
-            node->keys[i] = node->keys[i + step];
-            node->data[i] = node->data[i + step];
-        }
-        if (with_pointers) {
-            for (int i = index; i <= edge - step; i++) {
-                node->childs[i] = node->childs[i + step];
-            }
+// Whether an image read from the file is whole, rather than torn by a
+// crash or damaged on disk
+static bool chunk_intact(struct DB *db, const char *raw) {
+    return ((const struct Chunk_Header *) raw)->crc == chunk_crc(db, raw);
+}
+
+// Unpack a chunk read from the file. One that fails its checksum is
+// reported and marked corrupt. It is taken as an empty leaf, so that
+// nothing follows the offsets and lengths in it, and what the file holds
+// is never overwritten: operations reaching it fail instead.
+static void node_parse_read(struct DB *db, struct Chunk *node) {
+    const size_t size = db->header.main_settings.chunk_size;
+    if (!chunk_intact(db, (char *) node->raw_data)) {
+        fprintf(stderr, "ERROR! Chunk at %zu fails its checksum.\n", node->offset);
+        node->corrupt = true;
+        if (node->view) {
+            node->raw_data = malloc(size);
+            node->view = false;
         }
+        memset(node->raw_data, 0, size);
+        ((struct Chunk_Header *) node->raw_data)->leaf = true;
     }
-    node->n -= step;
+    node_parse(node);
 }
 
-void node_shift_right(struct Chunk *node, int index, int step, bool with_pointers) {
-    const int edge = node->n;
-    if (index < edge) {
-        for (int i = edge - 1; i >= index; i--) {
-            node->keys[i + step] = node->keys[i];
-            node->data[i + step] = node->data[i];
-        }
-        if (with_pointers) {
-            for (int i = edge; i >= index; i--) {
-                node->childs[i + step] = node->childs[i];
-            }
+struct Chunk *node_read(struct DB *db, size_t offset) {
+    const size_t size = db->header.main_settings.chunk_size;
+    // Read chunk
+    struct Chunk *node = node_alloc(offset);
+    node->view = node_mappable(db, offset);
+    if (node->view) {
+        node->raw_data = db->map + offset;
+    } else {
+        node->raw_data = malloc(size);
+        dbread(db, (char *) node->raw_data, size, offset);
+    }
+    node_parse_read(db, node);
+    return node;
+}
+
+// Give a chunk new raw_data. Views into the old buffer keep it allocated
+// until they are all released, optimistic readers until they are done.
+static void node_set_raw(struct DB *db, struct Chunk *node, void *raw) {
+    struct DB_Cache *cache = &db->cache;
+    void *old = node->raw_data;
+    bool retire = !node->view;
+    pthread_mutex_lock(&cache->pin_lock);
+    __atomic_store_n(&node->raw_data, raw, __ATOMIC_RELEASE);
+    node->view = false;
+    if (node->pins) {
+        if (cache->held_count == cache->held_cap) {
+            cache->held_cap = cache->held_cap ? 2 * cache->held_cap : 16;
+            cache->held = (struct Held_Buffer *) realloc(cache->held, cache->held_cap * sizeof(*cache->held));
         }
+        cache->held[cache->held_count++] = (struct Held_Buffer) {old, node->pins};
+        node->pins = 0;
+        retire = false;
     }
-    node->n += step;
+    pthread_mutex_unlock(&cache->pin_lock);
+    if (retire)
+        op_retire(old);
 }
 
-// Get data by key
+static void snapshot_keep(struct DB *db, struct Chunk *node);
 
-int keycmp(const struct DBT *a, const struct DBT *b) {
-    size_t min_len = (a->size > b->size) ? b->size : a->size;
-    char *str_a = (char *) a->data, *str_b = (char *) b->data;
-    for (int i = 0; i < min_len; i++) {
-        if (str_a[i] < str_b[i])
-            return -1;
-        else if (str_a[i] > str_b[i])
-            return 1;
+static unsigned lsn_current(struct DB *db) {
+    return __atomic_load_n(&db->header.last_LSN, __ATOMIC_ACQUIRE);
+}
+
+// Serialize changed node into its raw_data and mark it dirty.
+// The chunk reaches the disk only on eviction, sync or close.
+// The node must fit in a chunk.
+void node_write(struct DB *db, struct Chunk *node) {
+    const size_t chunk_size = db->header.main_settings.chunk_size;
+    // Neighbours of a change may be corrupt; the file keeps what it holds
+    if (node->corrupt)
+        return;
+    snapshot_keep(db, node);
+    node->LSN = lsn_current(db);
+    node->prefix = node->n > 0 ? key_lcp(&node->keys[0], &node->keys[node->n - 1]) : 0;
+    // New header
+    struct Chunk_Header header;
+    memset(&header, 0, sizeof(header));
+    header.leaf = node->leaf;
+    header.n = node->n;
+    header.prefix = node->prefix;
+    header.LSN = node->LSN;
+    header.prev = node->prev;
+    header.next = node->next;
+    // Never leak stale heap contents into the file or the log
+    char *modified_data = (char *) calloc(1, chunk_size);
+    *((struct Chunk_Header *) modified_data) = header;
+    size_t shift = sizeof(header), keys_size = 0;
+    if (node_has_childs(node->leaf, node->n)) {
+        memcpy(modified_data + shift, node->childs, (node->n + 1) * sizeof(size_t));
+        shift += (node->n + 1) * sizeof(size_t);
     }
-    if (a->size > min_len) {
-        return 1;
-    } else if (b->size > min_len) {
-        return -1;
-    } else {
-        return 0;
+    char *slots = modified_data + shift;
+    shift += node->n * sizeof(uint32_t);
+    if (node->n > 0)
+        memcpy(modified_data + shift, node->keys[0].data, node->prefix);
+    // Cells fill the chunk from its end
+    size_t end = chunk_size;
+    for (int i = 0; i < node->n; i++) {
+        const uint32_t suffix_len = node->keys[i].size - node->prefix, data_len = node->data[i].size;
+        end -= 2 * sizeof(uint32_t) + suffix_len + value_bytes(&node->data[i]);
+        const uint32_t cell = end;
+        memcpy(slots + i * sizeof(uint32_t), &cell, sizeof(cell));
+        memcpy(modified_data + end, &suffix_len, sizeof(suffix_len));
+        memcpy(modified_data + end + sizeof(uint32_t), &data_len, sizeof(data_len));
+        memcpy(modified_data + end + 2 * sizeof(uint32_t), (char *) node->keys[i].data + node->prefix, suffix_len);
+        // Separators in a B+tree carry no value and no data pointer
+        if (value_bytes(&node->data[i]) > 0)
+            memcpy(modified_data + end + 2 * sizeof(uint32_t) + suffix_len, node->data[i].data, value_bytes(&node->data[i]));
+        node->data[i].data = modified_data + end + 2 * sizeof(uint32_t) + suffix_len;
+        keys_size += node->keys[i].size;
+    }
+    char *keybuf = (char *) malloc(keys_size + 1), *key = keybuf;
+    for (int i = 0; i < node->n; i++) {
+        memcpy(key, node->keys[i].data, node->keys[i].size);
+        node->keys[i].data = key;
+        key += node->keys[i].size;
+    }
+    chunk_seal(db, modified_data);
+    node_set_raw(db, node, modified_data);
+    op_retire(node->keybuf);
+    node->keybuf = keybuf;
+    node_set_heads(node);
+    if (!node->dirty) {
+        node->dirty = true;
+        db->cache.dirty++;
     }
 }
 
-struct DBT *search(struct DB *db, struct Chunk *node, struct DBT *key) {
-    //printf("node.offest = %d\n", node->offset);
-    int index = 0;
-    while (index < node->n && keycmp(key, &node->keys[index]) > 0) {
-        index++;
+// Write back dirty chunks sorted by offset. Each run of adjacent chunks
+// becomes one vectored write and all runs are submitted as one batch.
+void node_flush(struct DB *db, struct Chunk **nodes, size_t count) {
+    const size_t chunk_size = db->header.main_settings.chunk_size;
+    struct iovec *iov = (struct iovec *) malloc((count + 1) * sizeof(*iov));
+    struct DB_IO *io = (struct DB_IO *) malloc((count + 1) * sizeof(*io));
+    size_t runs = 0;
+    for (size_t i = 0; i < count; ) {
+        struct DB_IO *run = &io[runs++];
+        run->iov = &iov[i];
+        run->count = 0;
+        run->offset = nodes[i]->offset;
+        run->write = true;
+        do {
+            iov[i].iov_base = nodes[i]->raw_data;
+            iov[i].iov_len = chunk_size;
+            run->count++;
+            i++;
+        } while (i < count && run->count < IOV_MAX
+                 && nodes[i]->offset == run->offset + run->count * chunk_size);
     }
-    /*
-    if (index < node->n)
-        printf("now we at %s, that is greater or equal %s\n", node->keys[index].data, key->data);
-    else
-        printf("we are out of scope\n");
-    */
-    if (index < node->n && keycmp(key, &node->keys[index]) == 0) {
-        struct DBT *result = (struct DBT *) malloc(sizeof(*result));
-        result->size = node->data[index].size;
-        result->data = malloc(result->size);
-        memcpy(result->data, node->data[index].data, result->size);
-        return result;
-    } else if (node->leaf) {
-        return NULL;
-    } else {
-        struct Chunk *child = node_get(db, node->childs[index]);
-        return search(db, child, key);
+    db->submit(db, io, runs);
+    free(io);
+    free(iov);
+    pthread_mutex_lock(&db->cache.pin_lock);
+    for (size_t i = 0; i < count; i++) {
+        struct Chunk *node = nodes[i];
+        node->dirty = false;
+        db->cache.dirty--;
+        db->cache.writes++;
+        if (node_mappable(db, node->offset) && !node->pins)
+            node_map(db, node);
     }
+    pthread_mutex_unlock(&db->cache.pin_lock);
 }
 
+// Free node
 
-int dbget(struct DB *db, struct DBT *key, struct DBT *data) {
-    //printf("searching %s: ", (char *) key->data);
-    struct Chunk *root = node_get(db, db->header.root_offset);
-    data = search(db, root, key); // search will free root
-    if (data) {
-        //printf("%s(%d)\n", (char *) data->data, (int) data->size);
-        return 0;
-    } else {
-        printf("Key not found\n");
-        return -1;
+void node_free(struct Chunk *node) {
+    if (node) {
+        if (!node->view)
+            free(node->raw_data);
+        free(node->keybuf);
+        free(node->childs);
+        free(node->keys);
+        free(node->data);
+        free(node->heads);
+        pthread_rwlock_destroy(&node->latch);
+        free(node);
     }
 }
 
-// Put data
 
-struct Chunk *split(struct DB *db, struct Chunk *x, int index, struct Chunk *y) {
-    x->LSN = y->LSN = db->header.last_LSN;
-    struct Chunk *z = node_create(db);
-    z->leaf = y->leaf;
-    z->n = T - 1;
-    for (int i = 0; i < T - 1; i++) {
-        z->keys[i] = y->keys[i + T];
-        z->data[i] = y->data[i + T];
-    }
-    if (!y->leaf) {
-        for (int i = 0; i < T; i++) {
-            z->childs[i] = y->childs[i + T];
-        }
-    }
-    y->n = T - 1;
-    node_shift_right(x, index, 1, true);
-    x->childs[index] = y->offset;
-    x->childs[index + 1] = z->offset;
-    x->keys[index] = y->keys[T - 1];
-    x->data[index] = y->data[T - 1];
-    node_write(db, z); //  Order
-    node_write(db, x); // is very
-    node_write(db, y); //important
-    return z;
-}
+// Tree operations
 
-bool node_enough_space(struct DB *db, struct Chunk *node, size_t len_new, size_t len_old) {
-    if (node->n > 0) {
-        size_t current_size = (size_t) (node->data[node->n - 1].data - node->raw_data) + node->data[node->n - 1].size;
-        return current_size + (len_new - len_old) < db->header.main_settings.chunk_size;
-    } else {
-        return true;
+// Each thread keeps the state of the tree operation it is in. Chunks it
+// gets stay cached and latches it takes are held until the outermost
+// operation ends. A chunk dropped from the cache while operations use it
+// is only detached, and retired by the last of them.
+
+#define NODE_DETACHED (1u << 31)
+#define CHUNK_OBSOLETE ((size_t) 1 << 63)
+
+static pthread_key_t tree_op_key;
+static pthread_once_t tree_op_once = PTHREAD_ONCE_INIT;
+static _Thread_local struct Tree_Op *tree_op;
+
+// Epochs
+
+// Optimistic readers take no latch and keep nothing cached, so chunks,
+// buffers and cache tables they may still be reading are not freed right
+// away: they are retired with the global epoch of the time, and freed once
+// it has advanced twice. It advances when every thread inside a read or an
+// operation has seen the current epoch.
+
+#define EPOCH_IDLE ((size_t) -1)
+// Retired items a thread gathers before it tries to collect them
+#define EPOCH_BATCH 64
+
+static atomic_size_t epoch_global;
+// Guards the thread list, the orphans and stripe assignment
+static pthread_mutex_t epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct Tree_Op *epoch_threads;
+// Left behind by threads that exited
+static struct Retire_List epoch_orphans;
+static unsigned int epoch_stripes;
+
+static void ptr_list_push(struct Ptr_List *list, void *item) {
+    if (list->count == list->cap) {
+        list->cap = list->cap ? 2 * list->cap : 16;
+        list->items = (void **) realloc(list->items, list->cap * sizeof(*list->items));
     }
+    list->items[list->count++] = item;
 }
 
-int insert(struct DB *db, struct Chunk *node, struct DBT *key, struct DBT *data) {
-    int index = 0;
-    while (index < node->n && keycmp(key, &node->keys[index]) > 0) {
-        index++;
+static void retire_push(struct Retire_List *list, struct Retired item) {
+    if (list->count == list->cap) {
+        list->cap = list->cap ? 2 * list->cap : 64;
+        list->items = (struct Retired *) realloc(list->items, list->cap * sizeof(*list->items));
     }
-    if (index < node->n && keycmp(key, &node->keys[index]) == 0) {
-        if (node_enough_space(db, node, key->size, node->keys[index].size)) {
-            node->data[index] = *data;
-            node->LSN = db->header.last_LSN;
-            node_write(db, node);
-            return 0;
-        } else {
-            // Chunk size is exceeded
-            return 1;
-        }
+    list->items[list->count++] = item;
+}
+
+// Free the items retired two epochs before the given one
+static void retire_drain(struct Retire_List *list, size_t epoch) {
+    size_t kept = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        if (list->items[i].epoch + 2 <= epoch)
+            list->items[i].release(list->items[i].ptr);
+        else
+            list->items[kept++] = list->items[i];
     }
-    if (node->leaf) {
-        if (node_enough_space(db, node, key->size, 0)) {
-            node_shift_right(node, index, 1, false);
-            node->keys[index] = *key;
-            node->data[index] = *data;
-            node->LSN = db->header.last_LSN;
-            node_write(db, node);
-            return 0;
-        } else {
-            // Chunk size is exceeded
-            return 1;
-        }
-    } else {
-        struct Chunk *child = node_get(db, node->childs[index]);
-        if (child->n == 2 * T - 1) {
-            struct Chunk *child2 = split(db, node, index, child);
-            if (keycmp(key, &node->keys[index]) == 0) {
-                if (node_enough_space(db, node, key->size, node->keys[index].size)) {
-                    node->data[index] = *data;
-                    node->LSN = db->header.last_LSN;
-                    return 0;
-                } else {
-                    // Chunk size is exceeded
-                    return 1;
-                }
-            }
-            if (keycmp(key, &node->keys[index]) > 0) {
-                return insert(db, child2, key, data);
-            }
+    list->count = kept;
+}
+
+// Thread exit
+static void tree_op_free(void *arg) {
+    struct Tree_Op *op = (struct Tree_Op *) arg;
+    pthread_mutex_lock(&epoch_lock);
+    for (struct Tree_Op **link = &epoch_threads; *link; link = &(*link)->next) {
+        if (*link == op) {
+            *link = op->next;
+            break;
         }
-        return insert(db, child, key, data);
     }
+    for (size_t i = 0; i < op->limbo.count; i++)
+        retire_push(&epoch_orphans, op->limbo.items[i]);
+    pthread_mutex_unlock(&epoch_lock);
+    free(op->used.items);
+    free(op->latched.items);
+    free(op->limbo.items);
+    free(op);
 }
 
-int dbput(struct DB *db, struct DBT *key, struct DBT *data) {
-    //printf("inserting %s - %s...\n", (char *) key->data, (char *) data->data);
-    if (key->size + data->size > db->header.main_settings.chunk_size / 2) {
-        // Data size is invalid
-        return 1;
-    }
+static void tree_op_init() {
+    pthread_key_create(&tree_op_key, &tree_op_free);
+    // A writer waiting for a latch goes before readers that come after it
+    pthread_rwlockattr_init(&latch_attr);
+    pthread_rwlockattr_setkind_np(&latch_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+}
 
-    struct Record record;
-    record.LSN = (db->header.last_LSN += 1);
-    record.op = 'i';
-    record.key = *key;
-    record.data = *data;
-    log_write(db->log, &record);
-    struct Chunk *root = node_get(db, db->header.root_offset);
-    if (root->n == 2 * T - 1) {
-        struct Chunk *s = node_create(db);
-        db->header.root_offset = s->offset;
-        s->leaf = false;
-        s->childs[0] = root->offset;
-        struct Chunk *new_node = split(db, s, 0, root);
-        return insert(db, s, key, data);
-    } else {
-        return insert(db, root, key, data);
+static struct Tree_Op *thread_op() {
+    if (!tree_op) {
+        tree_op = (struct Tree_Op *) calloc(1, sizeof(*tree_op));
+        tree_op->epoch = EPOCH_IDLE;
+        tree_op->collect_at = EPOCH_BATCH;
+        pthread_setspecific(tree_op_key, tree_op);
+        pthread_mutex_lock(&epoch_lock);
+        tree_op->stripe = epoch_stripes++ % CACHE_HIT_STRIPES;
+        tree_op->next = epoch_threads;
+        epoch_threads = tree_op;
+        pthread_mutex_unlock(&epoch_lock);
     }
+    return tree_op;
 }
 
-// Delete data by key
+static void epoch_enter() {
+    struct Tree_Op *op = thread_op();
+    if (op->reading++ == 0)
+        atomic_store(&op->epoch, atomic_load(&epoch_global));
+}
 
-struct Chunk *exchange(struct DB *db, struct Chunk *node, int index, struct Chunk *donor, struct Chunk *acceptor, bool left) {
-    //printf("exchange func %s\n", left ? "left" : "right");
-    // Edges
-    const int donor_index = left ? 0 : donor->n - 1;
-    const int acceptor_index = left ? acceptor->n : 0;
-    // Expand acceptor by 1
-    node_shift_right(acceptor, acceptor_index, 1, true);
-    // Copy data from parent to acceptor
-    acceptor->keys[acceptor_index] = node->keys[index];
-    acceptor->data[acceptor_index] = node->data[index];
-    // Copy data from donor to parent
-    node->keys[index] = donor->keys[donor_index];
-    node->data[index] = donor->data[donor_index];
-    // Copy child from donor to acceptor
-    if (left) {
-        acceptor->childs[acceptor_index + 1] = donor->childs[donor_index];
-    } else {
-        acceptor->childs[acceptor_index] = donor->childs[donor_index + 1];
-    }
-    // Shrink donor by 1
-    node_shift_left(donor, donor_index, 1, true);
-    // Save and free
-    node_write(db, acceptor); //   Order
-    node_write(db, node);     //  is very
-    node_write(db, donor);    // important
-    // Result
-    return acceptor;
-}
-
-struct Chunk *merge(struct DB *db, struct Chunk *node, int index, struct Chunk *child, struct Chunk *neighbour, bool left) {
-    //printf("merge func %s\n", left ? "left" : "right");
-    const int child_index = left ? T : 0;
-    // Expand child by T
-    node_shift_right(child, child_index, T, true);
-    // Copy data from parent to child
-    child->keys[T - 1] = node->keys[index];
-    child->data[T - 1] = node->data[index];
-    // Shrink parent by 1
-    if (left)
-        node->childs[index + 1] = node->childs[index];
-    else if (index == node->n - 1)
-        node->childs[index] = node->childs[index + 1];
-    node_shift_left(node, index, 1, true);
-    // Copy data from neighbour to child
-    for (int i = 0; i < T - 1; i++) {
-        child->keys[i + child_index] = neighbour->keys[i];
-        child->data[i + child_index] = neighbour->data[i];
-        child->childs[i + child_index] = neighbour->childs[i];
-    }
-    child->childs[child_index + T - 1] = neighbour->childs[T - 1];
-    // Save and free
-    node_write(db, child);        //   Order
-    node_destroy(db, neighbour);  //  is very
-    node_write(db, node);         // important
-    return child;
+static void epoch_leave() {
+    if (--tree_op->reading == 0)
+        atomic_store_explicit(&tree_op->epoch, EPOCH_IDLE, memory_order_release);
 }
 
-struct Chunk *fix_child(struct DB *db, struct Chunk *node, int index) {
-    //printf("fix child func\n");
-    struct Chunk *child = node_get(db, node->childs[index]);
-    //printf("child.offset == %d, child.n == %d\n", child->offset, child->n);
-    if (child->n >= T) {
-        return child;
-    } else {
-        struct Chunk *left = NULL, *right = NULL;
-        if (index > 0) {
-            left = node_get(db, node->childs[index - 1]);
-            //printf("left.offset == %d, left.n == %d\n", left->offset, left->n);
-            if (left->n >= T) {
-                return exchange(db, node, index - 1, left, child, false);
+// Advance the epoch if every reading thread has seen it, and free what
+// is old enough
+static void epoch_collect(struct Tree_Op *op) {
+    pthread_mutex_lock(&epoch_lock);
+    size_t epoch = atomic_load(&epoch_global);
+    bool seen = true;
+    for (struct Tree_Op *curr = epoch_threads; curr && seen; curr = curr->next) {
+        const size_t local = atomic_load(&curr->epoch);
+        seen = local == EPOCH_IDLE || local == epoch;
+    }
+    if (seen)
+        atomic_store(&epoch_global, ++epoch);
+    retire_drain(&epoch_orphans, epoch);
+    pthread_mutex_unlock(&epoch_lock);
+    retire_drain(&op->limbo, epoch);
+}
+
+// Free ptr with release once no reader can reach it; it must already be
+// unlinked from everything readers follow
+static void epoch_retire(void *ptr, void (*release)(void *)) {
+    if (!ptr)
+        return;
+    struct Tree_Op *op = thread_op();
+    retire_push(&op->limbo, (struct Retired) {ptr, release, atomic_load(&epoch_global)});
+    if (op->limbo.count >= op->collect_at) {
+        epoch_collect(op);
+        op->collect_at = op->limbo.count + EPOCH_BATCH;
+    }
+}
+
+// Free what the thread retired, as far as other readers allow
+static void epoch_flush() {
+    for (int i = 0; i < 3 && tree_op && tree_op->limbo.count > 0; i++)
+        epoch_collect(tree_op);
+}
+
+static void node_release(void *node) {
+    node_free((struct Chunk *) node);
+}
+
+static bool op_active() {
+    return tree_op && tree_op->depth > 0;
+}
+
+// Entries moved between nodes may still point into a replaced buffer
+// until the operation ends, and optimistic readers until they are done
+static void op_retire(void *buf) {
+    epoch_retire(buf, &free);
+}
+
+// Keep the chunk cached until the operation ends. Called under the cache lock.
+static void node_use(struct Chunk *node) {
+    if (!op_active())
+        return;
+    atomic_fetch_add(&node->users, 1);
+    ptr_list_push(&tree_op->used, node);
+}
+
+static void node_unuse(struct Chunk *node) {
+    if (atomic_fetch_sub(&node->users, 1) == NODE_DETACHED + 1)
+        epoch_retire(node, &node_release);
+}
+
+// Latch the chunk for the operation. Returns false if it already holds it.
+static bool node_latch(struct Chunk *node, bool exclusive) {
+    struct Ptr_List *latched = &tree_op->latched;
+    for (size_t i = 0; i < latched->count; i++) {
+        if (latched->items[i] == node)
+            return false;
+    }
+    if (exclusive) {
+        pthread_rwlock_wrlock(&node->latch);
+        atomic_fetch_add(&node->version, 1);
+    } else {
+        pthread_rwlock_rdlock(&node->latch);
+    }
+    ptr_list_push(latched, node);
+    return true;
+}
+
+// Shared latch only if it is free right away
+static bool node_try_latch(struct Chunk *node) {
+    if (pthread_rwlock_tryrdlock(&node->latch))
+        return false;
+    ptr_list_push(&tree_op->latched, node);
+    return true;
+}
+
+// An odd version on a latched chunk means the latch is exclusive
+static void latch_release(struct Chunk *node) {
+    if (atomic_load_explicit(&node->version, memory_order_relaxed) & 1)
+        atomic_fetch_add_explicit(&node->version, 1, memory_order_release);
+    pthread_rwlock_unlock(&node->latch);
+}
+
+static void node_unlatch(struct Chunk *node) {
+    struct Ptr_List *latched = &tree_op->latched;
+    for (size_t i = latched->count; i-- > 0;) {
+        if (latched->items[i] == node) {
+            latched->items[i] = latched->items[--latched->count];
+            latch_release(node);
+            return;
+        }
+    }
+}
+
+static void node_unlatch_all() {
+    struct Ptr_List *latched = &tree_op->latched;
+    while (latched->count > 0)
+        latch_release((struct Chunk *) latched->items[--latched->count]);
+}
+
+static void chunk_unreserve(struct DB *db);
+
+static void tree_begin(struct DB *db) {
+    if (thread_op()->depth++ == 0)
+        epoch_enter();
+}
+
+static void tree_end(struct DB *db) {
+    struct Tree_Op *op = tree_op;
+    if (--op->depth > 0)
+        return;
+    node_unlatch_all();
+    for (size_t i = 0; i < op->used.count; i++)
+        node_unuse((struct Chunk *) op->used.items[i]);
+    op->used.count = 0;
+    if (op->reserved > 0)
+        chunk_unreserve(db);
+    epoch_leave();
+}
+
+// Single-key operations and cursors share the tree
+static void tree_enter(struct DB *db) {
+    pthread_rwlock_rdlock(&db->tree_lock);
+    tree_begin(db);
+}
+
+static void tree_leave(struct DB *db) {
+    tree_end(db);
+    pthread_rwlock_unlock(&db->tree_lock);
+}
+
+// Operations over the whole tree change chunks without latching them.
+// They make the sequence of the tree odd while they run, so that
+// optimistic readers do not trust what they read meanwhile.
+static void tree_lock_exclusive(struct DB *db) {
+    pthread_rwlock_wrlock(&db->tree_lock);
+    atomic_fetch_add(&db->tree_seq, 1);
+}
+
+static void tree_unlock_exclusive(struct DB *db) {
+    atomic_fetch_add_explicit(&db->tree_seq, 1, memory_order_release);
+    pthread_rwlock_unlock(&db->tree_lock);
+}
+
+
+// Write Ahead Log
+
+// The log is a sequence of segment files <log>.<seq>. Each starts with a
+// Log_Segment_Header and holds whole records, each framed by its size
+// and the CRC32C of the size and the record
+//     LSN | op | key.size | key [| data.size | data].
+// A frame that is cut short or fails its CRC is the torn tail, which
+// ends the segment for recovery. Segments are preallocated to
+// LOG_SEGMENT_SIZE; once full, a segment is sealed with a sparse index of
+// (LSN, offset) pairs and a footer, and cut to its length.
+// A checkpoint seals the current segment and starts a new one with its
+// record. Once that is on disk the older segments are deleted, so the
+// log holds the last checkpoint and what was logged since. Recovery finds
+// the newest checkpoint by looking at segment headers and uses the index
+// of sealed segments to skip what the checkpoint covers.
+
+// Operations serialize their records into a lock-free ring buffer and
+// return; a background writer thread appends the ring to the segment and
+// syncs according to the commit policy, so that many operations share a
+// single write+fdatasync. Records too large for the ring and checkpoint
+// records bypass it.
+
+#define LOG_MAGIC 0xdeadface
+#define LOG_SEGMENT_SIZE (16 * 1024 * 1024)
+#define LOG_INDEX_STEP (64 * 1024)
+#define LOG_RING_SIZE (1024 * 1024)
+#define LOG_IDLE_WAIT 100
+
+static size_t now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static int logwritev(struct Log *log, struct iovec *iov, int count, size_t offset) {
+    while (count > 0) {
+        ssize_t part = pwritev(log->file, iov, count, offset);
+        if (part < 0)
+            return -1;
+        iov_consume(&iov, &count, part);
+        offset += part;
+    }
+    return 0;
+}
+
+static int logread(int file, void *dst, size_t size, off_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t part = pread(file, (char *) dst + done, size - done, offset + done);
+        if (part <= 0)
+            return -1;
+        done += part;
+    }
+    return 0;
+}
+
+static void log_raise_durable(struct Log *log, unsigned LSN) {
+    if (LSN > atomic_load(&log->durable_LSN))
+        atomic_store(&log->durable_LSN, LSN);
+}
+
+static char *segment_path(const char *path, size_t seq) {
+    char *name = (char *) malloc(strlen(path) + 24);
+    sprintf(name, "%s.%zu", path, seq);
+    return name;
+}
+
+static int seq_cmp(const void *a, const void *b) {
+    const size_t x = *(const size_t *) a, y = *(const size_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Sequence numbers of the segments of the log at path, in order
+static size_t *log_segments(const char *path, size_t *count) {
+    const char *slash = strrchr(path, '/');
+    char *dir_name = slash ? strndup(path, slash - path + 1) : strdup(".");
+    const char *base = slash ? slash + 1 : path;
+    const size_t base_len = strlen(base);
+    size_t *seqs = NULL, cap = 0;
+    *count = 0;
+    DIR *dir = opendir(dir_name);
+    free(dir_name);
+    if (!dir)
+        return NULL;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        const char *name = entry->d_name;
+        if (strncmp(name, base, base_len) != 0 || name[base_len] != '.' || !isdigit(name[base_len + 1]))
+            continue;
+        char *end;
+        const size_t seq = strtoul(name + base_len + 1, &end, 10);
+        if (*end)
+            continue;
+        if (*count == cap) {
+            cap = cap ? 2 * cap : 8;
+            seqs = (size_t *) realloc(seqs, cap * sizeof(*seqs));
+        }
+        seqs[(*count)++] = seq;
+    }
+    closedir(dir);
+    if (seqs)
+        qsort(seqs, *count, sizeof(*seqs), &seq_cmp);
+    return seqs;
+}
+
+// Delete the segments of the log at path numbered below `below`
+static void log_drop(const char *path, size_t below) {
+    size_t count;
+    size_t *seqs = log_segments(path, &count);
+    for (size_t i = 0; i < count && seqs[i] < below; i++) {
+        char *name = segment_path(path, seqs[i]);
+        unlink(name);
+        free(name);
+    }
+    free(seqs);
+}
+
+void log_remove(const char *path) {
+    log_drop(path, (size_t) -1);
+}
+
+// Make a new or renamed file in the directory of path durable
+static void dir_sync(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char *dir = slash ? strndup(path, slash - path + 1) : strdup(".");
+    const int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+// Write the index and the footer after the records of the current
+// segment, cut it there and close it
+static void log_seal(struct Log *log) {
+    if (log->file < 0)
+        return;
+    const size_t index_size = log->index_count * sizeof(*log->index);
+    struct Log_Segment_Footer footer = {log->segment_end, log->index_count, log->segment_LSN, 0, LOG_MAGIC};
+    footer.crc = crc32c(crc32c(0, log->index, index_size), &footer, offsetof(struct Log_Segment_Footer, crc));
+    struct iovec iov[2] = {{log->index, index_size}, {&footer, sizeof(footer)}};
+    logwritev(log, iov, 2, log->segment_end);
+    ftruncate(log->file, log->segment_end + index_size + sizeof(footer));
+    fdatasync(log->file);
+    close(log->file);
+    log->file = -1;
+}
+
+// Seal the current segment and start the next one, whose first record
+// has the given LSN
+static void log_next_segment(struct Log *log, unsigned LSN, bool checkpoint) {
+    log_seal(log);
+    char *name = segment_path(log->path, ++log->seq);
+    log->file = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    free(name);
+    // Allocated up front so that appends do not have to sync metadata
+    fallocate(log->file, 0, 0, LOG_SEGMENT_SIZE);
+    struct Log_Segment_Header header = {LOG_MAGIC, checkpoint, log->seq, LSN};
+    pwrite(log->file, &header, sizeof(header), 0);
+    dir_sync(log->path);
+    log->segment_end = sizeof(header);
+    log->segment_LSN = LSN;
+    log->index_count = 0;
+}
+
+// Called for every record appended to the current segment; notes one
+// record in the index at least every LOG_INDEX_STEP bytes
+static void log_index(struct Log *log, unsigned LSN, size_t offset) {
+    log->segment_LSN = LSN;
+    if (log->index_count && offset - log->index[log->index_count - 1].offset < LOG_INDEX_STEP)
+        return;
+    if (log->index_count == log->index_cap) {
+        log->index_cap *= 2;
+        log->index = (struct Log_Index_Entry *) realloc(log->index, log->index_cap * sizeof(*log->index));
+    }
+    log->index[log->index_count++] = (struct Log_Index_Entry) {LSN, offset};
+}
+
+// Whether a record of the given size starts a new segment
+static bool log_full(struct Log *log, size_t offset, size_t size) {
+    return log->file < 0
+           || (offset + size > LOG_SEGMENT_SIZE && offset > sizeof(struct Log_Segment_Header));
+}
+
+static void log_peek(struct Log *log, size_t pos, void *dst, size_t size) {
+    const size_t start = pos & (log->ring_size - 1);
+    const size_t first = size < log->ring_size - start ? size : log->ring_size - start;
+    memcpy(dst, log->ring + start, first);
+    memcpy((char *) dst + first, log->ring, size - first);
+}
+
+// Append ring positions [from, to) to the current segment and sync it
+static void log_append(struct Log *log, size_t from, size_t to) {
+    if (from == to)
+        return;
+    const size_t mask = log->ring_size - 1;
+    const size_t offset = log->segment_end;
+    struct iovec iov[2];
+    int count = 1;
+    iov[0].iov_base = log->ring + (from & mask);
+    iov[0].iov_len = to - from;
+    if ((from & mask) + (to - from) > log->ring_size) {
+        iov[0].iov_len = log->ring_size - (from & mask);
+        iov[1].iov_base = log->ring;
+        iov[1].iov_len = to - from - iov[0].iov_len;
+        count = 2;
+    }
+    log->segment_end += to - from;
+    if (log->uring) {
+        // Linked so that the sync starts only after the append completed
+        int res[2];
+        struct io_uring_sqe *sqe = uring_prep(log->uring, IORING_OP_WRITEV, log->file, iov, count, offset);
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = 0;
+        sqe = uring_prep(log->uring, IORING_OP_FSYNC, log->file, NULL, 0, 0);
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->user_data = 1;
+        if (uring_run(log->uring, 2, res) == 0 && res[0] == (int) (to - from) && res[1] == 0)
+            return;
+        // Finish a short or failed append synchronously
+        const size_t done = res[0] > 0 ? res[0] : 0;
+        struct iovec *rest = iov;
+        iov_consume(&rest, &count, done);
+        logwritev(log, rest, count, offset + done);
+    } else {
+        logwritev(log, iov, count, offset);
+    }
+    fdatasync(log->file);
+}
+
+// Append ring positions [from, to), moving on to a new segment before a
+// record that does not fit in the current one
+static void log_write_ring(struct Log *log, size_t from, size_t to) {
+    size_t start = from;
+    for (size_t pos = from; pos < to;) {
+        struct Log_Frame frame;
+        unsigned LSN;
+        log_peek(log, pos, &frame, sizeof(frame));
+        log_peek(log, pos + sizeof(frame), &LSN, sizeof(LSN));
+        const size_t size = sizeof(frame) + frame.size;
+        if (log_full(log, log->segment_end + (pos - start), size)) {
+            log_append(log, start, pos);
+            log_next_segment(log, LSN, false);
+            start = pos;
+        }
+        log_index(log, LSN, log->segment_end + (pos - start));
+        pos += size;
+    }
+    log_append(log, start, to);
+}
+
+static void *log_writer(void *arg) {
+    struct Log *log = (struct Log *) arg;
+    pthread_mutex_lock(&log->lock);
+    for (;;) {
+        // Read the LSN before the ring position it is published after
+        const unsigned LSN = atomic_load_explicit(&log->buffered_LSN, memory_order_acquire);
+        const size_t committed = atomic_load_explicit(&log->committed, memory_order_acquire);
+        const size_t tail = atomic_load_explicit(&log->tail, memory_order_relaxed);
+        const size_t pending = committed - tail;
+        bool due = log->waiters || log->stop || pending >= log->ring_size / 2;
+        switch (log->policy) {
+            case DB_COMMIT_INTERVAL:
+                due = due || now_ms() - log->last_sync >= log->interval;
+                break;
+            case DB_COMMIT_BYTES:
+                due = due || pending >= log->bytes;
+                break;
+            default:
+                due = true;
+        }
+        if (pending && due) {
+            pthread_mutex_unlock(&log->lock);
+            log_write_ring(log, tail, committed);
+            atomic_store_explicit(&log->tail, committed, memory_order_release);
+            pthread_mutex_lock(&log->lock);
+            log_raise_durable(log, LSN);
+            log->last_sync = now_ms();
+            log->syncs++;
+            pthread_cond_broadcast(&log->durable);
+            continue;
+        }
+        if (!pending) {
+            // Everything published before LSN was read is on disk
+            log_raise_durable(log, LSN);
+            if (log->waiters)
+                pthread_cond_broadcast(&log->durable);
+            if (log->stop)
+                break;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        size_t wait = log->policy == DB_COMMIT_INTERVAL && log->interval ? log->interval : LOG_IDLE_WAIT;
+        deadline.tv_sec += wait / 1000;
+        deadline.tv_nsec += (wait % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&log->wake, &log->lock, &deadline);
+    }
+    pthread_mutex_unlock(&log->lock);
+    return NULL;
+}
+
+// Appends go to a segment numbered after every existing one, created
+// with the first record
+struct Log *log_open(char *filename, const struct DBC *conf) {
+    struct Log *log = (struct Log *) malloc(sizeof(*log));
+    log->file = -1;
+    log->path = strdup(filename);
+    size_t count;
+    size_t *seqs = log_segments(filename, &count);
+    log->seq = count ? seqs[count - 1] : 0;
+    free(seqs);
+    log->segment_end = 0;
+    log->segment_LSN = 0;
+    log->index_cap = 64;
+    log->index = (struct Log_Index_Entry *) malloc(log->index_cap * sizeof(*log->index));
+    log->index_count = 0;
+    atomic_init(&log->written, 0);
+    log->ring_size = LOG_RING_SIZE;
+    while (log->ring_size < 8 * conf->chunk_size)
+        log->ring_size *= 2;
+    log->ring = (char *) malloc(log->ring_size);
+    atomic_init(&log->head, 0);
+    atomic_init(&log->committed, 0);
+    atomic_init(&log->tail, 0);
+    atomic_init(&log->buffered_LSN, 0);
+    atomic_init(&log->durable_LSN, 0);
+    log->policy = conf->commit_policy;
+    log->interval = conf->commit_interval;
+    log->bytes = conf->commit_bytes;
+    log->last_sync = now_ms();
+    log->syncs = 0;
+    log->waiters = 0;
+    log->stop = false;
+    log->uring = conf->use_uring ? uring_open(LOG_URING_ENTRIES) : NULL;
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_cond_init(&log->wake, NULL);
+    pthread_cond_init(&log->durable, NULL);
+    pthread_create(&log->writer, NULL, &log_writer, log);
+    return log;
+}
+
+static void log_wake(struct Log *log) {
+    pthread_mutex_lock(&log->lock);
+    pthread_cond_signal(&log->wake);
+    pthread_mutex_unlock(&log->lock);
+}
+
+// Block until the record with the given LSN is on disk
+void log_wait(struct Log *log, unsigned LSN) {
+    if (atomic_load(&log->durable_LSN) >= LSN)
+        return;
+    pthread_mutex_lock(&log->lock);
+    log->waiters++;
+    pthread_cond_signal(&log->wake);
+    while (atomic_load(&log->durable_LSN) < LSN)
+        pthread_cond_wait(&log->durable, &log->lock);
+    log->waiters--;
+    pthread_mutex_unlock(&log->lock);
+}
+
+// Block until everything published to the ring is on disk
+void log_flush(struct Log *log) {
+    pthread_mutex_lock(&log->lock);
+    log->waiters++;
+    pthread_cond_signal(&log->wake);
+    while (atomic_load(&log->tail) != atomic_load(&log->committed))
+        pthread_cond_wait(&log->durable, &log->lock);
+    log->waiters--;
+    pthread_mutex_unlock(&log->lock);
+}
+
+// Called once per operation, after its records are published
+void log_commit(struct Log *log, unsigned LSN) {
+    switch (log->policy) {
+        case DB_COMMIT_INTERVAL:
+            // The writer syncs on its own timer
+            break;
+        case DB_COMMIT_BYTES:
+            if (atomic_load(&log->committed) - atomic_load(&log->tail) >= log->bytes)
+                log_wake(log);
+            break;
+        default:
+            log_wait(log, LSN);
+    }
+}
+
+void log_close(struct Log *log) {
+    pthread_mutex_lock(&log->lock);
+    log->stop = true;
+    pthread_cond_signal(&log->wake);
+    pthread_mutex_unlock(&log->lock);
+    pthread_join(log->writer, NULL);
+    pthread_mutex_destroy(&log->lock);
+    pthread_cond_destroy(&log->wake);
+    pthread_cond_destroy(&log->durable);
+    uring_close(log->uring);
+    log_seal(log);
+    free(log->path);
+    free(log->index);
+    free(log->ring);
+    free(log);
+}
+
+// Reserve ring space; producers never take a lock unless the ring is full
+static size_t log_reserve(struct Log *log, size_t size) {
+    size_t head = atomic_load(&log->head);
+    for (;;) {
+        if (head + size - atomic_load_explicit(&log->tail, memory_order_acquire) > log->ring_size) {
+            log_wake(log);
+            sched_yield();
+            head = atomic_load(&log->head);
+        } else if (atomic_compare_exchange_weak(&log->head, &head, head + size)) {
+            return head;
+        }
+    }
+}
+
+static void log_copy(struct Log *log, size_t pos, const void *src, size_t size) {
+    const size_t start = pos & (log->ring_size - 1);
+    const size_t first = size < log->ring_size - start ? size : log->ring_size - start;
+    // Empty keys and values may have no buffer at all
+    if (first)
+        memcpy(log->ring + start, src, first);
+    if (size > first)
+        memcpy(log->ring, (const char *) src + first, size - first);
+}
+
+// Publish reserved space in reservation order, then raise buffered_LSN
+static void log_publish(struct Log *log, size_t start, size_t size, unsigned LSN) {
+    while (atomic_load_explicit(&log->committed, memory_order_acquire) != start)
+        sched_yield();
+    atomic_store_explicit(&log->committed, start + size, memory_order_release);
+    unsigned prev = atomic_load(&log->buffered_LSN);
+    while (prev < LSN && !atomic_compare_exchange_weak(&log->buffered_LSN, &prev, LSN))
+        ;
+}
+
+// Frame of a record and the pieces of the record in iov; returns their count
+static int record_frame(struct Record *record, struct Log_Frame *frame, struct iovec *iov) {
+    int count = 0;
+    iov[count++] = (struct iovec) {&record->LSN, sizeof(record->LSN)};
+    iov[count++] = (struct iovec) {&record->op, sizeof(record->op)};
+    iov[count++] = (struct iovec) {&record->key.size, sizeof(record->key.size)};
+    iov[count++] = (struct iovec) {record->key.data, record->key.size};
+    if (record->op != 'd') {
+        iov[count++] = (struct iovec) {&record->data.size, sizeof(record->data.size)};
+        iov[count++] = (struct iovec) {record->data.data, record->data.size};
+    }
+    frame->size = 0;
+    for (int i = 0; i < count; i++)
+        frame->size += iov[i].iov_len;
+    frame->crc = crc32c(0, &frame->size, sizeof(frame->size));
+    for (int i = 0; i < count; i++)
+        frame->crc = crc32c(frame->crc, iov[i].iov_base, iov[i].iov_len);
+    return count;
+}
+
+// Write a record straight to the current segment after draining the ring
+static void log_write_direct(struct Log *log, struct Record *record) {
+    struct Log_Frame frame;
+    struct iovec iov[7];
+    const int count = record_frame(record, &frame, iov + 1) + 1;
+    iov[0] = (struct iovec) {&frame, sizeof(frame)};
+    log_flush(log);
+    const size_t size = sizeof(frame) + frame.size;
+    if (log_full(log, log->segment_end, size))
+        log_next_segment(log, record->LSN, false);
+    log_index(log, record->LSN, log->segment_end);
+    logwritev(log, iov, count, log->segment_end);
+    log->segment_end += size;
+    fdatasync(log->file);
+    pthread_mutex_lock(&log->lock);
+    log_raise_durable(log, record->LSN);
+    pthread_mutex_unlock(&log->lock);
+}
+
+void log_write(struct Log *log, struct Record *record) {
+    struct Log_Frame frame;
+    struct iovec iov[6];
+    const int count = record_frame(record, &frame, iov);
+    const size_t size = sizeof(frame) + frame.size;
+    atomic_fetch_add(&log->written, size);
+    if (size > log->ring_size / 2) {
+        log_write_direct(log, record);
+        return;
+    }
+    const size_t start = log_reserve(log, size);
+    size_t pos = start;
+    log_copy(log, pos, &frame, sizeof(frame));
+    pos += sizeof(frame);
+    for (int i = 0; i < count; i++) {
+        log_copy(log, pos, iov[i].iov_base, iov[i].iov_len);
+        pos += iov[i].iov_len;
+    }
+    log_publish(log, start, size, record->LSN);
+}
+
+// Start a new segment with the checkpoint record. With drop, the older
+// segments are deleted once the record is on disk; until then they and
+// the previous checkpoint stay valid. Called with nothing being logged.
+void log_checkpoint(struct Log *log, struct Record *record, bool drop) {
+    log_flush(log);
+    log_next_segment(log, record->LSN, true);
+    log_write_direct(log, record);
+    atomic_store(&log->written, 0);
+    if (drop)
+        log_drop(log->path, log->seq);
+}
+
+// Open a segment for reading; -1 if it is missing or not a segment
+static int segment_open(const char *path, size_t seq, struct Log_Segment_Header *header) {
+    char *name = segment_path(path, seq);
+    const int file = open(name, O_RDONLY);
+    free(name);
+    if (file >= 0 && (logread(file, header, sizeof(*header), 0) < 0
+                      || header->magic != LOG_MAGIC || header->seq != seq)) {
+        close(file);
+        return -1;
+    }
+    return file;
+}
+
+// Where to start reading a segment for the records after LSN: the last
+// indexed record at or before it in a sealed segment, the first record
+// otherwise. -1 if the segment is sealed and holds nothing after LSN.
+off_t log_seek(int file, unsigned LSN) {
+    struct Log_Segment_Footer footer;
+    const off_t size = lseek(file, 0, SEEK_END);
+    const off_t start = sizeof(struct Log_Segment_Header);
+    if (size < start + (off_t) sizeof(footer)
+        || logread(file, &footer, sizeof(footer), size - sizeof(footer)) < 0
+        || footer.magic != LOG_MAGIC
+        || footer.end + footer.count * sizeof(struct Log_Index_Entry) + sizeof(footer) != (size_t) size)
+        return start;
+    const size_t index_size = footer.count * sizeof(struct Log_Index_Entry);
+    struct Log_Index_Entry *index = (struct Log_Index_Entry *) malloc(index_size);
+    off_t offset = start;
+    if (logread(file, index, index_size, footer.end) == 0
+        && crc32c(crc32c(0, index, index_size), &footer, offsetof(struct Log_Segment_Footer, crc)) == footer.crc) {
+        if (footer.last_LSN <= LSN) {
+            offset = -1;
+        } else {
+            size_t low = 0, high = footer.count;
+            while (low < high) {
+                const size_t mid = (low + high) / 2;
+                if (index[mid].LSN <= LSN)
+                    low = mid + 1;
+                else
+                    high = mid;
+            }
+            if (low)
+                offset = index[low - 1].offset;
+        }
+    }
+    free(index);
+    return offset;
+}
+
+void record_free(struct Record *record) {
+    if (record) {
+        free(record->key.data);
+        if (record->op != 'd')
+            free(record->data.data);
+        free(record);
+    }
+}
+
+// Take `size` bytes of a payload being parsed
+static bool payload_take(const char **p, const char *end, void *dst, size_t size) {
+    if ((size_t) (end - *p) < size)
+        return false;
+    memcpy(dst, *p, size);
+    *p += size;
+    return true;
+}
+
+// Read the record framed at *offset and move past it. Returns NULL at
+// the end of the segment or on a torn record.
+struct Record *log_read_next(int file, off_t *offset) {
+    struct Log_Frame frame;
+    struct stat file_stat;
+    if (logread(file, &frame, sizeof(frame), *offset) < 0 || fstat(file, &file_stat) < 0
+        || frame.size > file_stat.st_size - *offset - sizeof(frame))
+        return NULL;
+    char *payload = (char *) malloc(frame.size);
+    if (logread(file, payload, frame.size, *offset + sizeof(frame)) < 0
+        || crc32c(crc32c(0, &frame.size, sizeof(frame.size)), payload, frame.size) != frame.crc) {
+        free(payload);
+        return NULL;
+    }
+    struct Record *record = (struct Record *) malloc(sizeof(*record));
+    record->key.data = record->data.data = NULL;
+    record->op = 'i';
+    const char *p = payload, *end = payload + frame.size;
+    bool whole = payload_take(&p, end, &record->LSN, sizeof(record->LSN))
+                 && payload_take(&p, end, &record->op, sizeof(record->op))
+                 && payload_take(&p, end, &record->key.size, sizeof(record->key.size))
+                 && (record->key.data = malloc(record->key.size))
+                 && payload_take(&p, end, record->key.data, record->key.size);
+    if (whole && record->op != 'd')
+        whole = payload_take(&p, end, &record->data.size, sizeof(record->data.size))
+                && (record->data.data = malloc(record->data.size))
+                && payload_take(&p, end, record->data.data, record->data.size);
+    free(payload);
+    if (!whole) {
+        record_free(record);
+        return NULL;
+    }
+    *offset += sizeof(frame) + frame.size;
+    return record;
+}
+
+// Cache LRU
+
+// Open-addressing hash table (linear probing) over chunk offsets and
+// an intrusive doubly-linked LRU list through the cached chunks.
+
+static size_t offset_slot(size_t offset, unsigned int bits) {
+    return (size_t) ((offset * 0x9E3779B97F4A7C15ULL) >> (64 - bits));
+}
+
+static size_t cache_slot(struct DB_Cache *cache, size_t offset) {
+    return offset_slot(offset, cache->table_bits);
+}
+
+static void lru_unlink(struct DB_Cache *cache, struct Chunk *node) {
+    if (node->lru_prev)
+        node->lru_prev->lru_next = node->lru_next;
+    else
+        cache->head = node->lru_next;
+    if (node->lru_next)
+        node->lru_next->lru_prev = node->lru_prev;
+    else
+        cache->tail = node->lru_prev;
+    node->lru_prev = node->lru_next = NULL;
+}
+
+static void lru_push_front(struct DB_Cache *cache, struct Chunk *node) {
+    node->lru_prev = NULL;
+    node->lru_next = cache->head;
+    if (cache->head)
+        cache->head->lru_prev = node;
+    else
+        cache->tail = node;
+    cache->head = node;
+}
+
+static struct Chunk *cache_lookup(struct DB_Cache *cache, size_t offset) {
+    const size_t mask = ((size_t) 1 << cache->table_bits) - 1;
+    for (size_t i = cache_slot(cache, offset); cache->table[i]; i = (i + 1) & mask) {
+        if (cache->table[i]->offset == offset)
+            return cache->table[i];
+    }
+    return NULL;
+}
+
+// Lookup without the cache lock, for optimistic readers. Tables only grow
+// and are published before their size, so the probe stays in bounds; an
+// entry being shifted back may be missed, so a miss is only a hint. A
+// chunk found may be leaving the cache, which its version tells.
+static struct Chunk *cache_peek(struct DB_Cache *cache, size_t offset) {
+    const unsigned int bits = __atomic_load_n(&cache->table_bits, __ATOMIC_ACQUIRE);
+    struct Chunk **table = __atomic_load_n(&cache->table, __ATOMIC_ACQUIRE);
+    const size_t mask = ((size_t) 1 << bits) - 1;
+    size_t i = offset_slot(offset, bits);
+    for (size_t probes = 0; probes <= mask; probes++, i = (i + 1) & mask) {
+        struct Chunk *node = __atomic_load_n(&table[i], __ATOMIC_ACQUIRE);
+        if (!node)
+            break;
+        if (__atomic_load_n(&node->offset, __ATOMIC_RELAXED) == offset)
+            return node;
+    }
+    return NULL;
+}
+
+static void cache_set(struct DB_Cache *cache, size_t i, struct Chunk *node) {
+    __atomic_store_n(&cache->table[i], node, __ATOMIC_RELEASE);
+}
+
+// The cache may outgrow its limit while chunks are dirty or in use;
+// keep the table at most half full
+static void cache_grow(struct DB_Cache *cache) {
+    const unsigned int bits = cache->table_bits + 1;
+    const size_t mask = ((size_t) 1 << bits) - 1;
+    struct Chunk **table = (struct Chunk **) calloc(mask + 1, sizeof(*table));
+    for (struct Chunk *curr = cache->head; curr; curr = curr->lru_next) {
+        size_t i = offset_slot(curr->offset, bits);
+        while (table[i])
+            i = (i + 1) & mask;
+        table[i] = curr;
+    }
+    op_retire(cache->table);
+    __atomic_store_n(&cache->table, table, __ATOMIC_RELEASE);
+    __atomic_store_n(&cache->table_bits, bits, __ATOMIC_RELEASE);
+}
+
+static void cache_insert(struct DB_Cache *cache, struct Chunk *node) {
+    if (2 * (cache->count + 1) > ((size_t) 1 << cache->table_bits))
+        cache_grow(cache);
+    const size_t mask = ((size_t) 1 << cache->table_bits) - 1;
+    size_t i = cache_slot(cache, node->offset);
+    while (cache->table[i])
+        i = (i + 1) & mask;
+    cache_set(cache, i, node);
+    lru_push_front(cache, node);
+    cache->count++;
+}
+
+// Backward-shift deletion keeps probe chains intact without tombstones.
+// An entry is copied back before its old slot is reused, so lock-free
+// lookups rarely miss it.
+static void cache_remove(struct DB_Cache *cache, struct Chunk *node) {
+    const size_t mask = ((size_t) 1 << cache->table_bits) - 1;
+    size_t i = cache_slot(cache, node->offset);
+    while (cache->table[i] != node)
+        i = (i + 1) & mask;
+    size_t j = i;
+    for (;;) {
+        size_t home;
+        do {
+            j = (j + 1) & mask;
+            if (!cache->table[j]) {
+                cache_set(cache, i, NULL);
+                lru_unlink(cache, node);
+                cache->count--;
+                return;
+            }
+            home = cache_slot(cache, cache->table[j]->offset);
+        } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+        cache_set(cache, i, cache->table[j]);
+        i = j;
+    }
+}
+
+void cache_init(struct DB *db) {
+    struct DB_Cache *cache = &db->cache;
+    cache->n = db->header.main_settings.mem_size / db->header.main_settings.chunk_size;
+    // A tree operation keeps a handful of chunks in use at once
+    if (cache->n < 8)
+        cache->n = 8;
+    cache->table_bits = 1;
+    while (((size_t) 1 << cache->table_bits) < 2 * cache->n)
+        cache->table_bits++;
+    cache->table = (struct Chunk **) calloc((size_t) 1 << cache->table_bits, sizeof(*cache->table));
+    cache->count = 0;
+    cache->dirty = 0;
+    cache->head = cache->tail = NULL;
+    for (int i = 0; i < CACHE_HIT_STRIPES; i++)
+        cache->hits[i].count = 0;
+    cache->misses = cache->evictions = cache->writes = 0;
+    cache->held = NULL;
+    cache->held_count = cache->held_cap = 0;
+    pthread_rwlock_init(&cache->lock, NULL);
+    pthread_mutex_init(&cache->pin_lock, NULL);
+}
+
+void cache_free(struct DB *db) {
+    struct Chunk *curr = db->cache.head;
+    while (curr) {
+        struct Chunk *tmp = curr;
+        curr = curr->lru_next;
+        node_free(tmp);
+    }
+    for (size_t i = 0; i < db->cache.held_count; i++)
+        free(db->cache.held[i].buf);
+    free(db->cache.held);
+    db->cache.held = NULL;
+    db->cache.held_count = db->cache.held_cap = 0;
+    free(db->cache.table);
+    db->cache.table = NULL;
+    db->cache.head = db->cache.tail = NULL;
+    db->cache.count = 0;
+    pthread_rwlock_destroy(&db->cache.lock);
+    pthread_mutex_destroy(&db->cache.pin_lock);
+}
+
+// Dirty chunks are never written outside of a checkpoint, so the file
+// always holds the tree as of the last checkpoint. If every cached chunk
+// is dirty or in use the cache grows past its limit until the next
+// checkpoint. Hits only mark a chunk as referenced, so they need no
+// exclusive lock; the scan gives referenced chunks a second chance by
+// moving them to the front. Called under the exclusive cache lock.
+// Users are checked first: no one can start using the chunk meanwhile,
+// and the last one to let go has marked it dirty by then. Chunks a
+// checkpoint is still writing back stay as well.
+static bool checkpoint_pending(struct DB *db, size_t offset);
+
+void cache_evict(struct DB *db) {
+    struct DB_Cache *cache = &db->cache;
+    struct Chunk *victim = cache->tail;
+    for (size_t scanned = 0; victim && scanned < cache->count; scanned++) {
+        struct Chunk *prev = victim->lru_prev;
+        if (atomic_exchange_explicit(&victim->referenced, false, memory_order_relaxed)) {
+            lru_unlink(cache, victim);
+            lru_push_front(cache, victim);
+        } else if (atomic_load(&victim->users) == 0 && !victim->dirty && !victim->pins
+                   && !checkpoint_pending(db, victim->offset)) {
+            cache_remove(cache, victim);
+            atomic_fetch_or(&victim->version, CHUNK_OBSOLETE);
+            epoch_retire(victim, &node_release);
+            cache->evictions++;
+            return;
+        }
+        victim = prev;
+    }
+}
+
+static int node_offset_cmp(const void *a, const void *b) {
+    const struct Chunk *x = *(struct Chunk * const *) a, *y = *(struct Chunk * const *) b;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+// Dirty chunks in file order
+struct Chunk **cache_dirty_list(struct DB *db, size_t *count) {
+    struct Chunk **dirty = (struct Chunk **) malloc((db->cache.dirty + 1) * sizeof(*dirty));
+    *count = 0;
+    for (struct Chunk *curr = db->cache.head; curr; curr = curr->lru_next) {
+        if (curr->dirty)
+            dirty[(*count)++] = curr;
+    }
+    qsort(dirty, *count, sizeof(*dirty), &node_offset_cmp);
+    return dirty;
+}
+
+// Drop a chunk from the cache. One still used by tree operations is
+// freed by the last of them. Called under the exclusive cache lock.
+void cache_remove_node(struct DB *db, struct Chunk *node) {
+    if (node->dirty)
+        db->cache.dirty--;
+    if (node->pins)
+        node_set_raw(db, node, NULL);
+    cache_remove(&db->cache, node);
+    atomic_fetch_or(&node->version, CHUNK_OBSOLETE);
+    if (atomic_fetch_or(&node->users, NODE_DETACHED) == 0)
+        epoch_retire(node, &node_release);
+}
+
+void node_add_to_cache(struct DB *db, struct Chunk *node) {
+    if (db->cache.count >= db->cache.n)
+        cache_evict(db);
+    cache_insert(&db->cache, node);
+}
+
+// Hits write nothing shared unless the chunk needs its referenced bit set
+static void cache_hit(struct DB_Cache *cache, struct Chunk *node) {
+    if (!atomic_load_explicit(&node->referenced, memory_order_relaxed))
+        atomic_store_explicit(&node->referenced, true, memory_order_relaxed);
+    atomic_fetch_add_explicit(&cache->hits[thread_op()->stripe].count, 1, memory_order_relaxed);
+}
+
+// Chunks are read without the cache lock; of two threads reading the same
+// chunk at once the first to insert it wins
+struct Chunk *node_get(struct DB *db, size_t offset) {
+    struct DB_Cache *cache = &db->cache;
+    pthread_rwlock_rdlock(&cache->lock);
+    struct Chunk *node = cache_lookup(cache, offset);
+    if (node) {
+        node_use(node);
+        pthread_rwlock_unlock(&cache->lock);
+        cache_hit(cache, node);
+        return node;
+    }
+    pthread_rwlock_unlock(&cache->lock);
+    struct Chunk *read = node_read(db, offset);
+    pthread_rwlock_wrlock(&cache->lock);
+    node = cache_lookup(cache, offset);
+    if (!node) {
+        node = read;
+        read = NULL;
+        cache->misses++;
+        node_add_to_cache(db, node);
+    }
+    node_use(node);
+    pthread_rwlock_unlock(&cache->lock);
+    node_free(read);
+    return node;
+}
+
+// Read the given chunks into the cache ahead of use. Chunks already
+// cached are skipped, mapped ones are only hinted to the kernel, the rest
+// are read as one batch. At most a quarter of the cache is filled so that
+// the chunks a caller is working with are not evicted. Those its operation
+// uses cannot be evicted either, so chunks read ahead would be in their
+// place: the batch shrinks as the operation comes to use the whole cache.
+void node_prefetch(struct DB *db, const size_t *offsets, size_t count) {
+    const size_t chunk_size = db->header.main_settings.chunk_size;
+    const size_t used = op_active() ? tree_op->used.count : 0;
+    size_t limit = db->cache.n / 4;
+    if (used + limit > db->cache.n)
+        limit = used < db->cache.n ? db->cache.n - used : 0;
+    struct Chunk **nodes = (struct Chunk **) malloc((count + 1) * sizeof(*nodes));
+    struct iovec *iov = (struct iovec *) malloc((count + 1) * sizeof(*iov));
+    struct DB_IO *io = (struct DB_IO *) malloc((count + 1) * sizeof(*io));
+    size_t reads = 0;
+    pthread_rwlock_rdlock(&db->cache.lock);
+    for (size_t i = 0; i < count && reads < limit; i++) {
+        if (cache_lookup(&db->cache, offsets[i]))
+            continue;
+        if (node_mappable(db, offsets[i])) {
+            madvise(db->map + (offsets[i] & ~(size_t) (getpagesize() - 1)), chunk_size, MADV_WILLNEED);
+            continue;
+        }
+        struct Chunk *node = node_alloc(offsets[i]);
+        node->raw_data = malloc(chunk_size);
+        iov[reads] = (struct iovec) {node->raw_data, chunk_size};
+        io[reads] = (struct DB_IO) {&iov[reads], 1, node->offset, false};
+        nodes[reads++] = node;
+    }
+    pthread_rwlock_unlock(&db->cache.lock);
+    db->submit(db, io, reads);
+    for (size_t i = 0; i < reads; i++)
+        node_parse_read(db, nodes[i]);
+    pthread_rwlock_wrlock(&db->cache.lock);
+    for (size_t i = 0; i < reads; i++) {
+        // The same offset may have been listed twice or read by another thread
+        if (cache_lookup(&db->cache, nodes[i]->offset)) {
+            node_free(nodes[i]);
+            continue;
+        }
+        db->cache.misses++;
+        node_add_to_cache(db, nodes[i]);
+    }
+    pthread_rwlock_unlock(&db->cache.lock);
+    free(io);
+    free(iov);
+    free(nodes);
+}
+
+// Basic operations on nodes
+
+// Chunks are handed out from the free-space map. Without a hint the search
+// goes on from the last allocation, so chunks taken in a row are laid out
+// in file order; with a hint it starts right after the given chunk, which
+// puts a new sibling or the next chunk of a chain next to it. Only chunks
+// the file holds are searched, and the file is grown once there are none.
+// Chunks are taken under the allocation lock; the map words are updated
+// atomically, so chunk_used needs no lock.
+//
+// An operation reserves the most chunks it may take before it changes the
+// tree, growing the file for them then, so that it gives up with nothing
+// changed rather than fail halfway when the file cannot grow or db_size is
+// reached. Reservations are counts, not chunks, so that the hints still
+// place what is taken. A chunk taken outside of a reservation only gets
+// one of the free chunks no operation has reserved, and offset 0, which
+// the header takes, stands for none left.
+
+static size_t chunk_index(struct DB *db, size_t offset) {
+    return (offset - db->header.chunks_offset) / db->header.main_settings.chunk_size;
+}
+
+static size_t freemap_bytes(struct DB *db) {
+    return (db->chunk_count + 63) / 64 * sizeof(uint64_t);
+}
+
+// Size the map after the header; chunks_offset must be set
+void freemap_init(struct DB *db) {
+    const struct DBC *conf = &db->header.main_settings;
+    const size_t chunks_offset = db->header.chunks_offset;
+    db->chunk_count = conf->db_size > chunks_offset ? (conf->db_size - chunks_offset) / conf->chunk_size : 0;
+    db->chunk_map = (uint64_t *) calloc(1, freemap_bytes(db));
+    db->alloc_next = 0;
+    db->chunks_free = 0;
+    db->chunks_reserved = 0;
+}
+
+// Place the first chunk after the header and the map, aligned to the chunk size
+void freemap_layout(struct DB *db) {
+    const struct DBC *conf = &db->header.main_settings;
+    const size_t map_bytes = (conf->db_size / conf->chunk_size + 63) / 64 * sizeof(uint64_t);
+    const size_t start = sizeof(db->header) + map_bytes;
+    db->header.chunks_offset = (start + conf->chunk_size - 1) / conf->chunk_size * conf->chunk_size;
+}
+
+// Chunks the file holds in full
+static size_t file_chunks(struct DB *db) {
+    const size_t chunks_offset = db->header.chunks_offset;
+    if (db->file_size <= chunks_offset)
+        return 0;
+    const size_t count = (db->file_size - chunks_offset) / db->header.main_settings.chunk_size;
+    return count < db->chunk_count ? count : db->chunk_count;
+}
+
+// Count the free chunks the file holds, after the map or the file size
+// were set as a whole
+void freemap_count(struct DB *db) {
+    const size_t end = file_chunks(db);
+    size_t used = 0;
+    for (size_t word = 0; word * 64 < end; word++) {
+        uint64_t bits = db->chunk_map[word];
+        if (end - word * 64 < 64)
+            bits &= ((uint64_t) 1 << (end - word * 64)) - 1;
+        used += __builtin_popcountll(bits);
+    }
+    db->chunks_free = end - used;
+}
+
+// Load the map saved next to the header of an existing file
+void freemap_open(struct DB *db) {
+    freemap_init(db);
+    db->read(db, (char *) db->chunk_map, freemap_bytes(db), sizeof(db->header));
+    struct stat file_stat;
+    fstat(db->file, &file_stat);
+    db->file_size = file_stat.st_size;
+    freemap_count(db);
+}
+
+bool chunk_used(struct DB *db, size_t offset) {
+    const size_t index = chunk_index(db, offset);
+    return __atomic_load_n(&db->chunk_map[index / 64], __ATOMIC_ACQUIRE) >> (index % 64) & 1;
+}
+
+// First free chunk index in [from, to), or to if there is none
+static size_t freemap_find(struct DB *db, size_t from, size_t to) {
+    while (from < to) {
+        const uint64_t free_bits = ~__atomic_load_n(&db->chunk_map[from / 64], __ATOMIC_RELAXED) >> (from % 64);
+        if (free_bits) {
+            const size_t index = from + __builtin_ctzll(free_bits);
+            return index < to ? index : to;
+        }
+        from = (from / 64 + 1) * 64;
+    }
+    return to;
+}
+
+// Make sure the file has room up to end, growing it geometrically.
+// False if the file system has no room for it.
+static bool file_reserve(struct DB *db, size_t end) {
+    if (end <= db->file_size)
+        return true;
+    const size_t db_size = db->header.main_settings.db_size;
+    size_t size = 2 * db->file_size;
+    if (size > db_size)
+        size = db_size;
+    if (size < end)
+        size = end;
+    int res = posix_fallocate(db->file, db->file_size, size - db->file_size);
+    // Room for the chunk itself may be left when the doubled size is not
+    if (res == ENOSPC && size > end) {
+        size = end;
+        res = posix_fallocate(db->file, db->file_size, size - db->file_size);
+    }
+    // Without fallocate support the writes past the end extend the file
+    if (res != 0 && res != EOPNOTSUPP)
+        return false;
+    db->file_size = size;
+    return true;
+}
+
+// Grow the file until it holds count free chunks. False if db_size or the
+// file system has no room for them. Chunks past the end of the file are
+// all free, so each one it grows by is.
+static bool chunks_room(struct DB *db, size_t count) {
+    // Chunks freed meanwhile only add to the count
+    const size_t free_chunks = __atomic_load_n(&db->chunks_free, __ATOMIC_RELAXED);
+    if (free_chunks >= count)
+        return true;
+    const size_t chunk_size = db->header.main_settings.chunk_size;
+    const size_t have = file_chunks(db), want = have + count - free_chunks;
+    if (want > db->chunk_count || !file_reserve(db, db->header.chunks_offset + want * chunk_size))
+        return false;
+    __atomic_add_fetch(&db->chunks_free, file_chunks(db) - have, __ATOMIC_RELAXED);
+    return true;
+}
+
+// Reserve count chunks for the running operation, leaving spare chunks
+// free beyond all reservations. False if the file cannot hold them.
+static bool chunk_reserve(struct DB *db, size_t count, size_t spare) {
+    if (count == 0)
+        return true;
+    pthread_mutex_lock(&db->alloc_lock);
+    const bool room = chunks_room(db, db->chunks_reserved + count + spare);
+    if (room) {
+        db->chunks_reserved += count;
+        tree_op->reserved += count;
+    }
+    pthread_mutex_unlock(&db->alloc_lock);
+    return room;
+}
+
+// Give back what the operation reserved and did not take
+static void chunk_unreserve(struct DB *db) {
+    pthread_mutex_lock(&db->alloc_lock);
+    db->chunks_reserved -= tree_op->reserved;
+    tree_op->reserved = 0;
+    pthread_mutex_unlock(&db->alloc_lock);
+}
+
+// Mark the free chunk at index used and return its offset, or 0 for the
+// index chunk_pick has when no chunk is left
+static size_t chunk_claim(struct DB *db, size_t index) {
+    if (index == db->chunk_count)
+        return 0;
+    __atomic_or_fetch(&db->chunk_map[index / 64], (uint64_t) 1 << (index % 64), __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&db->chunks_free, 1, __ATOMIC_RELAXED);
+    return db->header.chunks_offset + index * db->header.main_settings.chunk_size;
+}
+
+// A chunk freed earlier may still be cached. Called under the exclusive
+// cache lock, together with caching what replaces it.
+static void cache_drop_freed(struct DB *db, size_t offset) {
+    struct Chunk *freed = cache_lookup(&db->cache, offset);
+    if (freed)
+        cache_remove_node(db, freed);
+}
+
+// Free chunk index, preferably right after near when it is not 0, taken
+// from the operation's reservation if it has one. chunk_count if there is
+// no chunk left to take. Called under the allocation lock.
+static size_t chunk_pick(struct DB *db, size_t near) {
+    if (op_active() && tree_op->reserved > 0) {
+        tree_op->reserved--;
+        db->chunks_reserved--;
+    } else if (!chunks_room(db, db->chunks_reserved + 1)) {
+        return db->chunk_count;
+    }
+    const size_t end = file_chunks(db);
+    const size_t start = near ? chunk_index(db, near) + 1 : db->alloc_next;
+    size_t index = freemap_find(db, start, end);
+    if (index == end)
+        index = freemap_find(db, 0, end);
+    if (index == end)
+        return db->chunk_count;
+    db->alloc_next = index + 1;
+    return index;
+}
+
+// Take a free chunk that is not cached; 0 if there is none
+size_t chunk_take(struct DB *db, size_t near) {
+    pthread_mutex_lock(&db->alloc_lock);
+    const size_t offset = chunk_claim(db, chunk_pick(db, near));
+    if (offset) {
+        pthread_rwlock_wrlock(&db->cache.lock);
+        cache_drop_freed(db, offset);
+        pthread_rwlock_unlock(&db->cache.lock);
+    }
+    pthread_mutex_unlock(&db->alloc_lock);
+    return offset;
+}
+
+void chunk_release(struct DB *db, size_t offset) {
+    const size_t index = chunk_index(db, offset);
+    __atomic_and_fetch(&db->chunk_map[index / 64], ~((uint64_t) 1 << (index % 64)), __ATOMIC_RELEASE);
+    __atomic_add_fetch(&db->chunks_free, 1, __ATOMIC_RELAXED);
+}
+
+// Basic operations on nodes
+
+// A new empty leaf, cached; NULL if there is no chunk left for it, which
+// an operation that reserved the chunks it takes never sees
+struct Chunk *node_create(struct DB *db, size_t near) {
+    pthread_mutex_lock(&db->alloc_lock);
+    const size_t offset = chunk_claim(db, chunk_pick(db, near));
+    if (!offset) {
+        pthread_mutex_unlock(&db->alloc_lock);
+        return NULL;
+    }
+    struct Chunk *node = node_alloc(offset);
+    node->leaf = true;
+    node->LSN = lsn_current(db);
+    pthread_rwlock_wrlock(&db->cache.lock);
+    cache_drop_freed(db, node->offset);
+    node_use(node);
+    node_add_to_cache(db, node);
+    pthread_rwlock_unlock(&db->cache.lock);
+    pthread_mutex_unlock(&db->alloc_lock);
+    return node;
+}
+
+// A chunk still in the map and in the cache. A chunk latched by an
+// operation that got it before it was freed may no longer be.
+static bool node_live(struct DB *db, struct Chunk *node) {
+    return chunk_used(db, node->offset) && !(atomic_load(&node->users) & NODE_DETACHED);
+}
+
+// A freed chunk is never written back: it only leaves the map. Its cached
+// copy stays an empty leaf with a new LSN until the chunk is taken again;
+// its image is not changed, so it is obsolete to optimistic readers.
+void node_destroy(struct DB *db, struct Chunk *node) {
+    snapshot_keep(db, node);
+    atomic_fetch_or(&node->version, CHUNK_OBSOLETE);
+    chunk_release(db, node->offset);
+    node->leaf = true;
+    node->n = 0;
+    node->LSN = lsn_current(db);
+    if (node->dirty) {
+        node->dirty = false;
+        db->cache.dirty--;
+    }
+}
+
+// Overflow chunks
+
+// Values that do not fit in a node are split over a chain of chunks taken
+// next to each other. An overflow chunk looks like an empty leaf: its
+// childs[0] links to the next chunk of the chain, and the value bytes
+// follow it up to the end of the chunk. The chunks go through the cache
+// and the checkpoints like nodes.
+
+#define OVERFLOW_HEADER (sizeof(struct Chunk_Header) + sizeof(size_t))
+
+static size_t overflow_payload(struct DB *db) {
+    return db->header.main_settings.chunk_size - OVERFLOW_HEADER;
+}
+
+static bool value_overflows(struct DB *db, const struct DBT *key, const struct DBT *data) {
+    const size_t overflow_size = db->header.main_settings.overflow_size;
+    return key->size + data->size > db->header.main_settings.chunk_size / 4
+           || (overflow_size && data->size > overflow_size);
+}
+
+static void overflow_write(struct DB *db, struct Chunk *chunk, const char *part, size_t size, size_t next) {
+    snapshot_keep(db, chunk);
+    struct Chunk_Header header;
+    memset(&header, 0, sizeof(header));
+    header.leaf = true;
+    header.LSN = chunk->LSN = lsn_current(db);
+    chunk->childs[0] = next;
+    char *raw = (char *) calloc(1, db->header.main_settings.chunk_size);
+    *((struct Chunk_Header *) raw) = header;
+    memcpy(raw + sizeof(header), &next, sizeof(next));
+    memcpy(raw + OVERFLOW_HEADER, part, size);
+    chunk_seal(db, raw);
+    node_set_raw(db, chunk, raw);
+    if (!chunk->dirty) {
+        chunk->dirty = true;
+        db->cache.dirty++;
+    }
+}
+
+static size_t overflow_count(struct DB *db, const struct DBT *data) {
+    const size_t payload = overflow_payload(db);
+    return (data->size + payload - 1) / payload;
+}
+
+// Write the value out to the given chunks and link them
+static void overflow_fill(struct DB *db, struct Chunk **chain, size_t count,
+                          const struct DBT *data, struct Overflow_Ref *ref) {
+    const size_t payload = overflow_payload(db);
+    for (size_t i = 0; i < count; i++) {
+        const size_t from = i * payload;
+        const size_t size = data->size - from < payload ? data->size - from : payload;
+        overflow_write(db, chain[i], (char *) data->data + from, size, i + 1 < count ? chain[i + 1]->offset : 0);
+    }
+    ref->size = data->size;
+    ref->first = count ? chain[0]->offset : 0;
+}
+
+// Write the value out to a new chain
+void overflow_store(struct DB *db, const struct DBT *data, struct Overflow_Ref *ref) {
+    const size_t count = overflow_count(db, data);
+    struct Chunk **chain = (struct Chunk **) malloc((count + 1) * sizeof(*chain));
+    for (size_t i = 0; i < count; i++)
+        chain[i] = node_create(db, i ? chain[i - 1]->offset : 0);
+    overflow_fill(db, chain, count, data, ref);
+    free(chain);
+}
+
+// Chunks the value takes outside of its cell
+static size_t value_chunks(struct DB *db, const struct DBT *key, const struct DBT *data) {
+    return value_overflows(db, key, data) ? overflow_count(db, data) : 0;
+}
+
+// Free the chain of a value being replaced or deleted. A corrupt chunk
+// and the rest of the chain after it are left in use.
+void value_free(struct DB *db, const struct DBT *value) {
+    if (!(value->size & VALUE_OVERFLOW))
+        return;
+    struct Overflow_Ref ref;
+    memcpy(&ref, value->data, sizeof(ref));
+    for (size_t offset = ref.first; offset;) {
+        struct Chunk *chunk = node_get(db, offset);
+        if (chunk->corrupt)
+            return;
+        offset = chunk->childs[0];
+        node_destroy(db, chunk);
+    }
+}
+
+size_t value_size(const struct DBT *value) {
+    if (!(value->size & VALUE_OVERFLOW))
+        return value->size;
+    struct Overflow_Ref ref;
+    memcpy(&ref, value->data, sizeof(ref));
+    return ref.size;
+}
+
+// Hand the bytes [offset, offset + len) of a value to visit as they lie
+// in the chunks, and return how many there were, or -1 if the chain runs
+// into a corrupt chunk. Chunks of the chain before offset are still read
+// to follow the links.
+long value_stream(struct DB *db, const struct DBT *value, size_t offset, size_t len,
+                  void (*visit)(void *, void *, size_t), void *arg) {
+    const size_t size = value_size(value);
+    if (offset >= size)
+        return 0;
+    if (len > size - offset)
+        len = size - offset;
+    if (!(value->size & VALUE_OVERFLOW)) {
+        visit(arg, (char *) value->data + offset, len);
+        return len;
+    }
+    // The value may point into a chunk evicted by the reads below
+    struct Overflow_Ref ref;
+    memcpy(&ref, value->data, sizeof(ref));
+    const size_t payload = overflow_payload(db);
+    size_t chunk_offset = ref.first;
+    for (; offset >= payload; offset -= payload) {
+        struct Chunk *chunk = node_get(db, chunk_offset);
+        if (chunk->corrupt)
+            return -1;
+        chunk_offset = chunk->childs[0];
+    }
+    size_t done = 0;
+    while (done < len) {
+        struct Chunk *chunk = node_get(db, chunk_offset);
+        if (chunk->corrupt)
+            return -1;
+        const size_t part = payload - offset < len - done ? payload - offset : len - done;
+        visit(arg, (char *) chunk->raw_data + OVERFLOW_HEADER + offset, part);
+        done += part;
+        offset = 0;
+        chunk_offset = chunk->childs[0];
+    }
+    return done;
+}
+
+static void value_append(void *arg, void *part, size_t size) {
+    char **pos = (char **) arg;
+    memcpy(*pos, part, size);
+    *pos += size;
+}
+
+static void dbt_assign(struct DBT *dst, const void *data, size_t size) {
+    dst->data = realloc(dst->data, size + 1);
+    if (size > 0)
+        memcpy(dst->data, data, size);
+    dst->size = size;
+}
+
+// Copy the whole value into dst, reusing its buffer. 0, or DB_CORRUPT if
+// its chain runs into a corrupt chunk.
+int value_load(struct DB *db, const struct DBT *value, struct DBT *dst) {
+    const size_t size = value_size(value);
+    dst->data = realloc(dst->data, size + 1);
+    char *pos = (char *) dst->data;
+    const long copied = value_stream(db, value, 0, size, &value_append, &pos);
+    dst->size = size;
+    return copied < 0 ? DB_CORRUPT : 0;
+}
+
+// Get data by key
+
+// Keys are ordered like memcmp: bytes compare as unsigned and a proper
+// prefix sorts first. The byte comparison and the head scan have SIMD
+// versions picked once at startup by key_dispatch_init.
+
+static int bytes_cmp_scalar(const unsigned char *a, const unsigned char *b, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (a[i] != b[i])
+            return a[i] < b[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+// Number of heads below `head` and number not above it
+static void heads_range_scalar(const unsigned int *heads, int n, unsigned int head, int *below, int *upto) {
+    int lt = 0, le = 0;
+    for (int i = 0; i < n; i++) {
+        lt += heads[i] < head;
+        le += heads[i] <= head;
+    }
+    *below = lt;
+    *upto = le;
+}
+
+#if defined(__x86_64__)
+
+// SSE2 is part of x86-64; the SSE4.2 string instructions are slower than
+// a plain compare and movemask for finding the first differing byte
+static int bytes_cmp_sse2(const unsigned char *a, const unsigned char *b, size_t size) {
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        const __m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+        const __m128i vb = _mm_loadu_si128((const __m128i *) (b + i));
+        const unsigned int diff = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) ^ 0xffff;
+        if (diff) {
+            const size_t at = i + __builtin_ctz(diff);
+            return a[at] < b[at] ? -1 : 1;
+        }
+    }
+    return bytes_cmp_scalar(a + i, b + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static int bytes_cmp_avx2(const unsigned char *a, const unsigned char *b, size_t size) {
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        const __m256i va = _mm256_loadu_si256((const __m256i *) (a + i));
+        const __m256i vb = _mm256_loadu_si256((const __m256i *) (b + i));
+        const unsigned int diff = ~(unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+        if (diff) {
+            const size_t at = i + __builtin_ctz(diff);
+            return a[at] < b[at] ? -1 : 1;
+        }
+    }
+    return bytes_cmp_sse2(a + i, b + i, size - i);
+}
+
+// Signed compares on biased lanes give the unsigned order
+static void heads_range_sse2(const unsigned int *heads, int n, unsigned int head, int *below, int *upto) {
+    const __m128i bias = _mm_set1_epi32((int) 0x80000000u);
+    const __m128i probe = _mm_xor_si128(_mm_set1_epi32((int) head), bias);
+    int lt = 0, gt = 0, i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (heads + i)), bias);
+        lt += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(v, probe))));
+        gt += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(v, probe))));
+    }
+    int tail_lt, tail_le;
+    heads_range_scalar(heads + i, n - i, head, &tail_lt, &tail_le);
+    *below = lt + tail_lt;
+    *upto = i - gt + tail_le;
+}
+
+__attribute__((target("avx2")))
+static void heads_range_avx2(const unsigned int *heads, int n, unsigned int head, int *below, int *upto) {
+    const __m256i bias = _mm256_set1_epi32((int) 0x80000000u);
+    const __m256i probe = _mm256_xor_si256(_mm256_set1_epi32((int) head), bias);
+    int lt = 0, gt = 0, i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (heads + i)), bias);
+        lt += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(probe, v))));
+        gt += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v, probe))));
+    }
+    int tail_lt, tail_le;
+    heads_range_sse2(heads + i, n - i, head, &tail_lt, &tail_le);
+    *below = lt + tail_lt;
+    *upto = i - gt + tail_le;
+}
+
+#endif
+
+static int (*bytes_cmp)(const unsigned char *, const unsigned char *, size_t) = &bytes_cmp_scalar;
+static void (*heads_range)(const unsigned int *, int, unsigned int, int *, int *) = &heads_range_scalar;
+
+void key_dispatch_init() {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        bytes_cmp = &bytes_cmp_avx2;
+        heads_range = &heads_range_avx2;
+    } else {
+        bytes_cmp = &bytes_cmp_sse2;
+        heads_range = &heads_range_sse2;
+    }
+#endif
+}
+
+int keycmp(const struct DBT *a, const struct DBT *b) {
+    size_t min_len = (a->size > b->size) ? b->size : a->size;
+    const int res = bytes_cmp((const unsigned char *) a->data, (const unsigned char *) b->data, min_len);
+    if (res != 0)
+        return res;
+    if (a->size > min_len) {
+        return 1;
+    } else if (b->size > min_len) {
+        return -1;
+    } else {
+        return 0;
+    }
+}
+
+// First key not less than `key`; *found tells whether it is equal.
+// A vector scan of the inline heads narrows the search to the keys with
+// the same head, so most lookups never touch the keys themselves.
+int node_search(struct Chunk *node, const struct DBT *key, bool *found) {
+    *found = false;
+    if (node->n == 0)
+        return 0;
+    // A key outside the common prefix sorts before or after the whole node
+    const size_t prefix = node->prefix;
+    const size_t common = key->size < prefix ? key->size : prefix;
+    const struct DBT key_start = {key->data, common}, node_start = {node->keys[0].data, common};
+    const int cmp = keycmp(&key_start, &node_start);
+    if (cmp < 0 || (cmp == 0 && key->size < prefix))
+        return 0;
+    if (cmp > 0)
+        return node->n;
+    const struct DBT suffix = {(char *) key->data + prefix, key->size - prefix};
+    const unsigned int head = key_head(suffix.data, suffix.size);
+    int low, high;
+    heads_range(node->heads, node->n, head, &low, &high);
+    // Keys in [low, high) share the probe's head
+    while (low < high) {
+        const int mid = (low + high) / 2;
+        const struct DBT other = {(char *) node->keys[mid].data + prefix, node->keys[mid].size - prefix};
+        const int res = keycmp(&suffix, &other);
+        if (res == 0) {
+            *found = true;
+            return mid;
+        } else if (res > 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// In B+tree mode separators only route: a key equal to one lives in the
+// subtree to its right, and values are found in leaves only
+static bool tree_bplus(struct DB *db) {
+    return db->header.main_settings.bplus;
+}
+
+// Child of an internal node to descend to for the key
+static int node_route(struct DB *db, struct Chunk *node, int index, bool found) {
+    return found && tree_bplus(db) ? index + 1 : index;
+}
+
+// Readers and writers latch chunks top-down, crabbing from a parent to
+// its child, so the tree can be searched and changed by several threads.
+// The root is replaced only with the old one latched exclusively, so a
+// latched root that is still the root stays so until it is unlatched.
+
+static size_t root_load(struct DB *db) {
+    return __atomic_load_n(&db->header.root_offset, __ATOMIC_ACQUIRE);
+}
+
+static void root_store(struct DB *db, size_t offset) {
+    __atomic_store_n(&db->header.root_offset, offset, __ATOMIC_RELEASE);
+}
+
+static struct Chunk *root_latch(struct DB *db, bool exclusive) {
+    for (;;) {
+        const size_t offset = root_load(db);
+        struct Chunk *root = node_get(db, offset);
+        const bool latched = node_latch(root, exclusive);
+        if (root_load(db) == offset && node_live(db, root))
+            return root;
+        if (latched)
+            node_unlatch(root);
+    }
+}
+
+// Node holding the key, or the leaf it would go in, latched shared. With
+// parent its parent stays latched as well, NULL for the root.
+static struct Chunk *node_find(struct DB *db, struct DBT *key, int *index, bool *found, struct Chunk **parent) {
+    struct Chunk *node = root_latch(db, false), *above = NULL;
+    for (;;) {
+        *index = node_search(node, key, found);
+        if ((*found && !tree_bplus(db)) || node->leaf)
+            break;
+        struct Chunk *child = node_get(db, node->childs[node_route(db, node, *index, *found)]);
+        node_latch(child, false);
+        if (above)
+            node_unlatch(above);
+        if (parent)
+            above = node;
+        else
+            node_unlatch(node);
+        node = child;
+    }
+    if (parent)
+        *parent = above;
+    return node;
+}
+
+// Point value at the stored value of the key, in its chunk: 0 if found,
+// 1 if missing and DB_CORRUPT if the search ends in a corrupt chunk. The
+// chunk stays latched until the operation ends.
+int value_find(struct DB *db, struct DBT *key, struct DBT **value, struct Chunk **chunk) {
+    int index;
+    bool found;
+    struct Chunk *node = node_find(db, key, &index, &found, NULL);
+    if (node->corrupt)
+        return DB_CORRUPT;
+    if (!found)
+        return 1;
+    if (chunk)
+        *chunk = node;
+    *value = &node->data[index];
+    return 0;
+}
+
+// Optimistic reads
+
+// Single-key reads and cursors first go down the tree without latches and
+// without writing to anything shared. A reader parses the chunk image it
+// loads, checking every bound, and the version of the chunk tells whether
+// that image was still the current one: each step down checks the parent
+// did not change before trusting the child, and the leaf is checked once
+// its entry has been copied out. A private buffer never changes once set;
+// a view of the mapping is rewritten by the checkpoint after a writer
+// changed its chunk, so nothing read is used before the check. A reader
+// that sees a change starts over, and after a few tries takes the latches.
+
+#define READ_TRIES 4
+
+// A chunk in use, which the file holds a valid image of if it is not cached
+static bool chunk_valid(struct DB *db, size_t offset) {
+    const size_t chunk_size = db->header.main_settings.chunk_size;
+    return offset >= db->header.chunks_offset && (offset - db->header.chunks_offset) % chunk_size == 0
+           && chunk_index(db, offset) < db->chunk_count && chunk_used(db, offset);
+}
+
+// The cached chunk at offset; NULL if the offset is stale. It is not kept
+// cached: the reader's epoch keeps it allocated. A miss is read in with
+// the tree shared, like latched readers do, as exclusive sections may be
+// rewriting the file.
+static struct Chunk *node_peek(struct DB *db, size_t offset) {
+    if (!chunk_valid(db, offset))
+        return NULL;
+    struct Chunk *node = cache_peek(&db->cache, offset);
+    if (node) {
+        cache_hit(&db->cache, node);
+        return node;
+    }
+    pthread_rwlock_rdlock(&db->tree_lock);
+    node = chunk_valid(db, offset) ? node_get(db, offset) : NULL;
+    pthread_rwlock_unlock(&db->tree_lock);
+    return node;
+}
+
+static bool node_read_begin(struct Chunk *node, size_t *version) {
+    if (!node)
+        return false;
+    *version = atomic_load_explicit(&node->version, memory_order_acquire);
+    return !(*version & (1 | CHUNK_OBSOLETE));
+}
+
+// Nothing read from the chunk since node_read_begin has changed
+static bool node_read_valid(struct Chunk *node, size_t version) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&node->version, memory_order_relaxed) == version;
+}
+
+// Read from a chunk image laid out as node_parse expects
+static bool image_parse(struct DB *db, const char *raw, struct Chunk_Image *image) {
+    const size_t chunk_size = db->header.main_settings.chunk_size;
+    struct Chunk_Header header;
+    memcpy(&header, raw, sizeof(header));
+    size_t shift = sizeof(header);
+    image->raw = raw;
+    image->leaf = header.leaf;
+    image->n = header.n;
+    image->prefix = header.prefix;
+    image->LSN = header.LSN;
+    image->prev = header.prev;
+    image->next = header.next;
+    image->childs = NULL;
+    if (node_has_childs(image->leaf, image->n)) {
+        image->childs = raw + shift;
+        shift += ((size_t) image->n + 1) * sizeof(size_t);
+    }
+    image->slots = raw + shift;
+    shift += (size_t) image->n * sizeof(uint32_t);
+    image->prefix_data = raw + shift;
+    return shift + image->prefix <= chunk_size;
+}
+
+// Read from the current image of the chunk
+static bool image_open(struct DB *db, struct Chunk *node, struct Chunk_Image *image) {
+    const char *raw = (const char *) __atomic_load_n(&node->raw_data, __ATOMIC_ACQUIRE);
+    return raw && image_parse(db, raw, image);
+}
+
+// Key suffix and stored value of entry i, pointing into the image
+static bool image_entry(struct DB *db, const struct Chunk_Image *image, int i, struct DBT *suffix, struct DBT *value) {
+    const size_t chunk_size = db->header.main_settings.chunk_size;
+    uint32_t cell, suffix_len, data_len;
+    memcpy(&cell, image->slots + i * sizeof(uint32_t), sizeof(cell));
+    if (cell > chunk_size - 2 * sizeof(uint32_t))
+        return false;
+    memcpy(&suffix_len, image->raw + cell, sizeof(suffix_len));
+    memcpy(&data_len, image->raw + cell + sizeof(uint32_t), sizeof(data_len));
+    suffix->data = (void *) (image->raw + cell + 2 * sizeof(uint32_t));
+    suffix->size = suffix_len;
+    value->data = (char *) suffix->data + suffix_len;
+    value->size = data_len;
+    const size_t room = chunk_size - cell - 2 * sizeof(uint32_t);
+    return suffix_len <= room && value_bytes(value) <= room - suffix_len
+           && (!(value->size & VALUE_OVERFLOW) || value_bytes(value) == sizeof(struct Overflow_Ref));
+}
+
+// node_search over an image; -1 if it does not parse
+static int image_search(struct DB *db, const struct Chunk_Image *image, const struct DBT *key, bool *found) {
+    *found = false;
+    if (image->n == 0)
+        return 0;
+    const size_t prefix = image->prefix;
+    const size_t common = key->size < prefix ? key->size : prefix;
+    const struct DBT key_start = {key->data, common}, image_start = {(void *) image->prefix_data, common};
+    const int cmp = keycmp(&key_start, &image_start);
+    if (cmp < 0 || (cmp == 0 && key->size < prefix))
+        return 0;
+    if (cmp > 0)
+        return image->n;
+    const struct DBT suffix = {(char *) key->data + prefix, key->size - prefix};
+    int low = 0, high = image->n;
+    while (low < high) {
+        const int mid = (low + high) / 2;
+        struct DBT other, value;
+        if (!image_entry(db, image, mid, &other, &value))
+            return -1;
+        const int res = keycmp(&suffix, &other);
+        if (res == 0) {
+            *found = true;
+            return mid;
+        } else if (res > 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static size_t image_child(const struct Chunk_Image *image, int i) {
+    size_t offset;
+    memcpy(&offset, image->childs + i * sizeof(size_t), sizeof(offset));
+    return offset;
+}
+
+// Copy the full key of the entry with the given suffix into dst
+static void image_key(const struct Chunk_Image *image, const struct DBT *suffix, struct DBT *dst) {
+    dst->data = realloc(dst->data, image->prefix + suffix->size + 1);
+    memcpy(dst->data, image->prefix_data, image->prefix);
+    memcpy((char *) dst->data + image->prefix, suffix->data, suffix->size);
+    dst->size = image->prefix + suffix->size;
+}
+
+// Node holding the key, or the leaf it would go in, with its image and
+// the version to check it against. NULL if a writer got in the way.
+static struct Chunk *node_find_optimistic(struct DB *db, const struct DBT *key, struct Chunk_Image *image,
+                                          int *index, bool *found, size_t *version) {
+    const size_t offset = root_load(db);
+    struct Chunk *node = node_peek(db, offset);
+    if (!node_read_begin(node, version) || root_load(db) != offset)
+        return NULL;
+    for (int depth = 0; depth < PATH_MAX_DEPTH; depth++) {
+        // Corrupt chunks are left to the latched path to report
+        if (node->corrupt || !image_open(db, node, image) || (*index = image_search(db, image, key, found)) < 0)
+            return NULL;
+        if ((*found && !tree_bplus(db)) || image->leaf)
+            return node;
+        const size_t child_offset = image_child(image, *found && tree_bplus(db) ? *index + 1 : *index);
+        if (!node_read_valid(node, *version))
+            return NULL;
+        struct Chunk *child = node_peek(db, child_offset);
+        size_t child_version;
+        if (!node_read_begin(child, &child_version) || !node_read_valid(node, *version))
+            return NULL;
+        node = child;
+        *version = child_version;
+    }
+    return NULL;
+}
+
+// An optimistic read runs in an epoch and outside of exclusive sections
+static bool read_begin(struct DB *db, size_t *seq) {
+    epoch_enter();
+    *seq = atomic_load_explicit(&db->tree_seq, memory_order_acquire);
+    if (!(*seq & 1))
+        return true;
+    epoch_leave();
+    return false;
+}
+
+// What was read from node, and the path to it, is still current
+static bool read_valid(struct DB *db, size_t seq, struct Chunk *node, size_t version) {
+    return node_read_valid(node, version) && atomic_load_explicit(&db->tree_seq, memory_order_relaxed) == seq;
+}
+
+static void read_end() {
+    epoch_leave();
+}
+
+// Copy the bytes [offset, offset + len) of a value found by an optimistic
+// reader into buf, following its chain through the chunk images. -1 if
+// the chain breaks off, which the value having changed would tell as well.
+static long value_copy_optimistic(struct DB *db, const struct DBT *value, size_t offset, size_t len, char *buf) {
+    const size_t size = value_size(value);
+    if (offset >= size)
+        return 0;
+    if (len > size - offset)
+        len = size - offset;
+    if (!(value->size & VALUE_OVERFLOW)) {
+        memcpy(buf, (char *) value->data + offset, len);
+        return len;
+    }
+    struct Overflow_Ref ref;
+    memcpy(&ref, value->data, sizeof(ref));
+    const size_t payload = overflow_payload(db);
+    size_t chunk_offset = ref.first, done = 0;
+    while (done < len) {
+        struct Chunk *chunk = node_peek(db, chunk_offset);
+        const char *raw = chunk ? (const char *) __atomic_load_n(&chunk->raw_data, __ATOMIC_ACQUIRE) : NULL;
+        if (!raw || chunk->corrupt)
+            return -1;
+        if (offset >= payload) {
+            offset -= payload;
+        } else {
+            const size_t part = payload - offset < len - done ? payload - offset : len - done;
+            memcpy(buf + done, raw + OVERFLOW_HEADER + offset, part);
+            done += part;
+            offset = 0;
+        }
+        memcpy(&chunk_offset, raw + sizeof(struct Chunk_Header), sizeof(chunk_offset));
+    }
+    return done;
+}
+
+// Copy the bytes [offset, offset + dst->size) of the value of the key into
+// dst->data without latches, or the whole value into a buffer grown to fit
+// with grow set. dst->size becomes the number of bytes copied and *size
+// the value size. 1 if the key is missing, -1 if writers kept getting in
+// the way.
+static int get_optimistic(struct DB *db, struct DBT *key, size_t offset, struct DBT *dst, bool grow, size_t *size) {
+    const size_t len = dst->size;
+    for (int tries = 0; tries < READ_TRIES; tries++) {
+        size_t seq, version;
+        if (!read_begin(db, &seq))
+            break;
+        struct Chunk_Image image;
+        int index;
+        bool found;
+        struct Chunk *node = node_find_optimistic(db, key, &image, &index, &found, &version);
+        long copied = node ? 0 : -1;
+        struct DBT suffix, value;
+        if (node && found) {
+            copied = -1;
+            if (image_entry(db, &image, index, &suffix, &value)) {
+                *size = value_size(&value);
+                if (grow)
+                    dst->data = realloc(dst->data, *size + 1);
+                copied = value_copy_optimistic(db, &value, offset, grow ? *size : len, (char *) dst->data);
+            }
+        }
+        const bool valid = copied >= 0 && read_valid(db, seq, node, version);
+        read_end();
+        if (valid) {
+            dst->size = copied;
+            return found ? 0 : 1;
+        }
+    }
+    return -1;
+}
+
+// Views pin the buffer of the chunk holding the value instead of copying
+// it. A pinned chunk is not evicted and keeps its private buffer on write
+// back; if it is written, the old buffer lives on until its views are
+// released. Values in overflow chunks are not contiguous and are copied.
+// A chunk read as a view of the file mapping gets a private copy once it
+// is pinned, as the checkpoint rewrites the mapping in place.
+
+// Drop a view into the given buffer of the chunk at offset
+void cache_unpin(struct DB *db, size_t offset, void *raw) {
+    struct DB_Cache *cache = &db->cache;
+    pthread_rwlock_rdlock(&cache->lock);
+    pthread_mutex_lock(&cache->pin_lock);
+    for (size_t i = 0; i < cache->held_count; i++) {
+        if (cache->held[i].buf != raw)
+            continue;
+        if (--cache->held[i].pins == 0) {
+            op_retire(cache->held[i].buf);
+            cache->held[i] = cache->held[--cache->held_count];
+        }
+        pthread_mutex_unlock(&cache->pin_lock);
+        pthread_rwlock_unlock(&cache->lock);
+        return;
+    }
+    struct Chunk *node = cache_lookup(cache, offset);
+    if (node && node->raw_data == raw && node->pins)
+        node->pins--;
+    pthread_mutex_unlock(&cache->pin_lock);
+    pthread_rwlock_unlock(&cache->lock);
+}
+
+int view_get(struct DB *db, struct DBT *key, struct DB_View *view) {
+    tree_enter(db);
+    struct Chunk *chunk;
+    struct DBT *value;
+    int res = value_find(db, key, &value, &chunk);
+    if (res) {
+        tree_leave(db);
+        return res;
+    }
+    view->copy = NULL;
+    if (value->size & VALUE_OVERFLOW) {
+        struct DBT copy = {NULL, 0};
+        res = value_load(db, value, &copy);
+        if (res) {
+            free(copy.data);
+            tree_leave(db);
+            return res;
+        }
+        view->copy = view->data = copy.data;
+        view->size = copy.size;
+        tree_leave(db);
+        return 0;
+    }
+    pthread_mutex_lock(&db->cache.pin_lock);
+    if (chunk->view)
+        node_unmap(db, chunk);
+    chunk->pins++;
+    view->offset = chunk->offset;
+    view->raw = chunk->raw_data;
+    pthread_mutex_unlock(&db->cache.pin_lock);
+    view->data = value->data;
+    view->size = value->size;
+    tree_leave(db);
+    return 0;
+}
+
+void view_release(struct DB *db, struct DB_View *view) {
+    if (view->copy)
+        free(view->copy);
+    else
+        cache_unpin(db, view->offset, view->raw);
+    view->data = view->copy = view->raw = NULL;
+}
+
+// Copy the value into a caller buffer, as much of it as fits
+int get_into(struct DB *db, struct DBT *key, void *buf, size_t buf_len, size_t *val_len) {
+    struct DBT dst = {buf, buf_len};
+    int res = get_optimistic(db, key, 0, &dst, false, val_len);
+    if (res >= 0)
+        return res;
+    tree_enter(db);
+    struct DBT *value;
+    res = value_find(db, key, &value, NULL);
+    if (res == 0) {
+        *val_len = value_size(value);
+        char *pos = (char *) buf;
+        if (value_stream(db, value, 0, buf_len, &value_append, &pos) < 0)
+            res = DB_CORRUPT;
+    }
+    tree_leave(db);
+    return res;
+}
+
+// Copy the bytes [offset, offset + *len) of the value into a caller buffer
+int get_part(struct DB *db, struct DBT *key, size_t offset, void *buf, size_t *len) {
+    struct DBT dst = {buf, *len};
+    size_t size;
+    int res = get_optimistic(db, key, offset, &dst, false, &size);
+    if (res == 0)
+        *len = dst.size;
+    if (res >= 0)
+        return res;
+    tree_enter(db);
+    struct DBT *value;
+    res = value_find(db, key, &value, NULL);
+    if (res == 0) {
+        char *pos = (char *) buf;
+        const long copied = value_stream(db, value, offset, *len, &value_append, &pos);
+        if (copied < 0)
+            res = DB_CORRUPT;
+        else
+            *len = copied;
+    }
+    tree_leave(db);
+    return res;
+}
+
+int get_stream(struct DB *db, struct DBT *key, size_t offset, size_t len,
+               void (*visit)(void *, void *, size_t), void *arg) {
+    tree_enter(db);
+    struct DBT *value;
+    int res = value_find(db, key, &value, NULL);
+    if (res == 0 && value_stream(db, value, offset, len, visit, arg) < 0)
+        res = DB_CORRUPT;
+    tree_leave(db);
+    return res;
+}
+
+int dbget(struct DB *db, struct DBT *key, struct DBT *data) {
+    //printf("searching %s: ", (char *) key->data);
+    struct DBT result = {NULL, 0};
+    size_t size;
+    int res = get_optimistic(db, key, 0, &result, true, &size);
+    if (res < 0) {
+        tree_enter(db);
+        struct DBT *value;
+        res = value_find(db, key, &value, NULL);
+        if (res == 0)
+            res = value_load(db, value, &result);
+        tree_leave(db);
+    }
+    if (res == 0) {
+        //printf("%s(%d)\n", (char *) result.data, (int) result.size);
+        *data = result;
+        return 0;
+    } else {
+        free(result.data);
+        return res == DB_CORRUPT ? DB_CORRUPT : -1;
+    }
+}
+
+// Put data
+
+// Nodes split and merge by bytes, so fanout follows chunk_size and key
+// sizes. Put and delete descend once recording the path, change a single
+// node and then repair overflowing or underfull nodes bottom-up.
+
+// Insert an entry before index; child becomes the pointer to its right
+void node_insert(struct Chunk *node, int index, struct DBT *key, struct DBT *data, size_t child) {
+    node_reserve(node, node->n + 1);
+    const int tail = node->n - index;
+    memmove(node->keys + index + 1, node->keys + index, tail * sizeof(*node->keys));
+    memmove(node->data + index + 1, node->data + index, tail * sizeof(*node->data));
+    node->keys[index] = *key;
+    node->data[index] = *data;
+    if (!node->leaf) {
+        memmove(node->childs + index + 2, node->childs + index + 1, tail * sizeof(*node->childs));
+        node->childs[index + 1] = child;
+    }
+    node->n++;
+}
+
+// Remove the entry at index together with the pointer to its right
+void node_remove(struct Chunk *node, int index) {
+    const int tail = node->n - index - 1;
+    memmove(node->keys + index, node->keys + index + 1, tail * sizeof(*node->keys));
+    memmove(node->data + index, node->data + index + 1, tail * sizeof(*node->data));
+    if (!node->leaf)
+        memmove(node->childs + index + 1, node->childs + index + 2, tail * sizeof(*node->childs));
+    node->n--;
+}
+
+// Entries of a node, or of two siblings around the separator at index
+// of parent, in order. B+tree leaves are joined without the separator.
+static void run_init(struct Run *run, struct Chunk *left, int index, struct Chunk *parent, struct Chunk *right) {
+    const int separator = right && parent ? 1 : 0;
+    run->leaf = left->leaf;
+    run->n = left->n + (right ? right->n + separator : 0);
+    run->keys = (struct DBT *) malloc((run->n + 1) * sizeof(*run->keys));
+    run->data = (struct DBT *) malloc((run->n + 1) * sizeof(*run->data));
+    run->childs = (size_t *) malloc((run->n + 1) * sizeof(*run->childs));
+    memcpy(run->keys, left->keys, left->n * sizeof(*run->keys));
+    memcpy(run->data, left->data, left->n * sizeof(*run->data));
+    memcpy(run->childs, left->childs, (left->n + 1) * sizeof(*run->childs));
+    if (right) {
+        if (separator) {
+            run->keys[left->n] = parent->keys[index];
+            run->data[left->n] = parent->data[index];
+        }
+        memcpy(run->keys + left->n + separator, right->keys, right->n * sizeof(*run->keys));
+        memcpy(run->data + left->n + separator, right->data, right->n * sizeof(*run->data));
+        if (!run->leaf)
+            memcpy(run->childs + left->n + 1, right->childs, (right->n + 1) * sizeof(*run->childs));
+    }
+}
+
+static void run_free(struct Run *run) {
+    free(run->keys);
+    free(run->data);
+    free(run->childs);
+}
+
+// Entries [from, to) of the run with childs [from, to] become the node
+static void node_fill(struct Chunk *node, struct Run *run, int from, int to) {
+    node_reserve(node, to - from);
+    node->leaf = run->leaf;
+    node->n = to - from;
+    memcpy(node->keys, run->keys + from, node->n * sizeof(*node->keys));
+    memcpy(node->data, run->data + from, node->n * sizeof(*node->data));
+    if (!run->leaf)
+        memcpy(node->childs, run->childs + from, (node->n + 1) * sizeof(*node->childs));
+}
+
+// Entry that goes up when the run is dealt out to two nodes: the one
+// that balances their bytes best, leaving neither empty. Sizes are taken
+// with the prefix of the whole run, which either side can only extend.
+// With up unset the entry is the first of the right node instead.
+static int run_split_point(struct Run *run, bool up) {
+    const size_t prefix = key_lcp(&run->keys[0], &run->keys[run->n - 1]);
+    const size_t child = run->leaf ? 0 : sizeof(size_t);
+    size_t total = 0;
+    for (int i = 0; i < run->n; i++)
+        total += CELL_OVERHEAD + child + run->keys[i].size - prefix + value_bytes(&run->data[i]);
+    size_t left = CELL_OVERHEAD + child + run->keys[0].size - prefix + value_bytes(&run->data[0]);
+    size_t best_size = (size_t) -1;
+    int best = 1;
+    for (int m = 1; m < run->n - (up ? 1 : 0); m++) {
+        const size_t entry = CELL_OVERHEAD + child + run->keys[m].size - prefix + value_bytes(&run->data[m]);
+        const size_t right = total - left - (up ? entry : 0);
+        const size_t worst = left > right ? left : right;
+        if (worst < best_size) {
+            best_size = worst;
+            best = m;
+        }
+        left += entry;
+    }
+    return best;
+}
+
+// B+tree leaves keep every entry; the separator between two of them is
+// the shortest prefix of the right key that is greater than the left one
+static struct DBT key_separator(const struct DBT *left, const struct DBT *right) {
+    struct DBT separator = *right;
+    const size_t shortest = key_lcp(left, right) + 1;
+    if (shortest < separator.size)
+        separator.size = shortest;
+    return separator;
+}
+
+static struct DBT leaf_separator(struct Run *run, int m) {
+    return key_separator(&run->keys[m - 1], &run->keys[m]);
+}
+
+// Point the neighbours of a B+tree leaf back at it
+static void leaf_link(struct DB *db, struct Chunk *leaf) {
+    if (leaf->next) {
+        struct Chunk *after = node_get(db, leaf->next);
+        const bool latched = node_latch(after, true);
+        after->prev = leaf->offset;
+        node_write(db, after);
+        if (latched)
+            node_unlatch(after);
+    }
+}
+
+// Move the upper part of the overflowing child y of x at index to a new
+// node z and its middle entry up into x
+struct Chunk *split(struct DB *db, struct Chunk *x, int index, struct Chunk *y) {
+    const bool keep = tree_bplus(db) && y->leaf;
+    struct Run run;
+    run_init(&run, y, 0, NULL, NULL);
+    const int m = run_split_point(&run, !keep);
+    struct Chunk *z = node_create(db, y->offset);
+    node_fill(y, &run, 0, m);
+    if (keep) {
+        struct DBT separator = leaf_separator(&run, m), none = {NULL, 0};
+        node_fill(z, &run, m, run.n);
+        node_insert(x, index, &separator, &none, z->offset);
+        z->prev = y->offset;
+        z->next = y->next;
+        y->next = z->offset;
+        // A cursor may step to z from its right neighbour as soon as it is linked
+        node_write(db, z);
+        leaf_link(db, z);
+    } else {
+        node_fill(z, &run, m + 1, run.n);
+        node_insert(x, index, &run.keys[m], &run.data[m], z->offset);
+        node_write(db, z);
+    }
+    node_write(db, y);
+    run_free(&run);
+    return z;
+}
+
+// Exclusive latch only if it is free right away: 1 if taken, 0 if the
+// operation holds it already, -1 if it is busy
+static int node_try_latch_exclusive(struct Chunk *node) {
+    struct Ptr_List *latched = &tree_op->latched;
+    for (size_t i = 0; i < latched->count; i++) {
+        if (latched->items[i] == node)
+            return 0;
+    }
+    if (pthread_rwlock_trywrlock(&node->latch))
+        return -1;
+    atomic_fetch_add(&node->version, 1);
+    ptr_list_push(latched, node);
+    return 1;
+}
+
+// Join the children of x around the separator at index into the left one
+// if they fit in a chunk, otherwise deal their entries out evenly. In a
+// B+tree the separator of two leaves is dropped or chosen anew. Latches
+// are waited for left to right only, so a left sibling that is busy is
+// not waited for: the child stays underfull and false is returned, as it
+// does next to a corrupt sibling.
+bool rebalance(struct DB *db, struct Chunk *x, int index) {
+    const size_t chunk_size = db->header.main_settings.chunk_size;
+    struct Chunk *left = node_get(db, x->childs[index]);
+    const int left_latched = node_try_latch_exclusive(left);
+    if (left_latched < 0)
+        return false;
+    struct Chunk *right = node_get(db, x->childs[index + 1]);
+    const bool right_latched = node_latch(right, true);
+    // Corrupt siblings are never merged into or taken from
+    if (left->corrupt || right->corrupt) {
+        if (left_latched > 0)
+            node_unlatch(left);
+        if (right_latched)
+            node_unlatch(right);
+        return false;
+    }
+    const bool keep = tree_bplus(db) && left->leaf;
+    struct Run run;
+    run_init(&run, left, index, keep ? NULL : x, right);
+    if (entries_size(run.keys, run.data, 0, run.n, run.leaf) <= chunk_size) {
+        node_fill(left, &run, 0, run.n);
+        node_remove(x, index);
+        if (keep) {
+            left->next = right->next;
+            leaf_link(db, left);
+        }
+        node_write(db, left);
+        node_destroy(db, right);
+    } else if (keep) {
+        const int m = run_split_point(&run, false);
+        node_fill(left, &run, 0, m);
+        node_fill(right, &run, m, run.n);
+        x->keys[index] = leaf_separator(&run, m);
+        x->data[index] = (struct DBT) {NULL, 0};
+        node_write(db, left);
+        node_write(db, right);
+    } else {
+        const int m = run_split_point(&run, true);
+        node_fill(left, &run, 0, m);
+        node_fill(right, &run, m + 1, run.n);
+        x->keys[index] = run.keys[m];
+        x->data[index] = run.data[m];
+        node_write(db, left);
+        node_write(db, right);
+    }
+    run_free(&run);
+    if (left_latched > 0)
+        node_unlatch(left);
+    if (right_latched)
+        node_unlatch(right);
+    return true;
+}
+
+// A node that can take one more entry, lose one or have one replaced and
+// still fill a quarter to a whole chunk, so a change below it stops there.
+// An entry takes at most a quarter of a chunk, and a new first or last
+// key can shorten the prefix all the other keys share.
+static bool node_safe(struct Chunk *node, size_t chunk_size) {
+    if (node->n < 2)
+        return false;
+    const size_t child = node->leaf ? 0 : sizeof(size_t);
+    const size_t size = node_size(node);
+    if (size + chunk_size / 4 + CELL_OVERHEAD + child + node->prefix * (node->n - 1) > chunk_size)
+        return false;
+    size_t least = entries_size(node->keys, node->data, 1, node->n, node->leaf);
+    const size_t without_last = entries_size(node->keys, node->data, 0, node->n - 1, node->leaf);
+    if (without_last < least)
+        least = without_last;
+    for (int i = 1; i < node->n - 1; i++) {
+        const size_t cell = CELL_OVERHEAD + child + node->keys[i].size - node->prefix + value_bytes(&node->data[i]);
+        if (size - cell < least)
+            least = size - cell;
+    }
+    return least >= chunk_size / 4;
+}
+
+// Descend to the node holding the key, or the leaf where it belongs.
+// The index recorded for the last node is the key's position. Coupled
+// latching takes exclusive latches top-down and lets go of the ones above
+// a safe node, which the change cannot reach.
+static bool path_descend(struct DB *db, struct DBT *key, struct Path *path, enum Path_Latch latch) {
+    const size_t chunk_size = db->header.main_settings.chunk_size;
+    struct Chunk *node = latch == PATH_UNLATCHED ? node_get(db, root_load(db)) : root_latch(db, true);
+    path->depth = 0;
+    path->top = 0;
+    for (;;) {
+        if (latch == PATH_COUPLED && path->depth > path->top && node_safe(node, chunk_size)) {
+            for (int i = path->top; i < path->depth; i++)
+                node_unlatch(path->nodes[i]);
+            path->top = path->depth;
+        }
+        bool found;
+        int index = node_search(node, key, &found);
+        if (!node->leaf)
+            index = node_route(db, node, index, found);
+        path->nodes[path->depth] = node;
+        path->index[path->depth] = index;
+        path->changed[path->depth] = false;
+        path->depth++;
+        if ((found && !tree_bplus(db)) || node->leaf)
+            return found;
+        node = node_get(db, node->childs[index]);
+        if (latch != PATH_UNLATCHED)
+            node_latch(node, true);
+    }
+}
+
+static void path_push(struct DB *db, struct Path *path, size_t offset) {
+    struct Chunk *node = node_get(db, offset);
+    node_latch(node, true);
+    path->nodes[path->depth] = node;
+    path->index[path->depth] = node->n;
+    path->changed[path->depth] = false;
+    path->depth++;
+}
+
+// Write changed nodes of the path, splitting the ones that overflow and
+// rebalancing the underfull ones with a sibling, from the bottom up. The
+// right sibling is preferred, as it is latched without a wait. Nodes
+// above the top of the path were let go of and are left as they are.
+static void path_fix(struct DB *db, struct Path *path) {
+    const size_t chunk_size = db->header.main_settings.chunk_size;
+    for (int level = path->depth - 1; level > path->top; level--) {
+        if (!path->changed[level])
+            continue;
+        struct Chunk *node = path->nodes[level], *parent = path->nodes[level - 1];
+        const int index = path->index[level - 1];
+        const size_t size = node_size(node);
+        if (size > chunk_size) {
+            split(db, parent, index, node);
+            path->changed[level - 1] = true;
+        } else if (size < chunk_size / 4 && parent->n > 0
+                   && rebalance(db, parent, index < parent->n ? index : index - 1)) {
+            path->changed[level - 1] = true;
+        } else {
+            node_write(db, node);
+        }
+    }
+    struct Chunk *root = path->nodes[path->top];
+    if (!path->changed[path->top])
+        return;
+    if (path->top > 0) {
+        node_write(db, root);
+    } else if (node_size(root) > chunk_size) {
+        struct Chunk *s = node_create(db, 0);
+        s->leaf = false;
+        s->childs[0] = root->offset;
+        split(db, s, 0, root);
+        node_write(db, s);
+        root_store(db, s->offset);
+    } else if (!root->leaf && root->n == 0) {
+        root_store(db, root->childs[0]);
+        node_destroy(db, root);
+    } else {
+        node_write(db, root);
+    }
+}
+
+// Chunks the repair of the path may take: one for a split on every level
+// below its top and, if that is the root, two for a split and a new root
+static size_t path_chunks(struct Path *path) {
+    return path->depth - 1 - path->top + (path->top == 0 ? 2 : 0);
+}
+
+// Chunks that puts and batches leave free beyond all reservations. Deletes
+// only take chunks to split a node that got a longer key, and free more,
+// so that they can still get through once puts no longer fit. Redo needs
+// none left: it only repeats what fit before.
+#define CHUNK_SPARE 8
+
+static size_t chunk_spare(struct DB *db) {
+    return db->recovering ? 0 : CHUNK_SPARE;
+}
+
+// Log the change about to be made to the latched target. LSNs are taken
+// in the order the records enter the log; redo passes no record.
+static void op_log(struct DB *db, struct Record *record) {
+    if (!record)
+        return;
+    pthread_mutex_lock(&db->lsn_lock);
+    record->LSN = __atomic_add_fetch(&db->header.last_LSN, 1, __ATOMIC_ACQ_REL);
+    log_write(db->log, record);
+    pthread_mutex_unlock(&db->lsn_lock);
+}
+
+// Latch exclusively the node a search found with its parent latched, and
+// search it again. NULL if it no longer holds the key or the leaf for it.
+static struct Chunk *node_upgrade(struct DB *db, struct DBT *key, struct Chunk *node, struct Chunk *parent,
+                                  int *index, bool *found) {
+    node_unlatch(node);
+    if (parent) {
+        node_latch(node, true);
+        node_unlatch(parent);
+    } else {
+        node = root_latch(db, true);
+    }
+    *index = node_search(node, key, found);
+    return (*found && !tree_bplus(db)) || node->leaf ? node : NULL;
+}
+
+// The value as it goes into a cell, its overflow chain written to ref
+static struct DBT value_store(struct DB *db, struct DBT *key, struct DBT *data, struct Overflow_Ref *ref) {
+    if (!value_overflows(db, key, data))
+        return *data;
+    overflow_store(db, data, ref);
+    return (struct DBT) {ref, sizeof(*ref) | VALUE_OVERFLOW};
+}
+
+// Set the value at the position the path ends at
+static void path_put(struct DB *db, struct Path *path, bool found, struct DBT *key, struct DBT *value) {
+    const int level = path->depth - 1;
+    struct Chunk *node = path->nodes[level];
+    if (found) {
+        value_free(db, &node->data[path->index[level]]);
+        node->data[path->index[level]] = *value;
+    } else {
+        node_insert(node, path->index[level], key, value, 0);
+    }
+    path->changed[level] = true;
+}
+
+// Most puts change a single node and leave it between a quarter and a
+// whole chunk. They are tried first with only that node latched
+// exclusively: 0 if done, 1 if the tree needs repair and DB_CORRUPT if
+// the node is corrupt, with nothing changed in both cases.
+static int put_in_place(struct DB *db, struct DBT *key, struct DBT *value, struct Record *record) {
+    const size_t chunk_size = db->header.main_settings.chunk_size;
+    int index;
+    bool found;
+    struct Chunk *parent;
+    struct Chunk *node = node_find(db, key, &index, &found, &parent);
+    node = node_upgrade(db, key, node, parent, &index, &found);
+    if (!node)
+        return 1;
+    if (node->corrupt)
+        return DB_CORRUPT;
+    struct DBT old;
+    if (found) {
+        old = node->data[index];
+        node->data[index] = *value;
+    } else {
+        node_insert(node, index, key, value, 0);
+    }
+    const size_t size = node_size(node);
+    if (size > chunk_size || (parent && size < chunk_size / 4)) {
+        if (found)
+            node->data[index] = old;
+        else
+            node_remove(node, index);
+        return 1;
+    }
+    op_log(db, record);
+    if (found)
+        value_free(db, &old);
+    node_write(db, node);
+    return 0;
+}
+
+// The chain of the value is reserved before it is written, and the chunks
+// the path may take once it is latched: DB_FULL if either does not fit
+int apply_put(struct DB *db, struct DBT *key, struct DBT *data, struct Record *record) {
+    struct Path path;
+    struct Overflow_Ref ref;
+    if (!chunk_reserve(db, value_chunks(db, key, data), chunk_spare(db)))
+        return DB_FULL;
+    struct DBT value = value_store(db, key, data, &ref);
+    int res = put_in_place(db, key, &value, record);
+    if (res == 1) {
+        node_unlatch_all();
+        const bool found = path_descend(db, key, &path, PATH_COUPLED);
+        res = path.nodes[path.depth - 1]->corrupt ? DB_CORRUPT : 0;
+        if (res == 0 && !chunk_reserve(db, path_chunks(&path), chunk_spare(db)))
+            res = DB_FULL;
+        if (res == 0) {
+            op_log(db, record);
+            path_put(db, &path, found, key, &value);
+            path_fix(db, &path);
+        }
+    }
+    // The chain of a value that did not go in is not needed
+    if (res == DB_CORRUPT || res == DB_FULL)
+        value_free(db, &value);
+    return res;
+}
+
+void checkpoint_if_needed(struct DB *db);
+
+// At least three entries must fit in a chunk so that a split always
+// leaves two non-empty nodes. Larger values go to overflow chunks.
+static bool entry_too_large(struct DB *db, const struct DBT *key, const struct DBT *data) {
+    return key->size + sizeof(struct Overflow_Ref) > db->header.main_settings.chunk_size / 4
+           && value_overflows(db, key, data);
+}
+
+int dbput(struct DB *db, struct DBT *key, struct DBT *data) {
+    //printf("inserting %s - %s...\n", (char *) key->data, (char *) data->data);
+    if (entry_too_large(db, key, data)) {
+        // Data size is invalid
+        return 1;
+    }
+
+    struct Record record;
+    record.LSN = 0;
+    record.op = 'i';
+    record.key = *key;
+    record.data = *data;
+    tree_enter(db);
+    int res = apply_put(db, key, data, &record);
+    tree_leave(db);
+    log_commit(db->log, record.LSN);
+    checkpoint_if_needed(db);
+    return res;
+}
+
+// Delete data by key
+
+// Extend the path ending at an entry of an inner node down to the leaf
+// holding its predecessor, the last entry of the left subtree. False if
+// that leaf is corrupt.
+static bool path_predecessor(struct DB *db, struct Path *path) {
+    const int level = path->depth - 1;
+    path_push(db, path, path->nodes[level]->childs[path->index[level]]);
+    while (!path->nodes[path->depth - 1]->leaf) {
+        struct Chunk *last = path->nodes[path->depth - 1];
+        path_push(db, path, last->childs[last->n]);
+    }
+    return !path->nodes[path->depth - 1]->corrupt;
+}
+
+// Remove the entry at the given level of the path, the one it ends at or
+// the inner one path_predecessor went on from
+static void path_del(struct DB *db, struct Path *path, int level) {
+    struct Chunk *node = path->nodes[level];
+    const int index = path->index[level];
+    value_free(db, &node->data[index]);
+    if (node->leaf) {
+        node_remove(node, index);
+    } else {
+        // Replace with the predecessor
+        struct Chunk *leaf = path->nodes[path->depth - 1];
+        node->keys[index] = leaf->keys[leaf->n - 1];
+        node->data[index] = leaf->data[leaf->n - 1];
+        leaf->n--;
+        path->changed[path->depth - 1] = true;
+    }
+    path->changed[level] = true;
+}
+
+// A delete from a leaf that stays at least a quarter full is done in
+// place like a put: 0 if done, 1 if the tree needs repair, -1 if the key
+// is missing and DB_CORRUPT if the node is corrupt
+static int del_in_place(struct DB *db, struct DBT *key, struct Record *record) {
+    const size_t chunk_size = db->header.main_settings.chunk_size;
+    int index;
+    bool found;
+    struct Chunk *parent;
+    struct Chunk *node = node_find(db, key, &index, &found, &parent);
+    node = node_upgrade(db, key, node, parent, &index, &found);
+    if (!node)
+        return 1;
+    if (node->corrupt)
+        return DB_CORRUPT;
+    if (!found)
+        return -1;
+    if (!node->leaf)
+        return 1;
+    struct DBT old_key = node->keys[index], old = node->data[index];
+    node_remove(node, index);
+    if (parent && node_size(node) < chunk_size / 4) {
+        node_insert(node, index, &old_key, &old, 0);
+        return 1;
+    }
+    op_log(db, record);
+    value_free(db, &old);
+    node_write(db, node);
+    return 0;
+}
+
+int apply_del(struct DB *db, struct DBT *key, struct Record *record) {
+    int res = del_in_place(db, key, record);
+    if (res > 0) {
+        node_unlatch_all();
+        struct Path path;
+        bool found = path_descend(db, key, &path, PATH_COUPLED);
+        // Taking the predecessor up changes two levels at once, which
+        // the safe node above may not take
+        if (found && !path.nodes[path.depth - 1]->leaf && path.top > 0) {
+            node_unlatch_all();
+            found = path_descend(db, key, &path, PATH_HELD);
+        }
+        const int level = path.depth - 1;
+        res = found ? 0 : -1;
+        if (path.nodes[level]->corrupt || (found && !path.nodes[level]->leaf && !path_predecessor(db, &path)))
+            res = DB_CORRUPT;
+        if (res == 0 && !chunk_reserve(db, path_chunks(&path), 0))
+            res = DB_FULL;
+        if (res == 0) {
+            op_log(db, record);
+            path_del(db, &path, level);
+            path_fix(db, &path);
+        }
+    }
+    return res;
+}
+
+int dbdel(struct DB *db, struct DBT *key) {
+    //printf("-------------------\ndeleting %s\n", (char *) key->data);
+    struct Record record;
+    record.LSN = 0;
+    record.op = 'd';
+    record.key = *key;
+    tree_enter(db);
+    int res = apply_del(db, key, &record);
+    tree_leave(db);
+    if (record.LSN)
+        log_commit(db->log, record.LSN);
+    checkpoint_if_needed(db);
+    return res;
+}
+
+// Batches
+
+// Keys of a batch are sorted so that neighbours share the descent. A get
+// batch visits every node once for all the keys under it. A write batch
+// is logged as one 'b' record and applies its changes leaf by leaf: the
+// ops that fall into the leaf the previous op descended to are applied
+// to it in place, and its path is repaired once for all of them.
+
+static int batch_op_cmp(const void *a, const void *b) {
+    const struct Batch_Op *x = (const struct Batch_Op *) a, *y = (const struct Batch_Op *) b;
+    const int res = keycmp(&x->key, &y->key);
+    if (res)
+        return res;
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+void batch_sort(struct Batch_Op *ops, size_t count) {
+    qsort(ops, count, sizeof(*ops), &batch_op_cmp);
+}
+
+// Child of node a key descends to, or -1 if the node holds the key
+static int batch_route(struct DB *db, struct Chunk *node, struct DBT *key) {
+    bool found;
+    const int index = node_search(node, key, &found);
+    if (found && !tree_bplus(db))
+        return -1;
+    return node_route(db, node, index, found);
+}
+
+// Look up sorted keys under node, copying the values found into data.
+// All keys are routed first, so that the children they go on to are read
+// in as one batch before the descent.
+void multi_search(struct DB *db, struct Chunk *node, struct Batch_Op *ops, size_t count) {
+    int *routes = (int *) malloc((count + 1) * sizeof(*routes));
+    size_t *offsets = (size_t *) malloc((node->n + 2) * sizeof(*offsets));
+    size_t wanted = 0;
+    for (size_t i = 0; i < count; i++) {
+        bool found;
+        const int index = node_search(node, &ops[i].key, &found);
+        routes[i] = -1;
+        if (found && (node->leaf || !tree_bplus(db))) {
+            value_load(db, &node->data[index], &ops[i].data);
+            ops[i].op = 'f';
+            continue;
+        }
+        if (node->leaf)
+            continue;
+        routes[i] = node_route(db, node, index, found);
+        // Sorted keys go to children in order
+        if (!wanted || offsets[wanted - 1] != node->childs[routes[i]])
+            offsets[wanted++] = node->childs[routes[i]];
+    }
+    if (wanted > 1)
+        node_prefetch(db, offsets, wanted);
+    size_t i = 0;
+    while (i < count) {
+        if (routes[i] < 0) {
+            i++;
+            continue;
+        }
+        size_t j = i + 1;
+        while (j < count && routes[j] == routes[i])
+            j++;
+        struct Chunk *below = node_get(db, node->childs[routes[i]]);
+        node_latch(below, false);
+        multi_search(db, below, ops + i, j - i);
+        node_unlatch(below);
+        i = j;
+    }
+    free(offsets);
+    free(routes);
+}
+
+size_t multi_get(struct DB *db, struct Batch_Op *ops, size_t count) {
+    batch_sort(ops, count);
+    tree_enter(db);
+    multi_search(db, root_latch(db, false), ops, count);
+    tree_leave(db);
+    size_t found = 0;
+    for (size_t i = 0; i < count; i++)
+        found += ops[i].op == 'f';
+    return found;
+}
+
+// Whether the key descends along the path to the leaf it ends at
+static bool path_covers(struct DB *db, struct Path *path, struct DBT *key) {
+    for (int level = 0; level < path->depth - 1; level++) {
+        if (batch_route(db, path->nodes[level], key) != path->index[level])
+            return false;
+    }
+    return true;
+}
+
+static void batch_apply_op(struct DB *db, struct Path *path, int level, struct Batch_Op *op, bool found) {
+    if (op->op == 'd') {
+        if (found)
+            path_del(db, path, level);
+        return;
+    }
+    op->value = value_store(db, &op->key, &op->data, &op->ref);
+    path_put(db, path, found, &op->key, &op->value);
+}
+
+// Whether the sorted ops reach no corrupt chunk under node, counting the
+// predecessors that deletes of inner entries take up. A batch is checked
+// as a whole before any of it is applied, visiting every node once.
+static bool batch_intact(struct DB *db, struct Chunk *node, struct Batch_Op *ops, size_t count) {
+    if (node->corrupt)
+        return false;
+    if (node->leaf)
+        return true;
+    size_t i = 0;
+    while (i < count) {
+        bool found;
+        const int index = node_search(node, &ops[i].key, &found);
+        if (found && !tree_bplus(db)) {
+            if (ops[i].op == 'd') {
+                struct Chunk *last = node_get(db, node->childs[index]);
+                while (!last->leaf)
+                    last = node_get(db, last->childs[last->n]);
+                if (last->corrupt)
+                    return false;
+            }
+            i++;
+            continue;
+        }
+        const int child = node_route(db, node, index, found);
+        size_t j = i + 1;
+        while (j < count && batch_route(db, node, &ops[j].key) == child)
+            j++;
+        if (!batch_intact(db, node_get(db, node->childs[child]), ops + i, j - i))
+            return false;
+        i = j;
+    }
+    return true;
+}
+
+// Reserve the chunks a batch may take: the chains of its values, and as
+// every op repairs its path, a split on each level and a new root. The
+// tree is held alone, so its height stays.
+static bool batch_reserve(struct DB *db, struct Batch_Op *ops, size_t count) {
+    size_t height = 1;
+    struct Chunk *node = node_get(db, root_load(db));
+    while (!node->leaf && !node->corrupt) {
+        node = node_get(db, node->childs[0]);
+        height++;
+    }
+    size_t chunks = count * (height + 1);
+    for (size_t i = 0; i < count; i++) {
+        if (ops[i].op != 'd')
+            chunks += value_chunks(db, &ops[i].key, &ops[i].data);
+    }
+    return chunk_reserve(db, chunks, chunk_spare(db));
+}
+
+// Apply sorted ops; the refs of their overflow values live in the ops
+// until the paths are repaired. The tree is not shared meanwhile.
+void apply_batch(struct DB *db, struct Batch_Op *ops, size_t count) {
+    const size_t chunk_size = db->header.main_settings.chunk_size;
+    struct Path path;
+    for (size_t i = 0; i < count; i++) {
+        bool found = path_descend(db, &ops[i].key, &path, PATH_UNLATCHED);
+        struct Chunk *leaf = path.nodes[path.depth - 1];
+        const bool shared = leaf->leaf;
+        const int level = path.depth - 1;
+        if (found && ops[i].op == 'd' && !leaf->leaf)
+            path_predecessor(db, &path);
+        batch_apply_op(db, &path, level, &ops[i], found);
+        node_reindex(leaf);
+        // A leaf past the chunk size is split in two right away
+        while (shared && i + 1 < count && node_size(leaf) <= chunk_size
+               && path_covers(db, &path, &ops[i + 1].key)) {
+            i++;
+            path.index[path.depth - 1] = node_search(leaf, &ops[i].key, &found);
+            batch_apply_op(db, &path, level, &ops[i], found);
+            node_reindex(leaf);
+        }
+        path_fix(db, &path);
+    }
+}
+
+// Log record data: for each op its code, key and value (none for 'd')
+static void batch_encode(struct Batch_Op *ops, size_t count, struct DBT *out) {
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++)
+        size += 1 + 2 * sizeof(size_t) + ops[i].key.size + (ops[i].op == 'd' ? 0 : ops[i].data.size);
+    char *pos = (char *) malloc(size + 1);
+    out->data = pos;
+    out->size = size;
+    for (size_t i = 0; i < count; i++) {
+        const size_t data_size = ops[i].op == 'd' ? 0 : ops[i].data.size;
+        *pos++ = ops[i].op;
+        memcpy(pos, &ops[i].key.size, sizeof(size_t));
+        memcpy(pos + sizeof(size_t), &data_size, sizeof(size_t));
+        pos += 2 * sizeof(size_t);
+        memcpy(pos, ops[i].key.data, ops[i].key.size);
+        pos += ops[i].key.size;
+        if (data_size > 0)
+            memcpy(pos, ops[i].data.data, data_size);
+        pos += data_size;
+    }
+}
+
+// Ops of a logged batch, pointing into the record
+static struct Batch_Op *batch_decode(struct DBT *in, size_t *count) {
+    size_t cap = 16;
+    struct Batch_Op *ops = (struct Batch_Op *) malloc(cap * sizeof(*ops));
+    const char *pos = (const char *) in->data, *end = pos + in->size;
+    *count = 0;
+    while (pos < end) {
+        if (*count == cap) {
+            cap *= 2;
+            ops = (struct Batch_Op *) realloc(ops, cap * sizeof(*ops));
+        }
+        struct Batch_Op *op = &ops[(*count)++];
+        op->op = *pos++;
+        memcpy(&op->key.size, pos, sizeof(size_t));
+        memcpy(&op->data.size, pos + sizeof(size_t), sizeof(size_t));
+        pos += 2 * sizeof(size_t);
+        op->key.data = (void *) pos;
+        pos += op->key.size;
+        op->data.data = (void *) pos;
+        pos += op->data.size;
+        op->seq = *count;
+    }
+    return ops;
+}
+
+int write_batch(struct DB *db, struct Batch_Op *ops, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (ops[i].op != 'd' && entry_too_large(db, &ops[i].key, &ops[i].data))
+            return 1;
+    }
+    if (count == 0)
+        return 0;
+    batch_sort(ops, count);
+    struct Record record;
+    record.op = 'b';
+    // Recovery checks the chunk of the first key like for single ops
+    record.key = ops[0].key;
+    batch_encode(ops, count, &record.data);
+    // Leaves are changed several ops at a time, so the tree is held alone
+    tree_lock_exclusive(db);
+    tree_begin(db);
+    int res = batch_intact(db, node_get(db, db->header.root_offset), ops, count) ? 0 : DB_CORRUPT;
+    if (res == 0 && !batch_reserve(db, ops, count))
+        res = DB_FULL;
+    if (res == 0) {
+        op_log(db, &record);
+        apply_batch(db, ops, count);
+    }
+    tree_end(db);
+    tree_unlock_exclusive(db);
+    free(record.data.data);
+    if (res != 0)
+        return res;
+    log_commit(db->log, record.LSN);
+    checkpoint_if_needed(db);
+    return 0;
+}
+
+// Cursors
+
+// A cursor sits between two entries of the leaf chain and moves along
+// the sibling links. If its leaf has been written since the position was
+// taken, the position is looked up again from the key it was taken at.
+// Steps are read optimistically from the leaf images first. Otherwise a
+// cursor holds a shared latch on one leaf at a time and never waits for
+// another one meanwhile: if the neighbour it moves to is busy, it lets go
+// and finds its position again from the root.
+
+struct DB_Cursor *cursor_open(struct DB *db) {
+    if (!tree_bplus(db))
+        return NULL;
+    struct DB_Cursor *cursor = (struct DB_Cursor *) calloc(1, sizeof(*cursor));
+    cursor->db = db;
+    cursor->leaf = root_load(db);
+    cursor->LSN = (size_t) -1;
+    return cursor;
+}
+
+// Descend to the leaf for the cursor key
+static struct Chunk *cursor_locate(struct DB_Cursor *cursor) {
+    int index;
+    bool found;
+    struct Chunk *node = node_find(cursor->db, &cursor->key, &index, &found, NULL);
+    cursor->leaf = node->offset;
+    cursor->index = found && cursor->after ? index + 1 : index;
+    cursor->LSN = node->LSN;
+    return node;
+}
+
+static struct Chunk *cursor_leaf(struct DB_Cursor *cursor) {
+    struct DB *db = cursor->db;
+    if (chunk_used(db, cursor->leaf)) {
+        struct Chunk *leaf = node_get(db, cursor->leaf);
+        node_latch(leaf, false);
+        if (node_live(db, leaf) && leaf->LSN == cursor->LSN && leaf->leaf && cursor->index <= leaf->n)
+            return leaf;
+        node_unlatch(leaf);
+    }
+    return cursor_locate(cursor);
+}
+
+static void cursor_enter(struct DB_Cursor *cursor, struct Chunk *leaf, int index) {
+    cursor->leaf = leaf->offset;
+    cursor->index = index;
+    cursor->LSN = leaf->LSN;
+}
+
+// Move to the start of the next leaf or the end of the previous one. The
+// latched leaf keeps its neighbours from being freed.
+static struct Chunk *cursor_step(struct DB_Cursor *cursor, struct Chunk *leaf, bool forward) {
+    struct Chunk *next = node_get(cursor->db, forward ? leaf->next : leaf->prev);
+    const bool latched = node_try_latch(next);
+    node_unlatch(leaf);
+    if (!latched) {
+        sched_yield();
+        return cursor_locate(cursor);
+    }
+    cursor_enter(cursor, next, forward ? 0 : next->n);
+    return next;
+}
+
+// Position before the first key not less than the given one
+void cursor_seek(struct DB_Cursor *cursor, struct DBT *key) {
+    dbt_assign(&cursor->key, key->data, key->size);
+    cursor->after = false;
+    for (int tries = 0; tries < READ_TRIES; tries++) {
+        size_t seq, version;
+        if (!read_begin(cursor->db, &seq))
+            break;
+        struct Chunk_Image image;
+        int index;
+        bool found;
+        struct Chunk *leaf = node_find_optimistic(cursor->db, key, &image, &index, &found, &version);
+        const size_t offset = leaf ? leaf->offset : 0;
+        const bool valid = leaf && read_valid(cursor->db, seq, leaf, version);
+        if (valid) {
+            cursor->leaf = offset;
+            cursor->index = index;
+            cursor->LSN = image.LSN;
+        }
+        read_end();
+        if (valid)
+            return;
+    }
+    tree_enter(cursor->db);
+    cursor_locate(cursor);
+    tree_leave(cursor->db);
+}
+
+// Position after the last key
+void cursor_last(struct DB_Cursor *cursor) {
+    struct DB *db = cursor->db;
+    tree_enter(db);
+    struct Chunk *node;
+    for (;;) {
+        node = root_latch(db, false);
+        while (!node->leaf) {
+            struct Chunk *child = node_get(db, node->childs[node->n]);
+            node_latch(child, false);
+            node_unlatch(node);
+            node = child;
+        }
+        while (node->n == 0 && node->prev) {
+            struct Chunk *prev = node_get(db, node->prev);
+            if (!node_try_latch(prev))
+                break;
+            node_unlatch(node);
+            node = prev;
+        }
+        if (node->n > 0 || !node->prev)
+            break;
+        node_unlatch(node);
+        sched_yield();
+    }
+    if (node->n > 0) {
+        dbt_assign(&cursor->key, node->keys[node->n - 1].data, node->keys[node->n - 1].size);
+        cursor->after = true;
+    } else {
+        dbt_assign(&cursor->key, NULL, 0);
+        cursor->after = false;
+    }
+    cursor_enter(cursor, node, node->n);
+    tree_leave(db);
+}
+
+// Copy the entry at the position to the cursor key and data, moving
+// forward past it; 1 at the end
+static int cursor_next_latched(struct DB_Cursor *cursor) {
+    struct DB *db = cursor->db;
+    tree_enter(db);
+    struct Chunk *leaf = cursor_leaf(cursor);
+    while (leaf && cursor->index >= leaf->n)
+        leaf = leaf->next ? cursor_step(cursor, leaf, true) : NULL;
+    if (leaf) {
+        const int index = cursor->index++;
+        dbt_assign(&cursor->key, leaf->keys[index].data, leaf->keys[index].size);
+        cursor->after = true;
+        value_load(db, &leaf->data[index], &cursor->data);
+    }
+    tree_leave(db);
+    return leaf ? 0 : 1;
+}
+
+// Copy the entry before the position, moving back before it; 1 at the start
+static int cursor_prev_latched(struct DB_Cursor *cursor) {
+    struct DB *db = cursor->db;
+    tree_enter(db);
+    struct Chunk *leaf = cursor_leaf(cursor);
+    while (leaf && cursor->index == 0)
+        leaf = leaf->prev ? cursor_step(cursor, leaf, false) : NULL;
+    if (leaf) {
+        const int index = --cursor->index;
+        dbt_assign(&cursor->key, leaf->keys[index].data, leaf->keys[index].size);
+        cursor->after = false;
+        value_load(db, &leaf->data[index], &cursor->data);
+    }
+    tree_leave(db);
+    return leaf ? 0 : 1;
+}
+
+// Copy the entry after the position (before it if not forward) without
+// latches and move past it: 0 if done, 1 at the end, -1 if a writer got
+// in the way. The cursor key is only replaced once the read is valid, as
+// the position may have to be found from it again.
+static int cursor_move_optimistic(struct DB_Cursor *cursor, bool forward, size_t seq) {
+    struct DB *db = cursor->db;
+    struct Chunk_Image image;
+    size_t offset = cursor->leaf, version;
+    int index = cursor->index;
+    struct Chunk *leaf = node_peek(db, offset);
+    if (!node_read_begin(leaf, &version) || !image_open(db, leaf, &image) || !node_read_valid(leaf, version)
+        || image.LSN != cursor->LSN || !image.leaf || index > (int) image.n) {
+        bool found;
+        leaf = node_find_optimistic(db, &cursor->key, &image, &index, &found, &version);
+        if (!leaf)
+            return -1;
+        offset = leaf->offset;
+        if (found && cursor->after)
+            index++;
+    }
+    while (forward ? index >= (int) image.n : index == 0) {
+        const size_t next_offset = forward ? image.next : image.prev;
+        if (!next_offset)
+            break;
+        struct Chunk *next = node_peek(db, next_offset);
+        size_t next_version;
+        if (!node_read_begin(next, &next_version) || !node_read_valid(leaf, version)
+            || !image_open(db, next, &image) || !image.leaf)
+            return -1;
+        leaf = next;
+        offset = next_offset;
+        version = next_version;
+        index = forward ? 0 : image.n;
+    }
+    const bool end = forward ? index >= (int) image.n : index == 0;
+    struct DBT suffix, value, key = {NULL, 0};
+    if (!end) {
+        if (!forward)
+            index--;
+        if (!image_entry(db, &image, index, &suffix, &value))
+            return -1;
+        const size_t size = value_size(&value);
+        cursor->data.data = realloc(cursor->data.data, size + 1);
+        if (value_copy_optimistic(db, &value, 0, size, (char *) cursor->data.data) < 0)
+            return -1;
+        cursor->data.size = size;
+        image_key(&image, &suffix, &key);
+    }
+    if (!read_valid(db, seq, leaf, version)) {
+        free(key.data);
+        return -1;
+    }
+    if (!end) {
+        free(cursor->key.data);
+        cursor->key = key;
+        cursor->after = forward;
+        if (forward)
+            index++;
+    }
+    cursor->leaf = offset;
+    cursor->index = index;
+    cursor->LSN = image.LSN;
+    return end ? 1 : 0;
+}
+
+// Optimistic tries first, then the latched step
+static int cursor_move(struct DB_Cursor *cursor, bool forward) {
+    for (int tries = 0; tries < READ_TRIES; tries++) {
+        size_t seq;
+        if (!read_begin(cursor->db, &seq))
+            break;
+        const int res = cursor_move_optimistic(cursor, forward, seq);
+        read_end();
+        if (res >= 0)
+            return res;
+    }
+    return forward ? cursor_next_latched(cursor) : cursor_prev_latched(cursor);
+}
+
+int cursor_next(struct DB_Cursor *cursor) {
+    return cursor_move(cursor, true);
+}
+
+int cursor_prev(struct DB_Cursor *cursor) {
+    return cursor_move(cursor, false);
+}
+
+// Read ahead the leaves after the latched one that a range of left more
+// entries would go on to, as many as fill them at its size and none past
+// to. They are the next children of its parent, which is found from the
+// cached images without latches: the reads are only a hint, so a path
+// that is not cached or changes meanwhile is left to the scan. Returns
+// the last leaf read ahead, 0 if none.
+static size_t cursor_prefetch(struct DB_Cursor *cursor, struct Chunk *leaf, const struct DBT *to, size_t left) {
+    struct DB *db = cursor->db;
+    const size_t here = leaf->n - cursor->index;
+    size_t seq, version, *offsets = NULL, count = 0;
+    if (leaf->n == 0 || left <= here || !read_begin(db, &seq))
+        return 0;
+    left -= here;
+    struct DBT separator = {NULL, 0};
+    struct Chunk *node = cache_peek(&db->cache, root_load(db));
+    for (int depth = 0; node && depth < PATH_MAX_DEPTH; depth++) {
+        struct Chunk_Image image;
+        bool found;
+        int index;
+        if (!node_read_begin(node, &version) || node->corrupt || !image_open(db, node, &image) || image.leaf
+            || (index = image_search(db, &image, &leaf->keys[0], &found)) < 0)
+            break;
+        if (found)
+            index++;
+        if (image_child(&image, index) != leaf->offset) {
+            const size_t child = image_child(&image, index);
+            node = node_read_valid(node, version) ? cache_peek(&db->cache, child) : NULL;
+            continue;
+        }
+        offsets = (size_t *) malloc((image.n + 1) * sizeof(*offsets));
+        for (int i = index + 1; i <= (int) image.n && count * leaf->n < left; i++) {
+            struct DBT suffix, value;
+            if (to) {
+                if (!image_entry(db, &image, i - 1, &suffix, &value))
+                    break;
+                image_key(&image, &suffix, &separator);
+                if (keycmp(&separator, to) >= 0)
+                    break;
+            }
+            offsets[count++] = image_child(&image, i);
+        }
+        if (!read_valid(db, seq, node, version))
+            count = 0;
+        break;
+    }
+    read_end();
+    const size_t last = count ? offsets[count - 1] : 0;
+    if (count)
+        node_prefetch(db, offsets, count);
+    free(separator.data);
+    free(offsets);
+    return last;
+}
+
+// Entries are handed to visit straight from the latched leaves, except
+// values in overflow chunks. The position is kept by key before moving
+// on, in case the next leaf is busy. The leaves ahead are read in
+// batches, another one once the scan gets to the last of the previous.
+size_t cursor_range(struct DB_Cursor *cursor, struct DBT *to, size_t limit,
+                    void (*visit)(void *, void *, size_t, void *, size_t), void *arg) {
+    struct DB *db = cursor->db;
+    tree_enter(db);
+    struct Chunk *leaf = cursor_leaf(cursor);
+    struct DBT *last = NULL;
+    size_t count = 0, ahead = cursor_prefetch(cursor, leaf, to, limit);
+    while (count < limit) {
+        if (cursor->index >= leaf->n) {
+            if (!leaf->next)
+                break;
+            if (last) {
+                dbt_assign(&cursor->key, last->data, last->size);
+                cursor->after = true;
+                last = NULL;
+            }
+            leaf = cursor_step(cursor, leaf, true);
+            if (!ahead || leaf->offset == ahead)
+                ahead = cursor_prefetch(cursor, leaf, to, limit - count);
+            continue;
+        }
+        struct DBT *key = &leaf->keys[cursor->index], *data = &leaf->data[cursor->index];
+        if (to && keycmp(key, to) >= 0)
+            break;
+        if (data->size & VALUE_OVERFLOW) {
+            value_load(db, data, &cursor->data);
+            data = &cursor->data;
+        }
+        visit(arg, key->data, key->size, data->data, data->size);
+        cursor->index++;
+        last = key;
+        count++;
+    }
+    if (last) {
+        dbt_assign(&cursor->key, last->data, last->size);
+        cursor->after = true;
+    }
+    tree_leave(db);
+    return count;
+}
+
+void cursor_close(struct DB_Cursor *cursor) {
+    free(cursor->key.data);
+    free(cursor->data.data);
+    free(cursor);
+}
+
+// Bulk load
+
+// An empty tree is built bottom-up from sorted input. Each level fills one
+// node at a time and starts the next when the fill limit is reached, with
+// the entry in between (or in a B+tree a separator) going up a level.
+// Finished chunks bypass the cache and the log and are written in batches
+// in allocation order, which is file order on an empty map. Only the
+// right spine of the tree can be left underfull; it is rebalanced through
+// the cache at the end, and the load completes with a checkpoint.
+// A crash during the load only overwrites chunks that the last checkpoint
+// has as free, so recovery finds the empty tree as it was.
+
+#define BULK_BATCH 256
+
+int checkpoint(struct DB *db);
+
+// Undo an interrupted load: the tree is still the empty root
+void bulk_reset(struct DB *db) {
+    memset(db->chunk_map, 0, freemap_bytes(db));
+    const size_t root = chunk_index(db, db->header.root_offset);
+    db->chunk_map[root / 64] |= (uint64_t) 1 << (root % 64);
+    db->alloc_next = 0;
+    freemap_count(db);
+}
+
+// A node for a level; NULL if no chunk is left for it
+static struct Chunk *bulk_node(struct DB *db, bool leaf) {
+    const size_t offset = chunk_take(db, 0);
+    if (!offset)
+        return NULL;
+    struct Chunk *node = node_alloc(offset);
+    node->leaf = leaf;
+    return node;
+}
+
+static void bulk_flush(struct DB *db, struct Bulk *bulk) {
+    qsort(bulk->batch, bulk->batch_count, sizeof(*bulk->batch), &node_offset_cmp);
+    node_flush(db, bulk->batch, bulk->batch_count);
+    for (size_t i = 0; i < bulk->batch_count; i++)
+        node_free(bulk->batch[i]);
+    bulk->batch_count = 0;
+}
+
+static void bulk_queue(struct DB *db, struct Bulk *bulk, struct Chunk *chunk) {
+    bulk->batch[bulk->batch_count++] = chunk;
+    if (bulk->batch_count == BULK_BATCH)
+        bulk_flush(db, bulk);
+}
+
+// Pack a finished node and free the entry copies it was built from
+static void bulk_write(struct DB *db, struct Bulk *bulk, struct Chunk *node) {
+    void **copies = (void **) malloc((node->n + 1) * sizeof(*copies));
+    for (int i = 0; i < node->n; i++)
+        copies[i] = node->keys[i].data;
+    node_write(db, node);
+    for (int i = 0; i < node->n; i++)
+        free(copies[i]);
+    free(copies);
+    bulk_queue(db, bulk, node);
+}
+
+// Key and value copied into one allocation
+static void bulk_copy(const struct DBT *key, const struct DBT *data, struct DBT *key_copy, struct DBT *data_copy) {
+    char *copy = (char *) malloc(key->size + value_bytes(data) + 1);
+    memcpy(copy, key->data, key->size);
+    if (value_bytes(data) > 0)
+        memcpy(copy + key->size, data->data, value_bytes(data));
+    *key_copy = (struct DBT) {copy, key->size};
+    *data_copy = (struct DBT) {copy + key->size, data->size};
+}
+
+static size_t bulk_cell(struct Chunk *node, const struct DBT *key, const struct DBT *data) {
+    return CELL_OVERHEAD + (node->leaf ? 0 : sizeof(size_t)) + key->size + value_bytes(data);
+}
+
+// Whether the node stays within the fill limit with the entry appended
+static bool bulk_fits(struct Bulk *bulk, int level, const struct DBT *key, const struct DBT *data) {
+    struct Chunk *node = bulk->levels[level];
+    if (node->n == 0)
+        return true;
+    const size_t prefix = key_lcp(&node->keys[0], key);
+    size_t size = sizeof(struct Chunk_Header) + bulk->bytes[level] + bulk_cell(node, key, data) - node->n * prefix;
+    if (!node->leaf)
+        size += (node->n + 2) * sizeof(size_t);
+    return size <= bulk->limit;
+}
+
+static void bulk_append(struct Bulk *bulk, int level, struct DBT *key, struct DBT *data, size_t left) {
+    struct Chunk *node = bulk->levels[level];
+    bulk->bytes[level] += bulk_cell(node, key, data);
+    node->childs[node->n] = left;
+    node_insert(node, node->n, key, data, 0);
+}
+
+// Add an entry to an internal level; left is the child before it. The
+// entry is left to the caller if no chunk is left for a node it needs.
+static bool bulk_push(struct DB *db, struct Bulk *bulk, int level, struct DBT *key, struct DBT *data, size_t left) {
+    if (level == bulk->depth) {
+        struct Chunk *top = bulk_node(db, false);
+        if (!top)
+            return false;
+        bulk->levels[bulk->depth++] = top;
+        bulk->bytes[level] = 0;
+    }
+    if (bulk_fits(bulk, level, key, data)) {
+        bulk_append(bulk, level, key, data, left);
+        return true;
+    }
+    struct Chunk *node = bulk->levels[level], *next = bulk_node(db, false);
+    if (!next)
+        return false;
+    const size_t offset = node->offset;
+    node->childs[node->n] = left;
+    bulk_write(db, bulk, node);
+    bulk->levels[level] = next;
+    bulk->bytes[level] = 0;
+    return bulk_push(db, bulk, level + 1, key, data, offset);
+}
+
+// Append a pair: 0, 1 if it is out of order or too long, and DB_FULL if
+// no chunk is left for it, which ends the load
+static int bulk_add(struct DB *db, struct Bulk *bulk, struct DBT *key, struct DBT *data) {
+    if (bulk->last.data && keycmp(&bulk->last, key) >= 0)
+        return 1;
+    if (entry_too_large(db, key, data))
+        return 1;
+    dbt_assign(&bulk->last, key->data, key->size);
+    struct Overflow_Ref ref;
+    struct DBT value = *data, key_copy, data_copy;
+    if (value_overflows(db, key, data)) {
+        const size_t count = overflow_count(db, data);
+        struct Chunk **chain = (struct Chunk **) malloc((count + 1) * sizeof(*chain));
+        for (size_t i = 0; i < count; i++) {
+            const size_t offset = chunk_take(db, 0);
+            if (!offset) {
+                while (i-- > 0)
+                    node_free(chain[i]);
+                free(chain);
+                return DB_FULL;
+            }
+            chain[i] = node_alloc(offset);
+        }
+        overflow_fill(db, chain, count, data, &ref);
+        for (size_t i = 0; i < count; i++)
+            bulk_queue(db, bulk, chain[i]);
+        free(chain);
+        value = (struct DBT) {&ref, sizeof(ref) | VALUE_OVERFLOW};
+    }
+    bulk_copy(key, &value, &key_copy, &data_copy);
+    if (bulk->depth == 0) {
+        struct Chunk *first = bulk_node(db, true);
+        if (!first) {
+            free(key_copy.data);
+            return DB_FULL;
+        }
+        bulk->levels[bulk->depth++] = first;
+        bulk->bytes[0] = 0;
+    }
+    struct Chunk *leaf = bulk->levels[0];
+    const size_t offset = leaf->offset;
+    if (bulk_fits(bulk, 0, &key_copy, &data_copy)) {
+        bulk_append(bulk, 0, &key_copy, &data_copy, 0);
+        return 0;
+    }
+    struct Chunk *next = bulk_node(db, true);
+    if (!next) {
+        free(key_copy.data);
+        return DB_FULL;
+    }
+    bulk->levels[0] = next;
+    bulk->bytes[0] = 0;
+    if (tree_bplus(db)) {
+        struct DBT separator = key_separator(&leaf->keys[leaf->n - 1], &key_copy), none = {NULL, 0}, sep_copy, none_copy;
+        bulk_copy(&separator, &none, &sep_copy, &none_copy);
+        leaf->next = next->offset;
+        next->prev = leaf->offset;
+        bulk_write(db, bulk, leaf);
+        bulk_append(bulk, 0, &key_copy, &data_copy, 0);
+        if (!bulk_push(db, bulk, 1, &sep_copy, &none_copy, offset)) {
+            free(sep_copy.data);
+            return DB_FULL;
+        }
+    } else {
+        bulk_write(db, bulk, leaf);
+        if (!bulk_push(db, bulk, 1, &key_copy, &data_copy, offset)) {
+            free(key_copy.data);
+            return DB_FULL;
+        }
+    }
+    return 0;
+}
+
+// Close the open node of every level, each becoming the last child of
+// the one above, and return the root
+static size_t bulk_finish(struct DB *db, struct Bulk *bulk) {
+    size_t child = 0;
+    for (int level = 0; level < bulk->depth; level++) {
+        struct Chunk *node = bulk->levels[level];
+        if (level > 0)
+            node->childs[node->n] = child;
+        child = node->offset;
+        bulk_write(db, bulk, node);
+    }
+    bulk_flush(db, bulk);
+    return child;
+}
+
+// Rebalance the last node of every level with its left sibling, top-down
+// so that each parent has a separator to rebalance around
+static void bulk_fix_spine(struct DB *db) {
+    const size_t chunk_size = db->header.main_settings.chunk_size;
+    struct Chunk *parent = node_get(db, db->header.root_offset);
+    while (!parent->leaf) {
+        if (parent->n == 0) {
+            root_store(db, parent->childs[0]);
+            node_destroy(db, parent);
+            parent = node_get(db, db->header.root_offset);
+            continue;
+        }
+        struct Chunk *child = node_get(db, parent->childs[parent->n]);
+        if (node_size(child) < chunk_size / 4) {
+            rebalance(db, parent, parent->n - 1);
+            node_write(db, parent);
+            if (parent->n == 0 && parent->offset == db->header.root_offset)
+                continue;
+            child = node_get(db, parent->childs[parent->n]);
+        }
+        parent = child;
+    }
+}
+
+int bulk_load(struct DB *db, int (*next)(void *, void **, size_t *, void **, size_t *), void *arg, unsigned fill) {
+    const size_t chunk_size = db->header.main_settings.chunk_size;
+    // The whole load holds the tree alone
+    tree_lock_exclusive(db);
+    struct Chunk *root = node_get(db, db->header.root_offset);
+    if (!root->leaf || root->n > 0) {
+        tree_unlock_exclusive(db);
+        return 1;
+    }
+    // Nothing is dirty from here on, and the checkpointed map has only the
+    // root in use
+    checkpoint(db);
+
+    struct Bulk bulk;
+    memset(&bulk, 0, sizeof(bulk));
+    fill = fill < 50 ? 50 : fill > 100 ? 100 : fill;
+    bulk.limit = chunk_size * fill / 100;
+    bulk.batch = (struct Chunk **) malloc(BULK_BATCH * sizeof(*bulk.batch));
+    int res = 0;
+    struct DBT key, data;
+    while (res == 0 && next(arg, &key.data, &key.size, &data.data, &data.size) == 0)
+        res = bulk_add(db, &bulk, &key, &data);
+    size_t new_root = 0;
+    if (res == 0 && bulk.depth > 0)
+        new_root = bulk_finish(db, &bulk);
+    for (int level = 0; res != 0 && level < bulk.depth; level++) {
+        for (int i = 0; i < bulk.levels[level]->n; i++)
+            free(bulk.levels[level]->keys[i].data);
+        node_free(bulk.levels[level]);
+    }
+    if (res != 0)
+        bulk_flush(db, &bulk);
+    free(bulk.batch);
+    free(bulk.last.data);
+    if (res != 0) {
+        bulk_reset(db);
+    } else if (new_root) {
+        fdatasync(db->file);
+        tree_begin(db);
+        node_destroy(db, node_get(db, db->header.root_offset));
+        root_store(db, new_root);
+        bulk_fix_spine(db);
+        tree_end(db);
+    }
+    checkpoint(db);
+    tree_unlock_exclusive(db);
+    return res;
+}
+
+// Compaction
+
+// A compaction pass walks the tree in key order a leaf at a time and moves
+// every chunk it meets (the path down to the leaf, the leaf and the overflow
+// chains of their values) to the lowest free chunk if there is one before
+// it. Each call runs a bounded number of steps; the next one resumes after
+// the last separator passed, so the tree may change in between. A step is
+// logged as an 'm' record with no effect on redo, which gives the moved
+// chunks a new LSN for cursors to notice. The moves themselves reach the
+// file only with a checkpoint, like any other change, so once the pass is
+// through the file is cut after the last used chunk right after one.
+
+// Claim the lowest free chunk if it lies before offset, or return 0
+static size_t chunk_lower(struct DB *db, size_t offset) {
+    const size_t index = chunk_index(db, offset);
+    const size_t lower = freemap_find(db, 0, index);
+    return lower < index ? chunk_claim(db, lower) : 0;
+}
+
+// Rehash the cached chunk under its new offset and free the old one.
+// The chunk must be rewritten afterwards.
+static void chunk_move(struct DB *db, struct Chunk *chunk, size_t offset) {
+    snapshot_keep(db, chunk);
+    pthread_rwlock_wrlock(&db->cache.lock);
+    cache_drop_freed(db, offset);
+    cache_remove(&db->cache, chunk);
+    chunk_release(db, chunk->offset);
+    __atomic_store_n(&chunk->offset, offset, __ATOMIC_RELAXED);
+    cache_insert(&db->cache, chunk);
+    pthread_rwlock_unlock(&db->cache.lock);
+}
+
+// Move the chunks of an overflow chain forward; true if the first one moved
+static bool compact_chain(struct DB *db, struct Overflow_Ref *ref) {
+    const size_t payload = overflow_payload(db);
+    struct Chunk *prev = NULL;
+    bool moved = false;
+    for (size_t offset = ref->first; offset;) {
+        struct Chunk *chunk = node_get(db, offset);
+        // Corrupt chunks stay where they are, and so does the rest of the chain
+        if (chunk->corrupt)
+            break;
+        const size_t next = chunk->childs[0];
+        const size_t lower = chunk_lower(db, offset);
+        if (lower) {
+            chunk_move(db, chunk, lower);
+            overflow_write(db, chunk, (char *) chunk->raw_data + OVERFLOW_HEADER, payload, next);
+            if (prev) {
+                overflow_write(db, prev, (char *) prev->raw_data + OVERFLOW_HEADER, payload, lower);
+            } else {
+                ref->first = lower;
+                moved = true;
+            }
+        }
+        prev = chunk;
+        offset = next;
+    }
+    return moved;
+}
+
+// Move the node and the chains of its values forward, index being its
+// position in parent (NULL for the root)
+static void compact_node(struct DB *db, struct Chunk *node, struct Chunk *parent, int index) {
+    if (node->corrupt)
+        return;
+    struct Overflow_Ref *refs = (struct Overflow_Ref *) malloc((node->n + 1) * sizeof(*refs));
+    bool changed = false;
+    for (int i = 0; i < node->n; i++) {
+        if (!(node->data[i].size & VALUE_OVERFLOW))
+            continue;
+        memcpy(&refs[i], node->data[i].data, sizeof(refs[i]));
+        if (compact_chain(db, &refs[i])) {
+            node->data[i] = (struct DBT) {&refs[i], sizeof(refs[i]) | VALUE_OVERFLOW};
+            changed = true;
+        }
+    }
+    const size_t lower = chunk_lower(db, node->offset);
+    if (lower) {
+        chunk_move(db, node, lower);
+        if (parent) {
+            parent->childs[index] = lower;
+            node_write(db, parent);
+        } else {
+            root_store(db, lower);
+        }
+        if (node->leaf && node->prev) {
+            struct Chunk *prev = node_get(db, node->prev);
+            prev->next = lower;
+            node_write(db, prev);
+        }
+        if (node->leaf && node->next) {
+            struct Chunk *next = node_get(db, node->next);
+            next->prev = lower;
+            node_write(db, next);
+        }
+        changed = true;
+    }
+    if (changed)
+        node_write(db, node);
+    free(refs);
+}
+
+// Compact the path to the next leaf. Returns false once the pass is through.
+// The record only takes an LSN and needs not be waited for.
+static bool compact_step(struct DB *db) {
+    struct Record record;
+    record.op = 'm';
+    record.key = record.data = (struct DBT) {NULL, 0};
+    tree_begin(db);
+    op_log(db, &record);
+    struct Chunk *node = node_get(db, db->header.root_offset), *parent = NULL;
+    struct DBT fence = {NULL, 0};
+    bool fenced = false;
+    int index = 0;
+    for (;;) {
+        compact_node(db, node, parent, index);
+        if (node->leaf)
+            break;
+        bool found = false;
+        index = db->compact_resume ? node_search(node, &db->compact_key, &found) : 0;
+        // Keys up to the resume key have been passed in both tree modes
+        if (found)
+            index++;
+        if (index < node->n) {
+            dbt_assign(&fence, node->keys[index].data, node->keys[index].size);
+            fenced = true;
+        }
+        parent = node;
+        node = node_get(db, node->childs[index]);
+    }
+    tree_end(db);
+    free(db->compact_key.data);
+    db->compact_key = fence;
+    db->compact_resume = fenced;
+    return fenced;
+}
+
+// Cut the file after the last used chunk. Mapped files keep their size and
+// get the tail punched out instead.
+static void compact_truncate(struct DB *db) {
+    const size_t chunk_size = db->header.main_settings.chunk_size;
+    size_t used = db->chunk_count;
+    while (used > 0 && !chunk_used(db, db->header.chunks_offset + (used - 1) * chunk_size))
+        used--;
+    const size_t end = db->header.chunks_offset + used * chunk_size;
+    db->alloc_next = 0;
+    if (end >= db->file_size)
+        return;
+    if (db->map) {
+        fallocate(db->file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, end, db->file_size - end);
+        return;
+    }
+    ftruncate(db->file, end);
+    db->file_size = end;
+    freemap_count(db);
+}
+
+// Run up to steps compaction steps. Returns 1 while the pass goes on and 0
+// when it is through and the file has been shrunk.
+// Chunks are moved with the tree held alone, a step at a time.
+int compact(struct DB *db, size_t steps) {
+    bool more = true;
+    for (size_t step = 0; more && step < steps; step++) {
+        tree_lock_exclusive(db);
+        more = compact_step(db);
+        tree_unlock_exclusive(db);
+        checkpoint_if_needed(db);
+    }
+    if (more)
+        return 1;
+    // The chunks in the tail are free as of the checkpoint recovery would start from
+    pthread_rwlock_wrlock(&db->tree_lock);
+    checkpoint(db);
+    compact_truncate(db);
+    pthread_rwlock_unlock(&db->tree_lock);
+    return 0;
+}
+
+// Checkpoint and recovery
+
+// A checkpoint first logs the header, the free-space map and images of
+// all dirty chunks and syncs the log, and only then overwrites the chunks
+// in place.
+// A crash in the middle of the in-place writes is repaired by replaying
+// the images, so the file always reflects some complete checkpoint.
+// The record is taken with the tree held alone, so every change logged
+// before it is complete in the images. The chunks are clean from then on
+// and operations resume while the images are written in place; until
+// that is done the chunks are not evicted, as the file does not hold them
+// yet, and the next checkpoint waits. Chunks written this way keep their
+// private copies until they are evicted.
+
+static size_t checkpoint_offset(struct DB *db, const struct Checkpoint *cp, size_t i) {
+    size_t offset;
+    memcpy(&offset, cp->images + i * (sizeof(size_t) + db->header.main_settings.chunk_size), sizeof(offset));
+    return offset;
+}
+
+// A chunk the checkpoint in progress has yet to write in place. Called
+// under the cache lock.
+static bool checkpoint_pending(struct DB *db, size_t offset) {
+    const struct Checkpoint *cp = db->flushing;
+    if (!cp)
+        return false;
+    size_t low = 0, high = cp->count;
+    while (low < high) {
+        const size_t mid = (low + high) / 2;
+        const size_t other = checkpoint_offset(db, cp, mid);
+        if (other == offset)
+            return true;
+        if (other < offset)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return false;
+}
+
+// Log the checkpoint and mark its chunks clean. Called with the tree held
+// alone; waits for the in-place writes of the previous checkpoint.
+static struct Checkpoint *checkpoint_begin(struct DB *db) {
+    const size_t chunk_size = db->header.main_settings.chunk_size;
+    const size_t image_size = sizeof(size_t) + chunk_size;
+    pthread_mutex_lock(&db->flush_lock);
+    while (db->flushing)
+        pthread_cond_wait(&db->flush_done, &db->flush_lock);
+    struct Checkpoint *cp = (struct Checkpoint *) malloc(sizeof(*cp));
+    struct Chunk **dirty = cache_dirty_list(db, &cp->count);
+    cp->images = (char *) malloc(cp->count * image_size + 1);
+    for (size_t i = 0; i < cp->count; i++) {
+        memcpy(cp->images + i * image_size, &dirty[i]->offset, sizeof(size_t));
+        memcpy(cp->images + i * image_size + sizeof(size_t), dirty[i]->raw_data, chunk_size);
+    }
+    const size_t map_bytes = freemap_bytes(db);
+    cp->meta_size = sizeof(db->header) + map_bytes;
+    cp->meta = (char *) malloc(cp->meta_size);
+    memcpy(cp->meta, &db->header, sizeof(db->header));
+    memcpy(cp->meta + sizeof(db->header), db->chunk_map, map_bytes);
+    struct Record record;
+    record.LSN = db->header.last_LSN;
+    record.op = 'c';
+    record.key.data = cp->meta;
+    record.key.size = cp->meta_size;
+    record.data.data = cp->images;
+    record.data.size = cp->count * image_size;
+    // Records not replayed yet are still needed if recovery is cut short
+    log_checkpoint(db->log, &record, !db->recovering);
+    pthread_rwlock_wrlock(&db->cache.lock);
+    for (size_t i = 0; i < cp->count; i++)
+        dirty[i]->dirty = false;
+    db->cache.dirty -= cp->count;
+    db->cache.writes += cp->count;
+    db->flushing = cp;
+    pthread_rwlock_unlock(&db->cache.lock);
+    pthread_mutex_unlock(&db->flush_lock);
+    free(dirty);
+    return cp;
+}
+
+// Write the chunks of the checkpoint in place, adjacent ones as one
+// vectored write, then the header and the map. Needs no lock: nothing
+// else does chunk I/O in batches until it is done.
+static int checkpoint_finish(struct DB *db, struct Checkpoint *cp) {
+    const size_t chunk_size = db->header.main_settings.chunk_size;
+    const size_t image_size = sizeof(size_t) + chunk_size;
+    struct iovec *iov = (struct iovec *) malloc((cp->count + 1) * sizeof(*iov));
+    struct DB_IO *io = (struct DB_IO *) malloc((cp->count + 1) * sizeof(*io));
+    size_t runs = 0;
+    for (size_t i = 0; i < cp->count; ) {
+        struct DB_IO *run = &io[runs++];
+        run->iov = &iov[i];
+        run->count = 0;
+        run->offset = checkpoint_offset(db, cp, i);
+        run->write = true;
+        do {
+            iov[i].iov_base = cp->images + i * image_size + sizeof(size_t);
+            iov[i].iov_len = chunk_size;
+            run->count++;
+            i++;
+        } while (i < cp->count && run->count < IOV_MAX
+                 && checkpoint_offset(db, cp, i) == run->offset + run->count * chunk_size);
+    }
+    db->submit(db, io, runs);
+    free(io);
+    free(iov);
+    db->write(db, cp->meta, cp->meta_size, 0x0);
+    const int res = fsync(db->file);
+    pthread_mutex_lock(&db->flush_lock);
+    pthread_rwlock_wrlock(&db->cache.lock);
+    db->flushing = NULL;
+    pthread_rwlock_unlock(&db->cache.lock);
+    pthread_cond_broadcast(&db->flush_done);
+    pthread_mutex_unlock(&db->flush_lock);
+    free(cp->images);
+    free(cp->meta);
+    free(cp);
+    return res;
+}
+
+// Checkpoint within an exclusive section, done when it returns
+int checkpoint(struct DB *db) {
+    return checkpoint_finish(db, checkpoint_begin(db));
+}
+
+// Hold the tree only while the checkpoint is logged
+static int checkpoint_fuzzy(struct DB *db) {
+    pthread_rwlock_wrlock(&db->tree_lock);
+    struct Checkpoint *cp = checkpoint_begin(db);
+    pthread_rwlock_unlock(&db->tree_lock);
+    return checkpoint_finish(db, cp);
+}
+
+int dbsync(struct DB *db) {
+    return checkpoint_fuzzy(db);
+}
+
+// When the cache is mostly dirty or the log since the last checkpoint is
+// longer than the cache, which bounds recovery time
+static bool checkpoint_due(struct DB *db) {
+    return db->cache.dirty > db->cache.n / 2
+           || db->log->written > db->header.main_settings.mem_size;
+}
+
+void checkpoint_if_needed(struct DB *db) {
+    if (!checkpoint_due(db))
+        return;
+    // Another thread may have taken the checkpoint meanwhile
+    pthread_rwlock_wrlock(&db->tree_lock);
+    if (!checkpoint_due(db)) {
+        pthread_rwlock_unlock(&db->tree_lock);
+        return;
+    }
+    struct Checkpoint *cp = checkpoint_begin(db);
+    pthread_rwlock_unlock(&db->tree_lock);
+    checkpoint_finish(db, cp);
+}
+
+void checkpoint_restore(struct DB *db, struct Record *record) {
+    db->header = *((struct DB_Header *) record->key.data);
+    memcpy(db->chunk_map, (char *) record->key.data + sizeof(db->header), freemap_bytes(db));
+    freemap_count(db);
+    const size_t chunk_size = db->header.main_settings.chunk_size;
+    const size_t image_size = sizeof(size_t) + chunk_size;
+    const size_t count = record->data.size / image_size;
+    // Write every image back as one batch: a torn in-place write can leave
+    // a new header over stale sectors, so the header on disk proves nothing
+    struct iovec *iov = (struct iovec *) malloc((count + 1) * sizeof(*iov));
+    struct DB_IO *io = (struct DB_IO *) malloc((count + 1) * sizeof(*io));
+    for (size_t i = 0; i < count; i++) {
+        char *image = (char *) record->data.data + i * image_size;
+        iov[i] = (struct iovec) {image + sizeof(size_t), chunk_size};
+        io[i] = (struct DB_IO) {&iov[i], 1, *((size_t *) image), true};
+    }
+    db->submit(db, io, count);
+    free(io);
+    free(iov);
+}
+
+// Node holding the key, or the leaf where it would be inserted
+struct Chunk *node_locate(struct DB *db, struct DBT *key) {
+    struct Chunk *node = node_get(db, db->header.root_offset);
+    for (;;) {
+        bool found;
+        const int index = node_search(node, key, &found);
+        if ((found && !tree_bplus(db)) || node->leaf)
+            return node;
+        node = node_get(db, node->childs[node_route(db, node, index, found)]);
+    }
+}
+
+void redo(struct DB *db, struct Record *record) {
+    db->header.last_LSN = record->LSN;
+    // Compaction steps only move chunks, which is not redone
+    if (record->op == 'm')
+        return;
+    // Already reflected in the target chunk
+    if (node_locate(db, &record->key)->LSN >= record->LSN)
+        return;
+    switch (record->op) {
+        case 'd': {
+            tree_enter(db);
+            apply_del(db, &record->key, NULL);
+            tree_leave(db);
+            break;
+        }
+        case 'i': {
+            tree_enter(db);
+            apply_put(db, &record->key, &record->data, NULL);
+            tree_leave(db);
+            break;
+        }
+        case 'b': {
+            size_t count;
+            struct Batch_Op *ops = batch_decode(&record->data, &count);
+            tree_enter(db);
+            if (batch_reserve(db, ops, count))
+                apply_batch(db, ops, count);
+            else
+                fprintf(stderr, "ERROR! No room to redo a batch.\n");
+            tree_leave(db);
+            free(ops);
+            break;
+        }
+        default:
+            fprintf(stderr, "ERROR! Wrong operation in log.\n");
+    }
+}
+
+// Restore the last complete checkpoint and replay what was logged after it.
+// Returns the number of replayed records.
+size_t recovery(struct DB *db, char *filename) {
+    size_t replayed = 0, count;
+    size_t *seqs = log_segments(filename, &count);
+    struct Log_Segment_Header header;
+    struct Record *record;
+    // Newest segment that starts with a whole checkpoint record; a torn
+    // one falls back to the previous checkpoint
+    for (size_t i = count; i-- > 0;) {
+        const int file = segment_open(filename, seqs[i], &header);
+        if (file < 0)
+            continue;
+        off_t offset = sizeof(header);
+        record = header.checkpoint ? log_read_next(file, &offset) : NULL;
+        close(file);
+        if (record && record->op == 'c') {
+            checkpoint_restore(db, record);
+            record_free(record);
+            break;
+        }
+        record_free(record);
+    }
+    // Checkpoints taken while replaying start segments after the records
+    // they do not cover yet, so every segment is looked at
+    const unsigned checkpoint_LSN = db->header.last_LSN;
+    for (size_t i = 0; i < count; i++) {
+        const int file = segment_open(filename, seqs[i], &header);
+        if (file < 0)
+            continue;
+        off_t offset = log_seek(file, checkpoint_LSN);
+        while (offset >= 0 && (record = log_read_next(file, &offset))) {
+            if (record->op != 'c' && record->LSN > checkpoint_LSN) {
+                redo(db, record);
+                checkpoint_if_needed(db);
+                replayed++;
             }
+            record_free(record);
+        }
+        close(file);
+    }
+    free(seqs);
+    return replayed;
+}
+
+// DB external managing
+
+static char *log_path(const char *file) {
+    char *path = (char *) malloc(strlen(file) + 5);
+    sprintf(path, "%s.log", file);
+    return path;
+}
+
+// Switch chunk I/O to io_uring if configured and supported
+static void db_uring_init(struct DB *db) {
+    if (db->header.main_settings.use_uring) {
+        db->uring = uring_open(DB_URING_ENTRIES);
+        if (db->uring)
+            db->submit = &dbsubmit_uring;
+    }
+}
+
+int dbclose(struct DB *db) {
+    // Writing dirty chunks and header
+    dbsync(db);
+    log_close(db->log);
+    uring_close(db->uring);
+    // Close file
+    int res = close(db->file);
+    // Free memory
+    cache_free(db);
+    epoch_flush();
+    db_unmap(db);
+    free(db->chunk_map);
+    free(db->compact_key.data);
+    pthread_rwlock_destroy(&db->tree_lock);
+    pthread_mutex_destroy(&db->alloc_lock);
+    pthread_mutex_destroy(&db->lsn_lock);
+    pthread_mutex_destroy(&db->snapshot_lock);
+    pthread_mutex_destroy(&db->flush_lock);
+    pthread_cond_destroy(&db->flush_done);
+    free(db);
+    return res;
+}
+
+struct DB *dbInit() {
+    struct DB *db = (struct DB *) malloc(sizeof(struct DB));
+    key_dispatch_init();
+    crc32c_init();
+    pthread_once(&tree_op_once, &tree_op_init);
+    // Checkpoints are not held off by a steady stream of operations
+    pthread_rwlock_init(&db->tree_lock, &latch_attr);
+    db->tree_seq = 0;
+    pthread_mutex_init(&db->alloc_lock, NULL);
+    pthread_mutex_init(&db->lsn_lock, NULL);
+    pthread_mutex_init(&db->snapshot_lock, NULL);
+    db->snapshots = NULL;
+    db->snapshot_LSN = 0;
+    db->snapshot_memory = 0;
+    pthread_mutex_init(&db->flush_lock, NULL);
+    pthread_cond_init(&db->flush_done, NULL);
+    db->flushing = NULL;
+    db->recovering = false;
+    db->map = NULL;
+    db->map_size = 0;
+    db->uring = NULL;
+    db->chunk_map = NULL;
+    db->compact_key = (struct DBT) {NULL, 0};
+    db->compact_resume = false;
+    db->read = &dbread;
+    db->write = &dbwrite;
+    db->writev = &dbwritev;
+    db->submit = &dbsubmit;
+    db->get = &dbget;
+    db->put = &dbput;
+    db->del = &dbdel;
+    db->sync = &dbsync;
+    db->close = &dbclose;
+    return db;
+}
+
+struct DB *dbcreate(char *file, struct DBC conf) {
+    // Create file
+    const int fd = open(file, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR|S_IRUSR);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR! Cannot create %s.\n", file);
+        return NULL;
+    }
+    // Init DB
+    struct DB *db = dbInit();
+    db->file = fd;
+    // Init DB_Header
+    db->header.main_settings = conf;
+    freemap_layout(db);
+    db->header.root_offset = db->header.chunks_offset;
+    db->header.last_LSN = 0;
+    // The file grows as chunks are taken, except that a mapping needs it
+    // at full size from the start (sparse)
+    freemap_init(db);
+    db->file_size = db->header.chunks_offset;
+    if (conf.use_mmap) {
+        ftruncate(db->file, db->header.main_settings.db_size);
+        db->file_size = db->header.main_settings.db_size;
+        db_map(db);
+    }
+    freemap_count(db);
+    db_uring_init(db);
+    cache_init(db);
+    char *log_file = log_path(file);
+    log_remove(log_file);
+    db->log = log_open(log_file, &db->header.main_settings);
+
+    // Add root
+    struct Chunk *root = node_create(db, 0);
+    if (!root) {
+        fprintf(stderr, "ERROR! No room for the root of %s.\n", file);
+        dbclose(db);
+        unlink(file);
+        log_remove(log_file);
+        free(log_file);
+        return NULL;
+    }
+    free(log_file);
+    node_write(db, root);
+    dbsync(db);
+    return db;
+}
+
+struct DB *dbopen(char *file) {
+    // Open file
+    const int fd = open(file, O_RDWR);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) < 0 || (size_t) file_stat.st_size < sizeof(struct DB_Header)) {
+        fprintf(stderr, "ERROR! Cannot open %s.\n", file);
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    // Init DB
+    struct DB *db = dbInit();
+    db->file = fd;
+    // Read header
+    db->read(db, (char *) &(db->header), sizeof(db->header), 0x0);
+    freemap_open(db);
+    if (db->header.main_settings.use_mmap)
+        db_map(db);
+    db_uring_init(db);
+    cache_init(db);
+    char *log_file = log_path(file);
+    db->log = log_open(log_file, &db->header.main_settings);
+    db->recovering = true;
+    recovery(db, log_file);
+    db->recovering = false;
+    free(log_file);
+    dbsync(db);
+    // Warm the cache with the top of the tree
+    struct Chunk *root = node_get(db, db->header.root_offset);
+    if (!root->leaf)
+        node_prefetch(db, root->childs, root->n + 1);
+    return db;
+}
+
+// External API
+
+int db_close(struct DB *db) {
+    return db->close(db);
+}
+
+int db_sync(struct DB *db) {
+    return db->sync(db);
+}
+
+int db_del(struct DB *db, void *key, size_t key_len) {
+    struct DBT keyt = {
+            .data = key,
+            .size = key_len
+    };
+    return db->del(db, &keyt);
+}
+
+int db_get(struct DB *db, void *key, size_t key_len, void **val, size_t *val_len) {
+    struct DBT keyt = {
+            .data = key,
+            .size = key_len
+    };
+    struct DBT valt = {0, 0};
+    int rc = db->get(db, &keyt, &valt);
+    *val = valt.data;
+    *val_len = valt.size;
+    return rc;
+}
+
+int db_get_view(struct DB *db, void *key, size_t key_len, struct DB_View *view) {
+    struct DBT keyt = {
+            .data = key,
+            .size = key_len
+    };
+    return view_get(db, &keyt, view);
+}
+
+void db_release(struct DB *db, struct DB_View *view) {
+    view_release(db, view);
+}
+
+int db_get_into(struct DB *db, void *key, size_t key_len, void *buf, size_t buf_len, size_t *val_len) {
+    struct DBT keyt = {
+            .data = key,
+            .size = key_len
+    };
+    return get_into(db, &keyt, buf, buf_len, val_len);
+}
+
+int db_get_part(struct DB *db, void *key, size_t key_len, size_t offset, void *buf, size_t *len) {
+    struct DBT keyt = {
+            .data = key,
+            .size = key_len
+    };
+    return get_part(db, &keyt, offset, buf, len);
+}
+
+int db_get_stream(struct DB *db, void *key, size_t key_len, size_t offset, size_t len,
+                  void (*visit)(void *arg, void *part, size_t part_len), void *arg) {
+    struct DBT keyt = {
+            .data = key,
+            .size = key_len
+    };
+    return get_stream(db, &keyt, offset, len, visit, arg);
+}
+
+size_t db_multi_get(struct DB *db, size_t count, void **keys, size_t *key_lens, void **vals, size_t *val_lens) {
+    struct Batch_Op *ops = (struct Batch_Op *) calloc(count + 1, sizeof(*ops));
+    for (size_t i = 0; i < count; i++) {
+        ops[i].key = (struct DBT) {keys[i], key_lens[i]};
+        ops[i].seq = i;
+    }
+    const size_t found = multi_get(db, ops, count);
+    for (size_t i = 0; i < count; i++) {
+        const size_t seq = ops[i].seq;
+        vals[seq] = ops[i].data.data;
+        val_lens[seq] = ops[i].data.size;
+    }
+    free(ops);
+    return found;
+}
+
+int db_write_batch(struct DB *db, struct DB_Write *writes, size_t count) {
+    struct Batch_Op *ops = (struct Batch_Op *) calloc(count + 1, sizeof(*ops));
+    for (size_t i = 0; i < count; i++) {
+        ops[i].op = writes[i].del ? 'd' : 'i';
+        ops[i].key = (struct DBT) {writes[i].key, writes[i].key_len};
+        ops[i].data = (struct DBT) {writes[i].val, writes[i].del ? 0 : writes[i].val_len};
+        ops[i].seq = i;
+    }
+    const int res = write_batch(db, ops, count);
+    free(ops);
+    return res;
+}
+
+int db_bulk_load(struct DB *db,
+                 int (*next)(void *arg, void **key, size_t *key_len, void **val, size_t *val_len),
+                 void *arg, unsigned fill) {
+    return bulk_load(db, next, arg, fill);
+}
+
+int db_compact(struct DB *db, size_t steps) {
+    return compact(db, steps);
+}
+
+int db_put(struct DB *db, void *key, size_t key_len,
+        void *val, size_t val_len) {
+    struct DBT keyt = {
+            .data = key,
+            .size = key_len
+    };
+    struct DBT valt = {
+            .data = val,
+            .size = val_len
+    };
+    return db->put(db, &keyt, &valt);
+}
+
+unsigned db_last_lsn(struct DB *db) {
+    return lsn_current(db);
+}
+
+int db_wait_durable(struct DB *db, unsigned LSN) {
+    log_wait(db->log, LSN);
+    return 0;
+}
+
+void db_cache_stats(struct DB *db, struct DB_Cache_Stats *stats) {
+    stats->capacity = db->cache.n;
+    stats->count = db->cache.count;
+    stats->hits = 0;
+    for (int i = 0; i < CACHE_HIT_STRIPES; i++)
+        stats->hits += db->cache.hits[i].count;
+    stats->misses = db->cache.misses;
+    stats->evictions = db->cache.evictions;
+    stats->dirty = db->cache.dirty;
+    stats->writes = db->cache.writes;
+}
+
+struct DB_Cursor *db_cursor_open(struct DB *db) {
+    return cursor_open(db);
+}
+
+int db_cursor_seek(struct DB_Cursor *cursor, void *key, size_t key_len) {
+    struct DBT keyt = {
+            .data = key,
+            .size = key_len
+    };
+    cursor_seek(cursor, &keyt);
+    return 0;
+}
+
+int db_cursor_last(struct DB_Cursor *cursor) {
+    cursor_last(cursor);
+    return 0;
+}
+
+int db_cursor_next(struct DB_Cursor *cursor, void **key, size_t *key_len, void **val, size_t *val_len) {
+    if (cursor_next(cursor))
+        return 1;
+    *key = cursor->key.data;
+    *key_len = cursor->key.size;
+    *val = cursor->data.data;
+    *val_len = cursor->data.size;
+    return 0;
+}
+
+int db_cursor_prev(struct DB_Cursor *cursor, void **key, size_t *key_len, void **val, size_t *val_len) {
+    if (cursor_prev(cursor))
+        return 1;
+    *key = cursor->key.data;
+    *key_len = cursor->key.size;
+    *val = cursor->data.data;
+    *val_len = cursor->data.size;
+    return 0;
+}
+
+size_t db_cursor_range(struct DB_Cursor *cursor, void *to, size_t to_len, size_t limit,
+                       void (*visit)(void *arg, void *key, size_t key_len, void *val, size_t val_len),
+                       void *arg) {
+    struct DBT tot = {
+            .data = to,
+            .size = to_len
+    };
+    return cursor_range(cursor, to ? &tot : NULL, limit, visit, arg);
+}
+
+void db_cursor_close(struct DB_Cursor *cursor) {
+    cursor_close(cursor);
+}
+
+// Snapshots
+
+// A snapshot reads the tree as it was when it opened, while writers go on
+// changing chunks in place. The first time a chunk that existed then is
+// changed, freed or moved, its image is copied aside for every snapshot
+// that does not hold one yet, and reads of that offset through the
+// snapshot find the copy. A chunk whose LSN is past the snapshot's was
+// written since, so its old image is either held already or the chunk is
+// newer than the snapshot and not reachable from its root, so writers
+// check the LSN of the newest snapshot before taking the lock at all.
+// Opening waits for running operations so that none straddles the
+// snapshot. Images stay in memory up to a quarter of mem_size over all
+// snapshots; past that each snapshot appends them to an unlinked file
+// beside the log. Images are freed with their snapshot.
+//
+// Reads take no latch: a chunk image is copied out of the cache or the
+// file, and the snapshot is looked up again afterwards. Anything that
+// changes the image, or the file or mapping under it, comes after the
+// copy aside, so if there is none by then what was copied is the image of
+// the snapshot.
+
+static struct Snapshot_Image *snapshot_slot(struct DB_Snapshot *snap, size_t offset) {
+    const size_t mask = ((size_t) 1 << snap->image_bits) - 1;
+    size_t i = offset_slot(offset, snap->image_bits);
+    while (snap->images[i].offset && snap->images[i].offset != offset)
+        i = (i + 1) & mask;
+    return &snap->images[i];
+}
+
+// Append an image to the spill file of the snapshot, creating the file
+// first. False if either fails; the image is then kept in memory.
+static bool snapshot_spill(struct DB *db, struct DB_Snapshot *snap, const char *raw, size_t *at) {
+    const size_t chunk_size = db->header.main_settings.chunk_size;
+    if (snap->spill < 0) {
+        const char *slash = strrchr(db->log->path, '/');
+        char *dir = slash ? strndup(db->log->path, slash - db->log->path + 1) : strdup(".");
+        snap->spill = open(dir, O_TMPFILE | O_RDWR, 0600);
+        free(dir);
+        if (snap->spill < 0)
+            return false;
+    }
+    if (pwrite(snap->spill, raw, chunk_size, snap->spill_size) != (ssize_t) chunk_size)
+        return false;
+    *at = snap->spill_size;
+    snap->spill_size += chunk_size;
+    return true;
+}
+
+static void snapshot_insert(struct DB *db, struct DB_Snapshot *snap, size_t offset, const char *raw) {
+    const size_t chunk_size = db->header.main_settings.chunk_size;
+    if (2 * (snap->image_count + 1) > ((size_t) 1 << snap->image_bits)) {
+        struct Snapshot_Image *old = snap->images;
+        const size_t old_size = (size_t) 1 << snap->image_bits;
+        snap->image_bits++;
+        snap->images = (struct Snapshot_Image *) calloc((size_t) 1 << snap->image_bits, sizeof(*old));
+        for (size_t i = 0; i < old_size; i++)
+            if (old[i].offset)
+                *snapshot_slot(snap, old[i].offset) = old[i];
+        free(old);
+    }
+    struct Snapshot_Image image = {offset, NULL, 0};
+    const bool spill = db->snapshot_memory + chunk_size > db->header.main_settings.mem_size / 4;
+    if (!spill || !snapshot_spill(db, snap, raw, &image.spill_at)) {
+        image.raw = (char *) malloc(chunk_size);
+        memcpy(image.raw, raw, chunk_size);
+        db->snapshot_memory += chunk_size;
+    }
+    *snapshot_slot(snap, offset) = image;
+    snap->image_count++;
+}
+
+// Copy the image of a chunk about to change aside for the snapshots that
+// may reach it. Called with the chunk latched or the tree held alone.
+static void snapshot_keep(struct DB *db, struct Chunk *node) {
+    if (!__atomic_load_n(&db->snapshots, __ATOMIC_ACQUIRE) || !node->raw_data
+        || node->LSN > __atomic_load_n(&db->snapshot_LSN, __ATOMIC_ACQUIRE))
+        return;
+    pthread_mutex_lock(&db->snapshot_lock);
+    for (struct DB_Snapshot *snap = db->snapshots; snap; snap = snap->next) {
+        if (node->LSN > snap->LSN || snapshot_slot(snap, node->offset)->offset)
+            continue;
+        snapshot_insert(db, snap, node->offset, (const char *) node->raw_data);
+    }
+    pthread_mutex_unlock(&db->snapshot_lock);
+}
+
+// Copy the image kept for the snapshot at offset into buf: 1 if there is
+// one, 0 if not and -1 if it was spilled and cannot be read back. Spilled
+// images never change and the file lasts as long as the snapshot, so they
+// are read without the lock.
+static int snapshot_held(struct DB_Snapshot *snap, size_t offset, char *buf) {
+    struct DB *db = snap->db;
+    const size_t chunk_size = db->header.main_settings.chunk_size;
+    pthread_mutex_lock(&db->snapshot_lock);
+    const struct Snapshot_Image image = *snapshot_slot(snap, offset);
+    if (image.raw)
+        memcpy(buf, image.raw, chunk_size);
+    pthread_mutex_unlock(&db->snapshot_lock);
+    if (!image.offset)
+        return 0;
+    if (!image.raw && pread(snap->spill, buf, chunk_size, image.spill_at) != (ssize_t) chunk_size) {
+        fprintf(stderr, "ERROR! Cannot read back a snapshot image.\n");
+        return -1;
+    }
+    return 1;
+}
+
+// Copy the image the chunk at offset had when the snapshot opened into buf
+static bool snapshot_read(struct DB_Snapshot *snap, size_t offset, char *buf) {
+    struct DB *db = snap->db;
+    int held = snapshot_held(snap, offset, buf);
+    if (held)
+        return held > 0;
+    epoch_enter();
+    struct Chunk *node = node_peek(db, offset);
+    const char *raw = node ? (const char *) __atomic_load_n(&node->raw_data, __ATOMIC_ACQUIRE) : NULL;
+    if (raw)
+        memcpy(buf, raw, db->header.main_settings.chunk_size);
+    epoch_leave();
+    held = snapshot_held(snap, offset, buf);
+    return held ? held > 0 : raw != NULL;
+}
+
+// Copy a value found in a snapshot image into dst, following its chain
+// through the snapshot; buf is a chunk of scratch space
+static bool snapshot_value(struct DB_Snapshot *snap, const struct DBT *value, char *buf, struct DBT *dst) {
+    if (!(value->size & VALUE_OVERFLOW)) {
+        dbt_assign(dst, value->data, value->size);
+        return true;
+    }
+    struct Overflow_Ref ref;
+    memcpy(&ref, value->data, sizeof(ref));
+    const size_t payload = overflow_payload(snap->db);
+    dst->data = realloc(dst->data, ref.size + 1);
+    dst->size = ref.size;
+    size_t offset = ref.first;
+    for (size_t done = 0; done < ref.size; done += payload) {
+        if (!snapshot_read(snap, offset, buf))
+            return false;
+        const size_t part = ref.size - done < payload ? ref.size - done : payload;
+        memcpy((char *) dst->data + done, buf + OVERFLOW_HEADER, part);
+        memcpy(&offset, buf + sizeof(struct Chunk_Header), sizeof(offset));
+    }
+    return true;
+}
+
+static int snapshot_get(struct DB_Snapshot *snap, const struct DBT *key, struct DBT *dst) {
+    struct DB *db = snap->db;
+    char *buf = (char *) malloc(db->header.main_settings.chunk_size);
+    size_t offset = snap->root;
+    int rc = 1;
+    for (int depth = 0; depth < PATH_MAX_DEPTH; depth++) {
+        struct Chunk_Image image;
+        struct DBT suffix, value;
+        bool found;
+        int index;
+        if (!snapshot_read(snap, offset, buf) || !image_parse(db, buf, &image)
+            || (index = image_search(db, &image, key, &found)) < 0)
+            break;
+        if (found && (image.leaf || !tree_bplus(db))) {
+            if (image_entry(db, &image, index, &suffix, &value) && snapshot_value(snap, &value, buf, dst))
+                rc = 0;
+            break;
+        }
+        if (image.leaf)
+            break;
+        offset = image_child(&image, found && tree_bplus(db) ? index + 1 : index);
+    }
+    free(buf);
+    return rc;
+}
+
+struct Snapshot_Walk {
+    struct DB_Snapshot *snap;
+    const struct DBT *from;
+    const struct DBT *to;
+    size_t limit;
+    size_t count;
+    void (*visit)(void *, void *, size_t, void *, size_t);
+    void *arg;
+    /* An image per depth, and scratch space for overflow chains */
+    char *bufs;
+    struct DBT key;
+    struct DBT data;
+};
+
+// Visit the entries of the subtree in key order; false once the walk is over
+static bool snapshot_walk(struct Snapshot_Walk *walk, size_t offset, int depth) {
+    struct DB *db = walk->snap->db;
+    const size_t chunk_size = db->header.main_settings.chunk_size;
+    char *buf = walk->bufs + (depth + 1) * chunk_size;
+    struct Chunk_Image image;
+    if (depth == PATH_MAX_DEPTH || !snapshot_read(walk->snap, offset, buf) || !image_parse(db, buf, &image))
+        return false;
+    bool found = false;
+    const int first = walk->from ? image_search(db, &image, walk->from, &found) : 0;
+    if (first < 0)
+        return false;
+    const bool internal = !image.leaf && image.childs;
+    for (int i = first; i <= (int) image.n; i++) {
+        // Keys in the child left of an entry equal to from are all smaller
+        if (internal && !(i == first && found) && !snapshot_walk(walk, image_child(&image, i), depth + 1))
+            return false;
+        if (i == (int) image.n || (internal && tree_bplus(db)))
+            continue;
+        struct DBT suffix, value;
+        if (!image_entry(db, &image, i, &suffix, &value))
+            return false;
+        image_key(&image, &suffix, &walk->key);
+        if (walk->to && keycmp(&walk->key, walk->to) >= 0)
+            return false;
+        if (!snapshot_value(walk->snap, &value, walk->bufs, &walk->data))
+            return false;
+        walk->visit(walk->arg, walk->key.data, walk->key.size, walk->data.data, walk->data.size);
+        if (++walk->count == walk->limit)
+            return false;
+    }
+    return true;
+}
+
+static size_t snapshot_range(struct DB_Snapshot *snap, const struct DBT *from, const struct DBT *to, size_t limit,
+                             void (*visit)(void *, void *, size_t, void *, size_t), void *arg) {
+    const size_t chunk_size = snap->db->header.main_settings.chunk_size;
+    struct Snapshot_Walk walk = {snap, from, to, limit, 0, visit, arg};
+    if (!limit)
+        return 0;
+    walk.bufs = (char *) malloc((PATH_MAX_DEPTH + 1) * chunk_size);
+    snapshot_walk(&walk, snap->root, 0);
+    free(walk.bufs);
+    free(walk.key.data);
+    free(walk.data.data);
+    return walk.count;
+}
+
+// The tree is held alone for a moment, so that the root and the LSN taken
+// are those of a tree no operation is halfway through
+struct DB_Snapshot *db_snapshot_open(struct DB *db) {
+    struct DB_Snapshot *snap = (struct DB_Snapshot *) malloc(sizeof(*snap));
+    snap->db = db;
+    snap->image_bits = 4;
+    snap->image_count = 0;
+    snap->images = (struct Snapshot_Image *) calloc((size_t) 1 << snap->image_bits, sizeof(*snap->images));
+    snap->spill = -1;
+    snap->spill_size = 0;
+    pthread_rwlock_wrlock(&db->tree_lock);
+    snap->root = db->header.root_offset;
+    snap->LSN = db->header.last_LSN;
+    pthread_mutex_lock(&db->snapshot_lock);
+    snap->next = db->snapshots;
+    __atomic_store_n(&db->snapshot_LSN, snap->LSN, __ATOMIC_RELEASE);
+    __atomic_store_n(&db->snapshots, snap, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&db->snapshot_lock);
+    pthread_rwlock_unlock(&db->tree_lock);
+    return snap;
+}
+
+int db_snapshot_get(struct DB_Snapshot *snap, void *key, size_t key_len, void **val, size_t *val_len) {
+    struct DBT keyt = {
+            .data = key,
+            .size = key_len
+    };
+    struct DBT valt = {0, 0};
+    int rc = snapshot_get(snap, &keyt, &valt);
+    if (rc) {
+        free(valt.data);
+        valt = (struct DBT) {0, 0};
+    }
+    *val = valt.data;
+    *val_len = valt.size;
+    return rc;
+}
+
+size_t db_snapshot_range(struct DB_Snapshot *snap, void *from, size_t from_len, void *to, size_t to_len,
+                         size_t limit,
+                         void (*visit)(void *arg, void *key, size_t key_len, void *val, size_t val_len),
+                         void *arg) {
+    struct DBT fromt = {
+            .data = from,
+            .size = from_len
+    };
+    struct DBT tot = {
+            .data = to,
+            .size = to_len
+    };
+    return snapshot_range(snap, from ? &fromt : NULL, to ? &tot : NULL, limit, visit, arg);
+}
+
+void db_snapshot_close(struct DB_Snapshot *snap) {
+    struct DB *db = snap->db;
+    pthread_mutex_lock(&db->snapshot_lock);
+    struct DB_Snapshot **link = &db->snapshots;
+    while (*link != snap)
+        link = &(*link)->next;
+    __atomic_store_n(link, snap->next, __ATOMIC_RELEASE);
+    unsigned newest = 0;
+    for (struct DB_Snapshot *open = db->snapshots; open; open = open->next)
+        newest = open->LSN > newest ? open->LSN : newest;
+    __atomic_store_n(&db->snapshot_LSN, newest, __ATOMIC_RELEASE);
+    for (size_t i = 0; i < ((size_t) 1 << snap->image_bits); i++) {
+        if (snap->images[i].raw)
+            db->snapshot_memory -= db->header.main_settings.chunk_size;
+        free(snap->images[i].raw);
+    }
+    pthread_mutex_unlock(&db->snapshot_lock);
+    if (snap->spill >= 0)
+        close(snap->spill);
+    free(snap->images);
+    free(snap);
+}
+
+// Shards
+
+// A sharded handle partitions keys over several DBs, each in its own file
+// with its own log, tree and share of the cache, so writers to different
+// shards share no lock, root or LSN. Keys go to a shard by hash, or by
+// range when split keys are given. A manifest at the given path records
+// the layout; shard i lives in <path>.<i> with its log in <path>.<i>.log.
+// Batches are split by shard and each part is applied as one batch, so a
+// batch is atomic within a shard but not across shards.
+
+// Manifest: header, then the length and bytes of each split key
+struct Shards_Manifest {
+    size_t count;
+    size_t bounds;
+};
+
+static uint64_t key_hash(const struct DBT *key) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < key->size; i++)
+        hash = (hash ^ ((const unsigned char *) key->data)[i]) * 1099511628211ULL;
+    return hash;
+}
+
+static size_t shard_index(struct DB_Shards *shards, const struct DBT *key) {
+    if (!shards->bounds)
+        return key_hash(key) % shards->count;
+    // Shard i holds the keys from split key i - 1 up to split key i
+    size_t low = 0, high = shards->count - 1;
+    while (low < high) {
+        const size_t mid = (low + high) / 2;
+        if (keycmp(key, &shards->bounds[mid]) < 0)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+    return low;
+}
+
+static char *shard_path(const char *file, size_t index) {
+    char *path = (char *) malloc(strlen(file) + 24);
+    sprintf(path, "%s.%zu", file, index);
+    return path;
+}
+
+// Remove the files and logs of the first count shards
+static void shards_remove(const char *file, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        char *path = shard_path(file, i);
+        unlink(path);
+        char *log_file = log_path(path);
+        log_remove(log_file);
+        free(log_file);
+        free(path);
+    }
+}
+
+static struct DB_Shards *shards_alloc(size_t count, size_t bounds) {
+    struct DB_Shards *shards = (struct DB_Shards *) calloc(1, sizeof(*shards));
+    shards->count = count;
+    shards->shards = (struct DB **) calloc(count, sizeof(*shards->shards));
+    if (bounds)
+        shards->bounds = (struct DBT *) calloc(count, sizeof(*shards->bounds));
+    return shards;
+}
+
+// Split keys must increase for shard_index to route by them
+static bool shards_bounds_valid(struct DB_Shards *shards) {
+    if (!shards->bounds)
+        return true;
+    for (size_t i = 1; i + 1 < shards->count; i++) {
+        if (keycmp(&shards->bounds[i - 1], &shards->bounds[i]) >= 0)
+            return false;
+    }
+    return true;
+}
+
+// Close the shards opened so far and free the handle
+static int shards_close(struct DB_Shards *shards) {
+    int res = 0;
+    for (size_t i = 0; i < shards->count; i++) {
+        if (shards->shards[i])
+            res |= db_close(shards->shards[i]);
+    }
+    if (shards->bounds) {
+        for (size_t i = 0; i + 1 < shards->count; i++)
+            free(shards->bounds[i].data);
+        free(shards->bounds);
+    }
+    free(shards->shards);
+    free(shards);
+    return res;
+}
+
+static bool shards_manifest_write(const char *file, struct DB_Shards *shards) {
+    const int fd = open(file, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR|S_IRUSR);
+    if (fd < 0)
+        return false;
+    const struct Shards_Manifest manifest = {shards->count, shards->bounds ? shards->count - 1 : 0};
+    bool written = write(fd, &manifest, sizeof(manifest)) == sizeof(manifest);
+    for (size_t i = 0; written && i < manifest.bounds; i++) {
+        const struct DBT *bound = &shards->bounds[i];
+        written = write(fd, &bound->size, sizeof(bound->size)) == sizeof(bound->size)
+                  && write(fd, bound->data, bound->size) == (ssize_t) bound->size;
+    }
+    written = written && fsync(fd) == 0;
+    return close(fd) == 0 && written;
+}
+
+// Split keys are read back no longer than the file they are in
+static bool shards_manifest_read(int fd, struct DB_Shards *shards, size_t bounds) {
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) < 0)
+        return false;
+    for (size_t i = 0; i < bounds; i++) {
+        size_t size;
+        if (read(fd, &size, sizeof(size)) != sizeof(size) || size > (size_t) file_stat.st_size)
+            return false;
+        shards->bounds[i] = (struct DBT) {malloc(size + 1), size};
+        if (read(fd, shards->bounds[i].data, size) != (ssize_t) size)
+            return false;
+    }
+    return true;
+}
+
+struct DB_Shards *db_shards_create(char *file, struct DBC conf, size_t count, void **bounds, size_t *bound_lens) {
+    if (count == 0)
+        return NULL;
+    struct DB_Shards *shards = shards_alloc(count, bounds != NULL);
+    for (size_t i = 0; bounds && i + 1 < count; i++) {
+        shards->bounds[i] = (struct DBT) {malloc(bound_lens[i] + 1), bound_lens[i]};
+        memcpy(shards->bounds[i].data, bounds[i], bound_lens[i]);
+    }
+    if (!shards_bounds_valid(shards)) {
+        fprintf(stderr, "ERROR! Split keys do not increase.\n");
+        shards_close(shards);
+        return NULL;
+    }
+    if (!shards_manifest_write(file, shards)) {
+        fprintf(stderr, "ERROR! Cannot write the shard layout to %s.\n", file);
+        unlink(file);
+        shards_close(shards);
+        return NULL;
+    }
+    // Each shard gets an equal slice of the cache
+    conf.mem_size /= count;
+    for (size_t i = 0; i < count; i++) {
+        char *path = shard_path(file, i);
+        shards->shards[i] = dbcreate(path, conf);
+        free(path);
+        if (!shards->shards[i]) {
+            shards_close(shards);
+            shards_remove(file, i + 1);
+            unlink(file);
+            return NULL;
         }
-        if (index < node->n) {
-            right = node_get(db, node->childs[index + 1]);
-            //printf("right.offset == %d, right.n == %d\n", right->offset, right->n);
-            if (right->n >= T) {
-                return exchange(db, node, index, right, child, true);
-            }
+    }
+    return shards;
+}
+
+struct DB_Shards *db_shards_open(char *file) {
+    const int fd = open(file, O_RDONLY);
+    struct Shards_Manifest manifest;
+    if (fd < 0 || read(fd, &manifest, sizeof(manifest)) != sizeof(manifest) || manifest.count == 0
+        || (manifest.bounds && manifest.bounds != manifest.count - 1)) {
+        fprintf(stderr, "ERROR! Cannot read the shard layout from %s.\n", file);
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    struct DB_Shards *shards = shards_alloc(manifest.count, manifest.bounds);
+    const bool valid = shards_manifest_read(fd, shards, manifest.bounds) && shards_bounds_valid(shards);
+    close(fd);
+    if (!valid) {
+        fprintf(stderr, "ERROR! Cannot read the shard layout from %s.\n", file);
+        shards_close(shards);
+        return NULL;
+    }
+    for (size_t i = 0; i < manifest.count; i++) {
+        char *path = shard_path(file, i);
+        shards->shards[i] = dbopen(path);
+        free(path);
+        if (!shards->shards[i]) {
+            shards_close(shards);
+            return NULL;
         }
-        if (left) {
-            return merge(db, node, index - 1, child, left, false);
-        } else {
-            return merge(db, node, index, child, right, true);
+    }
+    return shards;
+}
+
+int db_shards_close(struct DB_Shards *shards) {
+    return shards_close(shards);
+}
+
+int db_shards_sync(struct DB_Shards *shards) {
+    int res = 0;
+    for (size_t i = 0; i < shards->count; i++)
+        res |= db_sync(shards->shards[i]);
+    return res;
+}
+
+struct DB *db_shard(struct DB_Shards *shards, void *key, size_t key_len) {
+    struct DBT keyt = {key, key_len};
+    return shards->shards[shard_index(shards, &keyt)];
+}
+
+int db_shards_put(struct DB_Shards *shards, void *key, size_t key_len, void *val, size_t val_len) {
+    return db_put(db_shard(shards, key, key_len), key, key_len, val, val_len);
+}
+
+int db_shards_get(struct DB_Shards *shards, void *key, size_t key_len, void **val, size_t *val_len) {
+    return db_get(db_shard(shards, key, key_len), key, key_len, val, val_len);
+}
+
+int db_shards_del(struct DB_Shards *shards, void *key, size_t key_len) {
+    return db_del(db_shard(shards, key, key_len), key, key_len);
+}
+
+// Positions 0..count-1 grouped by shard, keeping their order within each;
+// the group of shard i is order[start[i] .. start[i + 1])
+static size_t *shards_group(struct DB_Shards *shards, size_t count, void **keys, size_t *key_lens, size_t *start) {
+    size_t *owner = (size_t *) malloc((count + 1) * sizeof(*owner));
+    size_t *order = (size_t *) malloc((count + 1) * sizeof(*order));
+    memset(start, 0, (shards->count + 1) * sizeof(*start));
+    for (size_t i = 0; i < count; i++) {
+        const struct DBT key = {keys[i], key_lens[i]};
+        owner[i] = shard_index(shards, &key);
+        start[owner[i] + 1]++;
+    }
+    for (size_t s = 0; s < shards->count; s++)
+        start[s + 1] += start[s];
+    size_t *next = (size_t *) malloc((shards->count + 1) * sizeof(*next));
+    memcpy(next, start, (shards->count + 1) * sizeof(*next));
+    for (size_t i = 0; i < count; i++)
+        order[next[owner[i]]++] = i;
+    free(next);
+    free(owner);
+    return order;
+}
+
+size_t db_shards_multi_get(struct DB_Shards *shards, size_t count, void **keys, size_t *key_lens,
+                           void **vals, size_t *val_lens) {
+    size_t *start = (size_t *) malloc((shards->count + 1) * sizeof(*start));
+    size_t *order = shards_group(shards, count, keys, key_lens, start);
+    void **part_keys = (void **) malloc((count + 1) * sizeof(*part_keys));
+    void **part_vals = (void **) malloc((count + 1) * sizeof(*part_vals));
+    size_t *part_key_lens = (size_t *) malloc((count + 1) * sizeof(*part_key_lens));
+    size_t *part_val_lens = (size_t *) malloc((count + 1) * sizeof(*part_val_lens));
+    for (size_t i = 0; i < count; i++) {
+        part_keys[i] = keys[order[i]];
+        part_key_lens[i] = key_lens[order[i]];
+    }
+    size_t found = 0;
+    for (size_t s = 0; s < shards->count; s++) {
+        const size_t from = start[s];
+        if (start[s + 1] > from)
+            found += db_multi_get(shards->shards[s], start[s + 1] - from, part_keys + from, part_key_lens + from,
+                                  part_vals + from, part_val_lens + from);
+    }
+    for (size_t i = 0; i < count; i++) {
+        vals[order[i]] = part_vals[i];
+        val_lens[order[i]] = part_val_lens[i];
+    }
+    free(part_keys);
+    free(part_vals);
+    free(part_key_lens);
+    free(part_val_lens);
+    free(order);
+    free(start);
+    return found;
+}
+
+int db_shards_write_batch(struct DB_Shards *shards, struct DB_Write *writes, size_t count) {
+    // Refuse the whole batch before any shard applies its part
+    for (size_t i = 0; i < count; i++) {
+        struct DBT key = {writes[i].key, writes[i].key_len}, data = {writes[i].val, writes[i].val_len};
+        if (!writes[i].del && entry_too_large(shards->shards[shard_index(shards, &key)], &key, &data))
+            return 1;
+    }
+    void **keys = (void **) malloc((count + 1) * sizeof(*keys));
+    size_t *key_lens = (size_t *) malloc((count + 1) * sizeof(*key_lens));
+    for (size_t i = 0; i < count; i++) {
+        keys[i] = writes[i].key;
+        key_lens[i] = writes[i].key_len;
+    }
+    size_t *start = (size_t *) malloc((shards->count + 1) * sizeof(*start));
+    size_t *order = shards_group(shards, count, keys, key_lens, start);
+    struct DB_Write *part = (struct DB_Write *) malloc((count + 1) * sizeof(*part));
+    for (size_t i = 0; i < count; i++)
+        part[i] = writes[order[i]];
+    int res = 0;
+    for (size_t s = 0; s < shards->count; s++) {
+        if (start[s + 1] > start[s])
+            res |= db_write_batch(shards->shards[s], part + start[s], start[s + 1] - start[s]);
+    }
+    free(part);
+    free(order);
+    free(start);
+    free(key_lens);
+    free(keys);
+    return res;
+}
+
+// Verify
+
+// db_verify walks the tree as it lies in the file, without the cache or
+// the log, so the DB must have been closed cleanly. The top of the tree
+// is checked first until there are enough subtrees to go around, then
+// threads take subtrees one at a time. Chunks are parsed only through
+// the bounds-checked image readers, so a damaged one cannot mislead the
+// walk. A shared bitmap tells chunks reached twice, and afterwards the
+// chunks the free-space map holds that were never reached.
+
+#define VERIFY_TASKS_PER_THREAD 4
+// A crash can leave a few chunks in use that nothing links to. More than
+// one in this many of the chunks reached means a subtree was cut off.
+#define VERIFY_LEAK_RATIO 16
+
+// A subtree still to be checked, with the keys that bound it
+struct Verify_Task {
+    size_t offset;
+    int depth;
+    struct DBT low;
+    struct DBT high;
+    bool has_low;
+    bool has_high;
+};
+
+struct Verify_Tasks {
+    struct Verify_Task *items;
+    size_t count;
+    size_t cap;
+};
+
+struct Verify {
+    struct DB *db;
+    /* Chunks reached so far, laid out like the free-space map */
+    uint64_t *reached;
+    /* Depth of the leaves, -1 until the first is reached */
+    atomic_int leaf_depth;
+    struct Verify_Tasks tasks;
+    atomic_size_t next;
+};
+
+// State of one thread
+struct Verify_Walk {
+    struct Verify *verify;
+    /* An image per depth, and scratch space for overflow chains */
+    char *bufs;
+    /* Two keys per depth, the entry just read and the one before */
+    struct DBT *keys;
+    struct DB_Verify_Report report;
+};
+
+static void verify_task_add(struct Verify_Tasks *tasks, size_t offset, int depth,
+                            const struct DBT *low, const struct DBT *high) {
+    if (tasks->count == tasks->cap) {
+        tasks->cap = tasks->cap ? 2 * tasks->cap : 16;
+        tasks->items = (struct Verify_Task *) realloc(tasks->items, tasks->cap * sizeof(*tasks->items));
+    }
+    struct Verify_Task *task = &tasks->items[tasks->count++];
+    memset(task, 0, sizeof(*task));
+    task->offset = offset;
+    task->depth = depth;
+    if ((task->has_low = low))
+        dbt_assign(&task->low, low->data, low->size);
+    if ((task->has_high = high))
+        dbt_assign(&task->high, high->data, high->size);
+}
+
+static void verify_tasks_free(struct Verify_Tasks *tasks) {
+    for (size_t i = 0; i < tasks->count; i++) {
+        free(tasks->items[i].low.data);
+        free(tasks->items[i].high.data);
+    }
+    free(tasks->items);
+    *tasks = (struct Verify_Tasks) {NULL, 0, 0};
+}
+
+// Read a chunk linked from another into buf, once. False if the link or
+// the chunk is bad, which is reported.
+static bool verify_read(struct Verify_Walk *walk, size_t from, size_t offset, char *buf) {
+    struct DB *db = walk->verify->db;
+    if (!chunk_valid(db, offset)) {
+        fprintf(stderr, "Link from %zu to %zu, which is not a chunk in use.\n", from, offset);
+        walk->report.bad_links++;
+        return false;
+    }
+    const size_t index = chunk_index(db, offset);
+    const uint64_t bit = (uint64_t) 1 << (index % 64);
+    if (__atomic_fetch_or(&walk->verify->reached[index / 64], bit, __ATOMIC_RELAXED) & bit) {
+        fprintf(stderr, "Link from %zu to %zu, which is reached twice.\n", from, offset);
+        walk->report.bad_links++;
+        return false;
+    }
+    walk->report.chunks++;
+    if (db->read(db, buf, db->header.main_settings.chunk_size, offset) < 0 || !chunk_intact(db, buf)) {
+        fprintf(stderr, "Chunk at %zu fails its checksum.\n", offset);
+        walk->report.corrupt++;
+        return false;
+    }
+    return true;
+}
+
+// Follow the overflow chain of a value stored in the chunk at from
+static void verify_chain(struct Verify_Walk *walk, size_t from, const struct DBT *value) {
+    struct DB *db = walk->verify->db;
+    struct Overflow_Ref ref;
+    memcpy(&ref, value->data, sizeof(ref));
+    const size_t count = overflow_count(db, &(struct DBT) {NULL, ref.size});
+    size_t offset = ref.first;
+    for (size_t i = 0; i < count; i++) {
+        if (!offset) {
+            fprintf(stderr, "Overflow chain from %zu ends after %zu of %zu chunks.\n", from, i, count);
+            walk->report.bad_links++;
+            return;
         }
+        if (!verify_read(walk, from, offset, walk->bufs))
+            return;
+        from = offset;
+        memcpy(&offset, walk->bufs + sizeof(struct Chunk_Header), sizeof(offset));
+    }
+    if (offset) {
+        fprintf(stderr, "Overflow chain ends at %zu but links on to %zu.\n", from, offset);
+        walk->report.bad_links++;
     }
 }
 
-struct DBT *pull_neighbour(struct DB *db, struct Chunk *node, bool left) {
-    //printf("pull neibour func\n");
-    int index = left ? 0 : node->n - 1;
-    if (node->leaf) {
-        // Generating result (key + data)
-        struct DBT *result = (struct DBT *) malloc(sizeof(*result) * 2);
-        result[0].size = node->keys[index].size;
-        result[0].data = malloc(result[0].size);
-        memcpy(result[0].data, node->keys[index].data, result[0].size);
-        result[1].size = node->data[index].size;
-        result[1].data = malloc(result[1].size);
-        memcpy(result[1].data, node->data[index].data, result[1].size);
-        // Shrink node by 1
-        node_shift_left(node, index, 1, false);
-        node_write(db, node);
-        return result;
-    } else {
-        struct Chunk *child = fix_child(db, node, index + (left ? 0 : 1));
-        return pull_neighbour(db, child, left);
+// Whether key lies in the range a parent gives the subtree. Keys equal
+// to a separator go right in B+tree mode, and a separator may also equal
+// the upper bound.
+static bool verify_in_range(struct DB *db, const struct DBT *key, const struct DBT *low, const struct DBT *high,
+                            bool separator) {
+    const bool bplus = tree_bplus(db);
+    if (low) {
+        const int cmp = keycmp(key, low);
+        if (cmp < 0 || (cmp == 0 && !bplus))
+            return false;
+    }
+    if (high) {
+        const int cmp = keycmp(key, high);
+        if (cmp > 0 || (cmp == 0 && !(bplus && separator)))
+            return false;
     }
+    return true;
 }
 
-int del(struct DB *db, struct Chunk *node, struct DBT *key) {
-    //printf("del func\n");
-    //printf("node.offest = %d\n", node->offset);
-    int index = 0;
-    while (index < node->n && keycmp(key, &node->keys[index]) > 0) {
-        index++;
+// Check the subtree at offset. Its children are checked too, or added
+// to defer if given.
+static void verify_node(struct Verify_Walk *walk, size_t from, size_t offset, int depth,
+                        const struct DBT *low, const struct DBT *high, struct Verify_Tasks *defer) {
+    struct Verify *verify = walk->verify;
+    struct DB *db = verify->db;
+    const size_t chunk_size = db->header.main_settings.chunk_size;
+    if (depth == PATH_MAX_DEPTH) {
+        fprintf(stderr, "Chunk at %zu is deeper than any tree.\n", offset);
+        walk->report.bad_links++;
+        return;
     }
-    /*
-    if (index < node->n)
-        printf("now we at %s, that is greater or equal %s\n", node->keys[index].data, key->data);
-    else
-        printf("we are out of scope\n");
-    */
-    if (index < node->n && keycmp(key, &node->keys[index]) == 0) {
-        if (node->leaf) {
-            node_shift_left(node, index, 1, false);
-            node_write(db, node);
-            return 0;
-        } else {
-            struct DBT *replacement = NULL;
-            struct Chunk *left_child, *right_child = NULL;
-            left_child = node_get(db, node->childs[index]);
-            if (left_child->n >= T) {
-                replacement = pull_neighbour(db, left_child, false);
-            } else {
-                right_child = node_get(db, node->childs[index + 1]);
-                if (right_child->n >= T) {
-                    replacement = pull_neighbour(db, right_child, true);
-                }
+    char *buf = walk->bufs + (depth + 1) * chunk_size;
+    struct Chunk_Image image;
+    if (!verify_read(walk, from, offset, buf))
+        return;
+    if (!image_parse(db, buf, &image)) {
+        fprintf(stderr, "Chunk at %zu has a layout that does not fit in it.\n", offset);
+        walk->report.malformed++;
+        return;
+    }
+    const bool internal = !image.leaf;
+    if (!internal) {
+        int expected = -1;
+        if (!atomic_compare_exchange_strong(&verify->leaf_depth, &expected, depth) && expected != depth) {
+            fprintf(stderr, "Leaf at %zu is at depth %d, others at %d.\n", offset, depth, expected);
+            walk->report.bad_links++;
+        }
+    }
+    struct DBT *keys = walk->keys + 2 * depth;
+    size_t used = sizeof(struct Chunk_Header) + image.prefix + (internal ? (image.n + 1) * sizeof(size_t) : 0);
+    for (int i = 0; i <= (int) image.n; i++) {
+        struct DBT *key = &keys[i % 2], *prev = i ? &keys[(i + 1) % 2] : NULL;
+        if (i < (int) image.n) {
+            struct DBT suffix, value;
+            if (!image_entry(db, &image, i, &suffix, &value)) {
+                fprintf(stderr, "Entry %d of the chunk at %zu does not fit in it.\n", i, offset);
+                walk->report.malformed++;
+                return;
             }
-            if (replacement) {
-                node->keys[index] = replacement[0];
-                node->data[index] = replacement[1];
-                node_write(db, node);
-                free(replacement[0].data);
-                free(replacement[1].data);
-                free(replacement);
-                return 0;
-            } else {
-                left_child = merge(db, node, index, left_child, right_child, true);
-                return del(db, left_child, key);
+            used += CELL_OVERHEAD + suffix.size + value_bytes(&value);
+            image_key(&image, &suffix, key);
+            if ((prev && keycmp(prev, key) >= 0) || !verify_in_range(db, key, low, high, internal)) {
+                fprintf(stderr, "Key %d of the chunk at %zu is out of order.\n", i, offset);
+                walk->report.misordered++;
             }
+            if ((value.size & VALUE_OVERFLOW) && !(internal && tree_bplus(db)))
+                verify_chain(walk, offset, &value);
         }
-    } else if (node->leaf) {
-        printf("Not found\n");
-        return -1;
-    } else {
-        struct Chunk *child = fix_child(db, node, index);
-        return del(db, child, key);
+        if (!internal)
+            continue;
+        const struct DBT *child_low = prev ? prev : low, *child_high = i < (int) image.n ? key : high;
+        if (defer)
+            verify_task_add(defer, image_child(&image, i), depth + 1, child_low, child_high);
+        else
+            verify_node(walk, offset, image_child(&image, i), depth + 1, child_low, child_high, NULL);
+    }
+    if (depth > 0 && used < chunk_size / 4) {
+        fprintf(stderr, "Chunk at %zu is filled to %zu bytes only.\n", offset, used);
+        walk->report.underfull++;
     }
 }
 
-int dbdel(struct DB *db, struct DBT *key) {
-    //printf("-------------------\ndeleting %s\n", (char *) key->data);
-    struct Chunk *root = node_get(db, db->header.root_offset);
-    struct Record record;
-    record.LSN = (db->header.last_LSN += 1);
-    record.op = 'd';
-    record.key = *key;
-    log_write(db->log, &record);
-    return del(db, root, key);
+static void verify_walk_init(struct Verify_Walk *walk, struct Verify *verify) {
+    const size_t chunk_size = verify->db->header.main_settings.chunk_size;
+    memset(walk, 0, sizeof(*walk));
+    walk->verify = verify;
+    walk->bufs = (char *) malloc((PATH_MAX_DEPTH + 1) * chunk_size);
+    walk->keys = (struct DBT *) calloc(2 * PATH_MAX_DEPTH, sizeof(*walk->keys));
 }
 
-// DB external managing
+static void verify_walk_free(struct Verify_Walk *walk) {
+    for (int i = 0; i < 2 * PATH_MAX_DEPTH; i++)
+        free(walk->keys[i].data);
+    free(walk->keys);
+    free(walk->bufs);
+}
 
-int dbclose(struct DB *db) {
+static void *verify_worker(void *arg) {
+    struct Verify_Walk *walk = (struct Verify_Walk *) arg;
+    struct Verify *verify = walk->verify;
+    size_t i;
+    while ((i = atomic_fetch_add(&verify->next, 1)) < verify->tasks.count) {
+        const struct Verify_Task *task = &verify->tasks.items[i];
+        verify_node(walk, 0, task->offset, task->depth, task->has_low ? &task->low : NULL,
+                    task->has_high ? &task->high : NULL, NULL);
+    }
+    return NULL;
+}
+
+static void verify_report_add(struct DB_Verify_Report *sum, const struct DB_Verify_Report *part) {
+    sum->chunks += part->chunks;
+    sum->corrupt += part->corrupt;
+    sum->malformed += part->malformed;
+    sum->misordered += part->misordered;
+    sum->bad_links += part->bad_links;
+    sum->underfull += part->underfull;
+    sum->leaked += part->leaked;
+}
+
+int db_verify(char *file, int threads, struct DB_Verify_Report *report) {
+    memset(report, 0, sizeof(*report));
+    struct DB *db = (struct DB *) calloc(1, sizeof(*db));
+    crc32c_init();
+    key_dispatch_init();
+    db->read = &dbread;
+    db->file = open(file, O_RDONLY);
+    if (db->file < 0 || db->read(db, (char *) &(db->header), sizeof(db->header), 0x0) < 0) {
+        if (db->file >= 0)
+            close(db->file);
+        free(db);
+        return -1;
+    }
+    freemap_open(db);
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    struct Verify verify = {.db = db};
+    verify.reached = (uint64_t *) calloc(1, freemap_bytes(db) + sizeof(uint64_t));
+    atomic_init(&verify.leaf_depth, -1);
+    atomic_init(&verify.next, 0);
+    struct Verify_Walk *walks = (struct Verify_Walk *) malloc(threads * sizeof(*walks));
+    for (int t = 0; t < threads; t++)
+        verify_walk_init(&walks[t], &verify);
+    // Split the top of the tree level by level until every thread can
+    // have a few subtrees
+    verify_task_add(&verify.tasks, db->header.root_offset, 0, NULL, NULL);
+    while (verify.tasks.count && verify.tasks.count < (size_t) threads * VERIFY_TASKS_PER_THREAD) {
+        struct Verify_Tasks below = {NULL, 0, 0};
+        for (size_t i = 0; i < verify.tasks.count; i++) {
+            const struct Verify_Task *task = &verify.tasks.items[i];
+            verify_node(&walks[0], 0, task->offset, task->depth, task->has_low ? &task->low : NULL,
+                        task->has_high ? &task->high : NULL, &below);
+        }
+        verify_tasks_free(&verify.tasks);
+        verify.tasks = below;
+    }
+    pthread_t *ids = (pthread_t *) malloc(threads * sizeof(*ids));
+    for (int t = 0; t < threads; t++)
+        pthread_create(&ids[t], NULL, &verify_worker, &walks[t]);
+    for (int t = 0; t < threads; t++) {
+        pthread_join(ids[t], NULL);
+        verify_report_add(report, &walks[t].report);
+        verify_walk_free(&walks[t]);
+    }
+    for (size_t index = 0; index < db->chunk_count; index++) {
+        const uint64_t bit = (uint64_t) 1 << (index % 64);
+        if ((db->chunk_map[index / 64] & bit) && !(verify.reached[index / 64] & bit)) {
+            fprintf(stderr, "Chunk at %zu is in use but not reached.\n",
+                    db->header.chunks_offset + index * db->header.main_settings.chunk_size);
+            report->leaked++;
+        }
+    }
+    verify_tasks_free(&verify.tasks);
+    free(ids);
+    free(walks);
+    free(verify.reached);
+    free(db->chunk_map);
+    close(db->file);
+    free(db);
+    return report->corrupt || report->malformed || report->misordered || report->bad_links
+           || report->leaked > report->chunks / VERIFY_LEAK_RATIO ? 1 : 0;
+}
+
+// Benchmarks
+
+static double elapsed_ms(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// Drop the handle the way a crash would: nothing is flushed or logged
+static void db_crash(struct DB *db) {
     log_close(db->log);
-    // Writing header
-    db->write(db, (char *) &(db->header), sizeof(db->header), 0x0);
-    // Close file
-    int res = close(db->file);
-    // Free memory
+    uring_close(db->uring);
+    close(db->file);
     cache_free(db);
+    epoch_flush();
+    db_unmap(db);
+    free(db->chunk_map);
+    free(db->compact_key.data);
+    pthread_rwlock_destroy(&db->tree_lock);
+    pthread_mutex_destroy(&db->alloc_lock);
+    pthread_mutex_destroy(&db->lsn_lock);
+    pthread_mutex_destroy(&db->snapshot_lock);
+    pthread_mutex_destroy(&db->flush_lock);
+    pthread_cond_destroy(&db->flush_done);
     free(db);
-    return res;
 }
 
-struct DB *dbInit() {
-    struct DB *db = (struct DB *) malloc(sizeof(struct DB));
-    db->read = &dbread;
-    db->write = &dbwrite;
-    db->get = &dbget;
-    db->put = &dbput;
-    db->del = &dbdel;
-    db->close = &dbclose;
-    return db;
+static size_t log_bytes(const char *path) {
+    size_t count, bytes = 0;
+    size_t *seqs = log_segments(path, &count);
+    for (size_t i = 0; i < count; i++) {
+        char *name = segment_path(path, seqs[i]);
+        struct stat file_stat;
+        if (stat(name, &file_stat) == 0)
+            bytes += file_stat.st_size;
+        free(name);
+    }
+    free(seqs);
+    return bytes;
 }
 
-struct DB *dbcreate(char *file, struct DBC conf) {
-    // Init DB
-    struct DB *db = dbInit();
-    // Create file
-    db->file = open(file, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR|S_IRUSR);
-    // Init DB_Header
-    db->header.main_settings = conf;
-    db->header.root_offset = sizeof(db->header);
-    db->header.ff_offset = sizeof(db->header);
-    db->header.last_LSN = 0;
-    db->write(db, (char *) &(db->header), sizeof(db->header), 0x0);
-    // Init "first free" offsets
-    const size_t db_size = db->header.main_settings.db_size;
-    const size_t chunk_size = db->header.main_settings.chunk_size;
-    for (size_t chunk_off = db->header.root_offset; chunk_off < db_size; chunk_off += chunk_size) {
-        size_t next_chunk_off = chunk_off + chunk_size;
-        dbwrite(db, (char *) &next_chunk_off, sizeof(next_chunk_off), chunk_off);
+// Restart time after an unclean shutdown versus the length of the log
+int bench_recovery() {
+    struct DBC conf = {.db_size = 512 * 1024 * 1024, .chunk_size = 4 * 1024, .mem_size = 16 * 1024 * 1024};
+    const size_t counts[] = {1000, 10000, 50000, 100000, 200000};
+    char key[32], value[40];
+    memset(value, 'v', sizeof(value));
+    printf("%10s %14s %10s %12s\n", "records", "log bytes", "replayed", "restart ms");
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        struct DB *db = dbcreate("bench.db", conf);
+        unsigned seed = 1;
+        for (size_t i = 0; i < counts[c]; i++) {
+            seed = seed * 1103515245 + 12345;
+            db_put(db, key, sprintf(key, "key%010u", seed) + 1, value, sizeof(value));
+        }
+        db_crash(db);
+        const size_t log_size = log_bytes("bench.db.log");
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        db = dbInit();
+        db->file = open("bench.db", O_RDWR);
+        db->read(db, (char *) &(db->header), sizeof(db->header), 0x0);
+        freemap_open(db);
+        cache_init(db);
+        db->log = log_open("bench.db.log", &db->header.main_settings);
+        size_t replayed = recovery(db, "bench.db.log");
+        dbsync(db);
+        printf("%10zu %14zu %10zu %12.2f\n", counts[c], log_size, replayed, elapsed_ms(&start));
+        db_close(db);
     }
-    cache_init(db);
-    char log_file[100];
-    strcpy(log_file, file);
-    strcat(log_file, ".log");
-    db->log = log_open(log_file);
+    unlink("bench.db");
+    log_remove("bench.db.log");
+    return 0;
+}
 
-    // Add root
-    struct Chunk *root = node_create(db);
-    node_write(db, root);
-    return db;
+struct Bench_Keys {
+    size_t i, count;
+    char key[32], value[40];
+};
+
+static int bench_next(void *arg, void **key, size_t *key_len, void **val, size_t *val_len) {
+    struct Bench_Keys *keys = (struct Bench_Keys *) arg;
+    if (keys->i == keys->count)
+        return 1;
+    *key_len = sprintf(keys->key, "key%010zu", keys->i++) + 1;
+    *key = keys->key;
+    *val = keys->value;
+    *val_len = sizeof(keys->value);
+    return 0;
 }
 
-struct DB *dbopen(char *file) {
-    // Init DB
-    struct DB *db = dbInit();
-    // Open file
-    db->file = open(file, O_RDWR);
-    // Read header
-    db->read(db, (char *) &(db->header), sizeof(db->header), 0x0);
-    cache_init(db);
-    char log_file[100];
-    strcpy(log_file, file);
-    strcat(log_file, ".log");
-    db->log = log_open(log_file);
-    recovery(db, log_file);
-    db->log = log_open(log_file);
-    return db;
+// Loading sorted pairs one put at a time versus with db_bulk_load
+int bench_bulk() {
+    struct DBC conf = {.db_size = 512 * 1024 * 1024, .chunk_size = 4 * 1024, .mem_size = 16 * 1024 * 1024};
+    const size_t counts[] = {10000, 100000, 500000};
+    printf("%10s %12s %12s\n", "records", "put ms", "bulk ms");
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        struct Bench_Keys keys = {.i = 0, .count = counts[c]};
+        memset(keys.value, 'v', sizeof(keys.value));
+        struct DB *db = dbcreate("bench.db", conf);
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        void *key, *val;
+        size_t key_len, val_len;
+        while (bench_next(&keys, &key, &key_len, &val, &val_len) == 0)
+            db_put(db, key, key_len, val, val_len);
+        db_sync(db);
+        const double put_ms = elapsed_ms(&start);
+        db_close(db);
+        keys.i = 0;
+        db = dbcreate("bench.db", conf);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        db_bulk_load(db, &bench_next, &keys, 100);
+        printf("%10zu %12.2f %12.2f\n", counts[c], put_ms, elapsed_ms(&start));
+        db_close(db);
+    }
+    unlink("bench.db");
+    log_remove("bench.db.log");
+    return 0;
 }
 
-// External API
+// File size before and after compacting away three quarters of the keys,
+// and the longest pause a single bounded call takes
+int bench_compact() {
+    struct DBC conf = {.db_size = 512 * 1024 * 1024, .chunk_size = 4 * 1024, .mem_size = 16 * 1024 * 1024};
+    const size_t counts[] = {10000, 100000, 200000};
+    char key[32], value[40];
+    memset(value, 'v', sizeof(value));
+    printf("%10s %12s %12s %12s %12s\n", "records", "before KiB", "after KiB", "compact ms", "max call ms");
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        struct DB *db = dbcreate("bench.db", conf);
+        unsigned seed = 1;
+        for (size_t i = 0; i < counts[c]; i++) {
+            seed = seed * 1103515245 + 12345;
+            db_put(db, key, sprintf(key, "key%010u", seed) + 1, value, sizeof(value));
+        }
+        seed = 1;
+        for (size_t i = 0; i < counts[c]; i++) {
+            seed = seed * 1103515245 + 12345;
+            if (i % 4)
+                db_del(db, key, sprintf(key, "key%010u", seed) + 1);
+        }
+        db_sync(db);
+        struct stat file_stat;
+        fstat(db->file, &file_stat);
+        const long long before = (long long) file_stat.st_size;
+        struct timespec start, call;
+        double longest = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int more = 1; more;) {
+            clock_gettime(CLOCK_MONOTONIC, &call);
+            more = db_compact(db, 64);
+            const double ms = elapsed_ms(&call);
+            longest = ms > longest ? ms : longest;
+        }
+        const double total = elapsed_ms(&start);
+        fstat(db->file, &file_stat);
+        printf("%10zu %12lld %12lld %12.2f %12.2f\n", counts[c], before / 1024,
+               (long long) file_stat.st_size / 1024, total, longest);
+        db_close(db);
+    }
+    unlink("bench.db");
+    log_remove("bench.db.log");
+    return 0;
+}
 
-int db_close(struct DB *db) {
-    return db->close(db);
+struct Bench_Thread {
+    struct DB *db;
+    size_t count, ops;
+    unsigned seed;
+    // Every tenth op is a put
+    bool mixed;
+};
+
+static void *bench_worker(void *arg) {
+    struct Bench_Thread *thread = (struct Bench_Thread *) arg;
+    char key[32], value[40];
+    memset(value, 'w', sizeof(value));
+    for (size_t i = 0; i < thread->ops; i++) {
+        const size_t key_len = sprintf(key, "key%010zu", (size_t) rand_r(&thread->seed) % thread->count) + 1;
+        if (thread->mixed && i % 10 == 0) {
+            db_put(thread->db, key, key_len, value, sizeof(value));
+        } else {
+            void *val;
+            size_t val_len;
+            if (db_get(thread->db, key, key_len, &val, &val_len) == 0)
+                free(val);
+        }
+    }
+    return NULL;
 }
 
-int db_del(struct DB *db, void *key, size_t key_len) {
-    struct DBT keyt = {
-            .data = key,
-            .size = key_len
-    };
-    return db->del(db, &keyt);
+// Throughput of random gets, and of gets mixed with puts, from a growing
+// number of threads on one DB
+static double bench_run(struct DB *db, size_t count, int threads, bool mixed) {
+    const size_t ops = 200000;
+    pthread_t ids[threads];
+    struct Bench_Thread args[threads];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int t = 0; t < threads; t++) {
+        args[t] = (struct Bench_Thread) {db, count, ops / threads, (unsigned) t + 1, mixed};
+        pthread_create(&ids[t], NULL, &bench_worker, &args[t]);
+    }
+    for (int t = 0; t < threads; t++)
+        pthread_join(ids[t], NULL);
+    return ops / (elapsed_ms(&start) / 1000);
 }
 
-int db_get(struct DB *db, void *key, size_t key_len, void **val, size_t *val_len) {
-    struct DBT keyt = {
-            .data = key,
-            .size = key_len
-    };
-    struct DBT valt = {0, 0};
-    int rc = db->get(db, &keyt, &valt);
-    *val = valt.data;
-    *val_len = valt.size;
-    return rc;
+int bench_threads() {
+    struct DBC conf = {.db_size = 512 * 1024 * 1024, .chunk_size = 4 * 1024, .mem_size = 64 * 1024 * 1024,
+                       .commit_policy = DB_COMMIT_INTERVAL, .commit_interval = 10};
+    struct Bench_Keys keys = {.i = 0, .count = 200000};
+    memset(keys.value, 'v', sizeof(keys.value));
+    struct DB *db = dbcreate("bench.db", conf);
+    db_bulk_load(db, &bench_next, &keys, 100);
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    double get_base = 0, mixed_base = 0;
+    printf("%8s %12s %8s %12s %8s\n", "threads", "get ops/s", "speedup", "mixed ops/s", "speedup");
+    for (int threads = 1; threads <= cpus; threads *= 2) {
+        const double get = bench_run(db, keys.count, threads, false);
+        const double mixed = bench_run(db, keys.count, threads, true);
+        if (threads == 1) {
+            get_base = get;
+            mixed_base = mixed;
+        }
+        printf("%8d %12.0f %8.2f %12.0f %8.2f\n", threads, get, get / get_base, mixed, mixed / mixed_base);
+    }
+    db_close(db);
+    unlink("bench.db");
+    log_remove("bench.db.log");
+    return 0;
 }
 
-int db_put(struct DB *db, void *key, size_t key_len,
-        void *val, size_t val_len) {
-    struct DBT keyt = {
-            .data = key,
-            .size = key_len
-    };
-    struct DBT valt = {
-            .data = val,
-            .size = val_len
-    };
-    return db->put(db, &keyt, &valt);
+struct Bench_Shard_Thread {
+    struct DB_Shards *shards;
+    size_t ops;
+    unsigned seed;
+};
+
+static void *bench_shard_worker(void *arg) {
+    struct Bench_Shard_Thread *thread = (struct Bench_Shard_Thread *) arg;
+    char key[32], value[40];
+    memset(value, 'w', sizeof(value));
+    for (size_t i = 0; i < thread->ops; i++) {
+        const size_t key_len = sprintf(key, "key%010u", (unsigned) rand_r(&thread->seed)) + 1;
+        db_shards_put(thread->shards, key, key_len, value, sizeof(value));
+    }
+    return NULL;
+}
+
+// Put throughput from a growing number of threads into one shard and into
+// as many shards as threads
+int bench_shards() {
+    struct DBC conf = {.db_size = 512 * 1024 * 1024, .chunk_size = 4 * 1024, .mem_size = 64 * 1024 * 1024,
+                       .commit_policy = DB_COMMIT_INTERVAL, .commit_interval = 10};
+    const size_t ops = 200000;
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    double base = 0;
+    printf("%8s %12s %12s %8s\n", "threads", "1 shard/s", "n shards/s", "speedup");
+    for (int threads = 1; threads <= cpus; threads *= 2) {
+        double rate[2];
+        for (int sharded = 0; sharded < 2; sharded++) {
+            const size_t count = sharded ? threads : 1;
+            struct DB_Shards *shards = db_shards_create("bench.db", conf, count, NULL, NULL);
+            pthread_t ids[threads];
+            struct Bench_Shard_Thread args[threads];
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (int t = 0; t < threads; t++) {
+                args[t] = (struct Bench_Shard_Thread) {shards, ops / threads, (unsigned) t + 1};
+                pthread_create(&ids[t], NULL, &bench_shard_worker, &args[t]);
+            }
+            for (int t = 0; t < threads; t++)
+                pthread_join(ids[t], NULL);
+            rate[sharded] = ops / (elapsed_ms(&start) / 1000);
+            db_shards_close(shards);
+            shards_remove("bench.db", count);
+        }
+        if (threads == 1)
+            base = rate[0];
+        printf("%8d %12.0f %12.0f %8.2f\n", threads, rate[0], rate[1], rate[1] / base);
+    }
+    unlink("bench.db");
+    return 0;
+}
+
+// Check a file given on the command line, or else time checking a
+// freshly built one with more and more threads
+int bench_verify(int argc, char **argv) {
+    struct DB_Verify_Report report;
+    if (argc > 2) {
+        const int res = db_verify(argv[2], argc > 3 ? atoi(argv[3]) : 0, &report);
+        if (res < 0) {
+            fprintf(stderr, "Cannot read %s.\n", argv[2]);
+            return 2;
+        }
+        printf("%zu chunks: %zu corrupt, %zu malformed, %zu misordered, %zu bad links, %zu underfull, %zu leaked\n",
+               report.chunks, report.corrupt, report.malformed, report.misordered, report.bad_links,
+               report.underfull, report.leaked);
+        return res;
+    }
+    struct DBC conf = {.db_size = 1024 * 1024 * 1024, .chunk_size = 4 * 1024, .mem_size = 64 * 1024 * 1024,
+                       .commit_policy = DB_COMMIT_INTERVAL, .commit_interval = 10};
+    const size_t count = 1000000;
+    char key[32], value[100];
+    memset(value, 'v', sizeof(value));
+    struct DB *db = dbcreate("bench.db", conf);
+    unsigned seed = 1;
+    for (size_t i = 0; i < count; i++) {
+        seed = seed * 1103515245 + 12345;
+        db_put(db, key, sprintf(key, "key%010u", seed) + 1, value, sizeof(value));
+    }
+    db_close(db);
+    printf("%8s %10s %12s %12s\n", "threads", "chunks", "verify ms", "MiB/s");
+    for (int threads = 1; threads <= 8; threads *= 2) {
+        // Start each run with the file out of the page cache
+        const int fd = open("bench.db", O_RDONLY);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        const int res = db_verify("bench.db", threads, &report);
+        const double ms = elapsed_ms(&start);
+        printf("%8d %10zu %12.2f %12.1f%s\n", threads, report.chunks, ms,
+               report.chunks * (double) conf.chunk_size / (1024 * 1024) / (ms / 1000), res ? " FAILED" : "");
+    }
+    unlink("bench.db");
+    log_remove("bench.db.log");
+    return 0;
+}
+
+// Pairs for a bulk load, far more than a small store holds
+static int check_full_next(void *arg, void **key, size_t *key_len, void **val, size_t *val_len) {
+    size_t *count = (size_t *) arg;
+    static char key_buf[32], val_buf[40];
+    if (*count == 100000)
+        return 1;
+    *key = key_buf;
+    *key_len = sprintf(key_buf, "key%06zu", (*count)++);
+    *val = val_buf;
+    *val_len = sizeof(val_buf);
+    return 0;
+}
+
+// Fill a small store in both tree modes until a put no longer fits. What
+// is refused must change nothing: the store has to pass db_verify and hold
+// every pair that went in once reopened. Deletes still get through and
+// make room for puts again, and a bulk load that does not fit leaves the
+// store empty.
+int check_full() {
+    char key[32], value[2500];
+    memset(value, 'v', sizeof(value));
+    struct DB_Verify_Report report;
+    for (int bplus = 0; bplus < 2; bplus++) {
+        struct DBC conf = {.db_size = 96 * 1024, .chunk_size = 1024, .mem_size = 64 * 1024, .bplus = bplus};
+        struct DB *db = dbcreate("full.db", conf);
+        // Every seventh value takes an overflow chain
+        size_t stored = 0;
+        int res;
+        while ((res = db_put(db, key, sprintf(key, "key%06zu", stored), value, stored % 7 ? 40 : 2500)) == 0)
+            stored++;
+        void *val;
+        size_t val_len;
+        struct DB_Write write = {key, strlen(key), value, 40, false};
+        if (res != DB_FULL || stored == 0 || db_get(db, key, strlen(key), &val, &val_len) == 0
+            || db_write_batch(db, &write, 1) != DB_FULL) {
+            fprintf(stderr, "full: a put that does not fit was not refused cleanly\n");
+            return 1;
+        }
+        for (size_t i = 0; i < stored; i += 2) {
+            if (db_del(db, key, sprintf(key, "key%06zu", i)) != 0) {
+                fprintf(stderr, "full: deleting %s failed\n", key);
+                return 1;
+            }
+        }
+        if (db_put(db, key, sprintf(key, "key%06zu", stored), value, 40) != 0) {
+            fprintf(stderr, "full: no room after deletes\n");
+            return 1;
+        }
+        db_close(db);
+        if (db_verify("full.db", 0, &report) != 0) {
+            fprintf(stderr, "full: the store does not verify\n");
+            return 1;
+        }
+        db = dbopen("full.db");
+        for (size_t i = 0; db && i <= stored; i++) {
+            const size_t expect = i == stored ? 40 : i % 7 ? 40 : 2500;
+            res = db_get(db, key, sprintf(key, "key%06zu", i), &val, &val_len);
+            if (res == 0)
+                free(val);
+            if (i % 2 == 0 && i < stored ? res == 0 : res != 0 || val_len != expect) {
+                fprintf(stderr, "full: %s is wrong after reopening\n", key);
+                return 1;
+            }
+        }
+        if (!db) {
+            fprintf(stderr, "full: the store does not open\n");
+            return 1;
+        }
+        db_close(db);
+        // The load takes all chunks before it fails
+        db = dbcreate("full.db", conf);
+        size_t count = 0;
+        if (db_bulk_load(db, &check_full_next, &count, 100) != DB_FULL
+            || db_get(db, "key000000", 9, &val, &val_len) == 0 || db_put(db, "key", 3, value, 40) != 0) {
+            fprintf(stderr, "full: a bulk load that does not fit was not undone\n");
+            return 1;
+        }
+        db_close(db);
+        if (db_verify("full.db", 0, &report) != 0) {
+            fprintf(stderr, "full: the store does not verify after the bulk load\n");
+            return 1;
+        }
+        unlink("full.db");
+        log_remove("full.db.log");
+    }
+    printf("full: OK\n");
+    return 0;
 }
 
-int main() {
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "recovery") == 0)
+        return bench_recovery();
+    if (argc > 1 && strcmp(argv[1], "bulk") == 0)
+        return bench_bulk();
+    if (argc > 1 && strcmp(argv[1], "compact") == 0)
+        return bench_compact();
+    if (argc > 1 && strcmp(argv[1], "threads") == 0)
+        return bench_threads();
+    if (argc > 1 && strcmp(argv[1], "shards") == 0)
+        return bench_shards();
+    if (argc > 1 && strcmp(argv[1], "verify") == 0)
+        return bench_verify(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "full") == 0)
+        return check_full();
     struct DBC myconf = {.db_size = 512 * 256 * 1024, .chunk_size = 4 * 1024, .mem_size = 32 * 4 * 1024};
     struct DB *mydb = dbcreate("ololo.db", myconf);
     struct DBT key, data;
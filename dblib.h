@@ -1,7 +1,9 @@
 /* check  man dbopen  */
 #include <stdio.h>
-
-#define T 25
+#include <stdatomic.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 struct DBT {
     void  *data;
@@ -9,24 +11,73 @@ struct DBT {
 };
 
 struct Chunk_Header {
+    /* CRC32C of the rest of the chunk, set when its image is built */
+    uint32_t crc;
     bool leaf;
     unsigned int n;
+    /* Length of the key prefix shared by all keys, stored once */
+    unsigned int prefix;
     size_t LSN;
-    size_t childs[2 * T];
+    /* Sibling leaves in B+tree mode, 0 if none */
+    size_t prev;
+    size_t next;
 };
 
 struct Chunk {
+    /* Image of the chunk as last written; a private buffer is never */
+    /* changed once set, so optimistic readers parse it without the latch */
     void *raw_data;
     size_t offset;
     bool leaf;
     unsigned int n;
     size_t LSN;
-    size_t childs[2 * T];
-    struct DBT keys[2 * T - 1];
-    struct DBT data[2 * T - 1];
+    /* Changed since last written to disk; read by eviction without the latch */
+    atomic_bool dirty;
+    /* raw_data points into the file mapping */
+    bool view;
+    /* Failed its checksum when read: it is taken as an empty leaf, never */
+    /* written back, and the operations reaching it fail */
+    bool corrupt;
+    /* Sibling leaves in B+tree mode, 0 if none */
+    size_t prev;
+    size_t next;
+    /* Entry arrays sized for cap entries (cap + 1 childs) */
+    size_t *childs;
+    /* Full keys, expanded into keybuf */
+    struct DBT *keys;
+    struct DBT *data;
+    char *keybuf;
+    /* Common key prefix length and the key bytes following it */
+    unsigned int prefix;
+    unsigned int *heads;
+    unsigned int cap;
+    /* Views into raw_data not yet released */
+    atomic_uint pins;
+    /* Shared by readers, exclusive for the writer changing the chunk */
+    pthread_rwlock_t latch;
+    /* Tree operations using the chunk, which keep it cached. NODE_DETACHED */
+    /* is added once it has left the cache, and the last user frees it */
+    atomic_uint users;
+    /* Used since the eviction scan last passed it */
+    atomic_bool referenced;
+    /* Odd while a writer holds the latch exclusively, bumped as it takes */
+    /* and lets go of it; CHUNK_OBSOLETE is added once it leaves the cache */
+    atomic_size_t version;
+    /* Buffer pool LRU links (most recently used first) */
+    struct Chunk *lru_prev;
+    struct Chunk *lru_next;
 };
 
 
+enum DB_Commit_Policy {
+    /* Sync the log after every operation */
+    DB_COMMIT_PER_OP,
+    /* Sync the log at most every commit_interval milliseconds */
+    DB_COMMIT_INTERVAL,
+    /* Sync the log once commit_bytes are buffered */
+    DB_COMMIT_BYTES
+};
+
 struct DBC{
     /* Maximum on-disk file size */
     /* 512MB by default */
@@ -37,16 +88,133 @@ struct DBC{
     /* Maximum memory size */
     /* 16MB by default */
     size_t mem_size;
+    /* Log commit policy */
+    /* DB_COMMIT_PER_OP by default */
+    enum DB_Commit_Policy commit_policy;
+    /* Milliseconds between log syncs for DB_COMMIT_INTERVAL */
+    size_t commit_interval;
+    /* Buffered log bytes that trigger a sync for DB_COMMIT_BYTES */
+    size_t commit_bytes;
+    /* Read chunks through a shared mapping of the file */
+    /* Off by default */
+    bool use_mmap;
+    /* Submit chunk and log I/O through io_uring when the kernel has it */
+    /* Off by default */
+    bool use_uring;
+    /* B+tree: values only in leaves, leaves linked for cursors */
+    /* Off by default */
+    bool bplus;
+    /* Values longer than this are stored in overflow chunks */
+    /* Only values that do not fit in a node by default (0) */
+    size_t overflow_size;
+};
+
+/* Hit counters are striped over threads so that hits share no cache line */
+#define CACHE_HIT_STRIPES 16
+
+struct Hit_Stripe {
+    _Alignas(64) atomic_size_t count;
 };
 
-struct cache_list_node {
-    struct Chunk *node;
-    struct cache_list_node *next;
+/* Chunk buffer replaced while views into it were held */
+struct Held_Buffer {
+    void *buf;
+    unsigned int pins;
 };
 
 struct DB_Cache {
+    /* Maximum number of cached chunks */
     size_t n;
-    struct cache_list_node *head;
+    /* Number of cached chunks */
+    size_t count;
+    /* Number of dirty cached chunks */
+    atomic_size_t dirty;
+    /* Guards the table, the list and count; lookups share it */
+    pthread_rwlock_t lock;
+    /* Guards pins, the buffers of pinned chunks and the held list */
+    pthread_mutex_t pin_lock;
+    /* Replaced buffers that views still point into */
+    struct Held_Buffer *held;
+    size_t held_count;
+    size_t held_cap;
+    /* Open-addressing hash table keyed by chunk offset */
+    struct Chunk **table;
+    unsigned int table_bits;
+    /* LRU list; chunks hit since they last passed the tail get another round */
+    struct Chunk *head;
+    struct Chunk *tail;
+    /* Statistics */
+    struct Hit_Stripe hits[CACHE_HIT_STRIPES];
+    atomic_size_t misses;
+    atomic_size_t evictions;
+    atomic_size_t writes;
+};
+
+/* Growable array of pointers */
+struct Ptr_List {
+    void **items;
+    size_t count;
+    size_t cap;
+};
+
+/* Memory retired in an epoch, freed by release once no reader can see it */
+struct Retired {
+    void *ptr;
+    void (*release)(void *);
+    size_t epoch;
+};
+
+struct Retire_List {
+    struct Retired *items;
+    size_t count;
+    size_t cap;
+};
+
+/* State of a thread in tree operations and optimistic reads. Chunks the */
+/* operation used and latched are let go when the outermost one ends */
+struct Tree_Op {
+    int depth;
+    /* Chunks the operation has reserved and not taken yet */
+    size_t reserved;
+    struct Ptr_List used;
+    struct Ptr_List latched;
+    /* Global epoch the thread reads in, EPOCH_IDLE outside of reads */
+    atomic_size_t epoch;
+    int reading;
+    /* Memory the thread retired; collected once it holds collect_at items */
+    struct Retire_List limbo;
+    size_t collect_at;
+    /* Hit counter stripe */
+    unsigned int stripe;
+    /* Next registered thread */
+    struct Tree_Op *next;
+};
+
+/* A chunk image parsed by an optimistic reader, bounds checked */
+struct Chunk_Image {
+    const char *raw;
+    bool leaf;
+    unsigned int n;
+    unsigned int prefix;
+    size_t LSN;
+    size_t prev;
+    size_t next;
+    /* Child offsets (NULL in a non-empty leaf), cell slots and the prefix */
+    const char *childs;
+    const char *slots;
+    const char *prefix_data;
+};
+
+struct DB_Cache_Stats {
+    size_t capacity;
+    size_t count;
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    /* Dirty chunks waiting for write back */
+    size_t dirty;
+    /* Chunks written to disk */
+    size_t writes;
 };
 
 struct Record {
@@ -56,21 +224,196 @@ struct Record {
     struct DBT data;
 };
 
+/* io_uring instance driven through raw syscalls */
+struct Uring {
+    int fd;
+    unsigned int entries;
+    /* Submission queue */
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    /* Completion queue */
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    /* Kernel-shared mappings */
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size, sqes_size;
+};
+
+/* Cell contents of a value stored in a chain of overflow chunks */
+struct Overflow_Ref {
+    size_t size;
+    size_t first;
+};
+
+/* Entries of one or two nodes being split or rebalanced */
+struct Run {
+    int n;
+    bool leaf;
+    struct DBT *keys;
+    struct DBT *data;
+    size_t *childs;
+};
+
+/* Root-to-node path of a tree operation */
+#define PATH_MAX_DEPTH 64
+
+struct Path {
+    int depth;
+    struct Chunk *nodes[PATH_MAX_DEPTH];
+    /* Child followed below each node */
+    int index[PATH_MAX_DEPTH];
+    /* Node modified and not yet repaired */
+    bool changed[PATH_MAX_DEPTH];
+    /* Highest node still latched; the path is repaired no higher */
+    int top;
+};
+
+/* How path_descend latches the nodes it passes */
+enum Path_Latch {
+    /* None, the caller has the tree to itself */
+    PATH_UNLATCHED,
+    /* Exclusively, letting go of the ones above a node that cannot split */
+    /* or merge whatever happens below it */
+    PATH_COUPLED,
+    /* Exclusively, all of them */
+    PATH_HELD
+};
+
+/* One key of a batch */
+struct Batch_Op {
+    /* 'i' put, 'd' delete; a get sets 'f' once the key is found */
+    char op;
+    struct DBT key;
+    struct DBT data;
+    /* Position in the caller's order, which breaks ties between equal keys */
+    size_t seq;
+    /* Value as stored in the cell */
+    struct DBT value;
+    struct Overflow_Ref ref;
+};
+
+/* Bulk load state: the node being filled at each level, leaves first */
+struct Bulk {
+    int depth;
+    struct Chunk *levels[PATH_MAX_DEPTH];
+    /* Entry bytes of each node before prefix compression */
+    size_t bytes[PATH_MAX_DEPTH];
+    /* Node size the fill factor allows */
+    size_t limit;
+    /* Last key loaded, to check the order */
+    struct DBT last;
+    /* Finished chunks waiting to be written */
+    struct Chunk **batch;
+    size_t batch_count;
+};
+
+/* One transfer of a batch passed to db->submit */
+struct DB_IO {
+    struct iovec *iov;
+    int count;
+    size_t offset;
+    bool write;
+};
+
+/* Log segments are the files <log>.<seq>; each starts with this header */
+struct Log_Segment_Header {
+    unsigned int magic;
+    /* Whether the first record is a checkpoint */
+    unsigned int checkpoint;
+    size_t seq;
+    unsigned first_LSN;
+};
+
+/* Precedes every record: its size and the CRC32C of the size and record */
+struct Log_Frame {
+    uint32_t size;
+    uint32_t crc;
+};
+
+/* A record of a segment; sealed segments keep one every LOG_INDEX_STEP bytes */
+struct Log_Index_Entry {
+    unsigned LSN;
+    size_t offset;
+};
+
+/* Ends a sealed segment, after the records and the index */
+struct Log_Segment_Footer {
+    /* End of the records and start of the index */
+    size_t end;
+    size_t count;
+    unsigned last_LSN;
+    /* CRC32C of the index and the fields above */
+    uint32_t crc;
+    unsigned int magic;
+};
+
 struct Log {
+    /* Segment being appended to, -1 until the first append */
     int file;
-    //struct Record record;
+    /* Segments are named after this */
+    char *path;
+    /* Current segment: its number, the bytes in it, the LSN of its last */
+    /* record and its index. Changed only by whoever appends */
+    size_t seq;
+    size_t segment_end;
+    unsigned segment_LSN;
+    struct Log_Index_Entry *index;
+    size_t index_count;
+    size_t index_cap;
+    /* Bytes appended since the last checkpoint */
+    atomic_size_t written;
+    /* Ring of records not yet written to the file. Positions grow */
+    /* monotonically: reserved by producers up to head, published up */
+    /* to committed, written out by the writer thread up to tail */
+    char *ring;
+    size_t ring_size;
+    atomic_size_t head;
+    atomic_size_t committed;
+    atomic_size_t tail;
+    /* LSN of the last published and the last synced record */
+    atomic_uint buffered_LSN;
+    atomic_uint durable_LSN;
+    /* Commit policy */
+    enum DB_Commit_Policy policy;
+    size_t interval;
+    size_t bytes;
+    /* Writer thread state, guarded by lock */
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t durable;
+    size_t waiters;
+    bool stop;
+    size_t last_sync;
+    size_t syncs;
+    /* Writer thread appends and syncs in one submission, NULL if unused */
+    struct Uring *uring;
 };
 
-struct Log *log_open(char *filename);
+struct Log *log_open(char *filename, const struct DBC *conf);
 void log_close(struct Log *log);
+void log_flush(struct Log *log);
+void log_wait(struct Log *log, unsigned LSN);
 void log_write(struct Log *log, struct Record *record);
-void log_seek(struct Log *log);
-struct Record *log_read_next(struct Log *log);
+void log_checkpoint(struct Log *log, struct Record *record, bool drop);
+void log_remove(const char *path);
+off_t log_seek(int file, unsigned LSN);
+struct Record *log_read_next(int file, off_t *offset);
+
+/* A checkpoint taken but not yet written in place: the header and map, */
+/* and the offset and image of every chunk that was dirty, in file order */
+struct Checkpoint {
+    char *meta;
+    size_t meta_size;
+    char *images;
+    size_t count;
+};
 
 struct DB_Header {
     struct DBC main_settings;
     size_t root_offset;
-    size_t ff_offset;
+    /* First chunk; the free-space map is kept between the header and it */
+    size_t chunks_offset;
     unsigned last_LSN;
 };
 
@@ -80,21 +423,253 @@ struct DB {
     struct DB_Cache cache;
     struct Log *log;
     int file;
+    /* Read-only mapping of the file in mmap mode */
+    char *map;
+    size_t map_size;
+    /* io_uring backend behind db->submit, NULL for synchronous I/O */
+    struct Uring *uring;
+    /* Free-space map, a bit per chunk set while the chunk is in use */
+    uint64_t *chunk_map;
+    size_t chunk_count;
+    /* Chunk index where the next unhinted allocation starts looking */
+    size_t alloc_next;
+    /* Bytes allocated to the file so far; it grows on demand up to db_size */
+    size_t file_size;
+    /* Free chunks the file holds, and how many of them operations reserved */
+    size_t chunks_free;
+    size_t chunks_reserved;
+    /* A compaction pass in progress resumes after this key */
+    struct DBT compact_key;
+    bool compact_resume;
+    /* Shared by single-key operations and cursors; checkpoints, batches, */
+    /* bulk loads and compaction take it exclusively */
+    pthread_rwlock_t tree_lock;
+    /* Odd while an exclusive section changes chunks without latching */
+    /* them; optimistic readers check it did not change under them */
+    atomic_size_t tree_seq;
+    /* Serializes chunk allocation */
+    pthread_mutex_t alloc_lock;
+    /* Keeps log records in LSN order */
+    pthread_mutex_t lsn_lock;
+    /* Checkpoint whose chunks are being written in place, NULL if none; */
+    /* changed under flush_lock and the cache lock */
+    struct Checkpoint *flushing;
+    pthread_mutex_t flush_lock;
+    pthread_cond_t flush_done;
+    /* Set while the log is replayed; checkpoints then append to it */
+    bool recovering;
+    /* Open snapshots, and the lock over the list and their images */
+    struct DB_Snapshot *snapshots;
+    pthread_mutex_t snapshot_lock;
+    /* LSN the newest open snapshot was taken at; chunks written after it */
+    /* need no copy, which writers check before taking the lock */
+    unsigned snapshot_LSN;
+    /* Bytes of snapshot images held in memory */
+    size_t snapshot_memory;
     /* Public API */
     int (*close)(struct DB *db);
     int (*del)(struct DB *db, struct DBT *key);
     int (*get)(struct DB *db, struct DBT *key, struct DBT *data);
     int (*put)(struct DB *db, struct DBT *key, struct DBT *data);
-    //int (*sync)(struct DB *db);
+    int (*sync)(struct DB *db);
     /* Private API */
     int (*read)(struct DB *db, char *dst, size_t size, size_t offset);
     int (*write)(struct DB *db, char *src, size_t size, size_t offset);
+    int (*writev)(struct DB *db, struct iovec *iov, int count, size_t offset);
+    int (*submit)(struct DB *db, struct DB_IO *io, size_t count);
 };
 
+/* Position between two entries of the leaf chain in B+tree mode */
+struct DB_Cursor {
+    struct DB *db;
+    /* Leaf and index of the entry following the position */
+    size_t leaf;
+    int index;
+    /* Leaf LSN when the position was taken; on change it is looked up again */
+    size_t LSN;
+    /* Last entry returned (or the seek key); the position is right */
+    /* after it or right before it */
+    struct DBT key;
+    struct DBT data;
+    bool after;
+};
+
+/* Read-only view of a value, valid until passed to db_release */
+struct DB_View {
+    void *data;
+    size_t size;
+    /* Chunk and buffer the value lies in */
+    size_t offset;
+    void *raw;
+    /* Copy of a value stored in overflow chunks, NULL otherwise */
+    void *copy;
+};
+
+/* One change of a write batch; val is ignored for a delete */
+struct DB_Write {
+    void *key;
+    size_t key_len;
+    void *val;
+    size_t val_len;
+    bool del;
+};
+
+/* Image a chunk had when a snapshot was opened, kept once it changed */
+struct Snapshot_Image {
+    /* 0 for a free slot */
+    size_t offset;
+    /* Copy in memory, NULL if it went to the spill file at spill_at */
+    char *raw;
+    size_t spill_at;
+};
+
+/* The tree as of the time it was opened, readable while writers go on */
+struct DB_Snapshot {
+    struct DB *db;
+    size_t root;
+    unsigned LSN;
+    /* Open-addressing table over chunk offsets, at most half full */
+    struct Snapshot_Image *images;
+    size_t image_count;
+    unsigned int image_bits;
+    /* Unlinked file next to the log taking the images once those of all */
+    /* snapshots in memory reach a quarter of mem_size; -1 until then */
+    int spill;
+    size_t spill_size;
+    struct DB_Snapshot *next;
+};
+
+/* What db_verify found. Each problem is also reported on stderr */
+struct DB_Verify_Report {
+    /* Chunks reached from the root, overflow chains included */
+    size_t chunks;
+    /* Chunks failing their checksum */
+    size_t corrupt;
+    /* Chunks whose layout points outside of them */
+    size_t malformed;
+    /* Keys out of order in a node or outside the range its parent gives it */
+    size_t misordered;
+    /* Links to chunks not in use or reached twice, broken overflow */
+    /* chains and leaves at different depths */
+    size_t bad_links;
+    /* Nodes other than the root filled below a quarter of a chunk */
+    size_t underfull;
+    /* Chunks in use but not reached from the root */
+    size_t leaked;
+};
+
+/* Keys partitioned over several DBs by hash, or by range with split keys */
+struct DB_Shards {
+    size_t count;
+    struct DB **shards;
+    /* count - 1 increasing split keys, NULL when keys are hashed */
+    struct DBT *bounds;
+};
+
+/* Returned by gets, puts, deletes and write batches that reach a chunk */
+/* failing its checksum; nothing is changed */
+#define DB_CORRUPT (-2)
+/* Returned by puts, deletes, write batches and bulk loads when the file */
+/* cannot hold the chunks they might take; nothing is changed */
+#define DB_FULL (-3)
+
+/* A DB may be used from several threads at once. NULL if the file cannot */
+/* be created or opened */
 struct DB *dbcreate(char *file, struct DBC conf);
 struct DB *dbopen(char *file); /* Metadata in file */
 
 int db_close(struct DB *db);
+int db_sync(struct DB *db);
 int db_del(struct DB *db, void *, size_t);
+/* The value is a malloc'd copy the caller frees */
 int db_get(struct DB *db, void *, size_t, void **, size_t *);
+/* Lookups without allocation: get_view points the view into the cached */
+/* chunk and keeps it there until db_release; get_into copies as much of */
+/* the value as fits in buf and sets *val_len to its full size */
+int db_get_view(struct DB *db, void *key, size_t key_len, struct DB_View *view);
+void db_release(struct DB *db, struct DB_View *view);
+int db_get_into(struct DB *db, void *key, size_t key_len, void *buf, size_t buf_len, size_t *val_len);
 int db_put(struct DB *db, void *, size_t, void * , size_t  );
+/* Partial reads of a value. get_part copies up to *len bytes from offset */
+/* into buf and sets *len to the number copied; get_stream hands the bytes */
+/* in [offset, offset + len) to visit piece by piece without copying; */
+/* visit must not call into the DB */
+int db_get_part(struct DB *db, void *key, size_t key_len, size_t offset, void *buf, size_t *len);
+int db_get_stream(struct DB *db, void *key, size_t key_len, size_t offset, size_t len,
+                  void (*visit)(void *arg, void *part, size_t part_len), void *arg);
+/* Look up count keys in one sorted descent. vals[i] gets a malloc'd copy */
+/* of the value of keys[i], or NULL if it is missing. Returns the number found */
+size_t db_multi_get(struct DB *db, size_t count, void **keys, size_t *key_lens, void **vals, size_t *val_lens);
+/* Apply puts and deletes as one logged operation, later ones winning on */
+/* equal keys. Returns 1, changing nothing, if a pair is too large */
+int db_write_batch(struct DB *db, struct DB_Write *writes, size_t count);
+/* Build the tree of an empty DB from pairs in strictly increasing key order. */
+/* next returns 0 with a pair or 1 at the end; nodes are filled to fill */
+/* percent (50 to 100) and the pairs are not logged. Returns 1 if the DB is */
+/* not empty, a key is out of order or too long, and DB_FULL if the pairs */
+/* do not fit; the DB is then left empty */
+int db_bulk_load(struct DB *db,
+                 int (*next)(void *arg, void **key, size_t *key_len, void **val, size_t *val_len),
+                 void *arg, unsigned fill);
+/* Move chunks toward the start of the file in key order, at most steps */
+/* leaves at a time. Returns 1 while the pass goes on and 0 once it is */
+/* through and the file has been shrunk */
+int db_compact(struct DB *db, size_t steps);
+void db_cache_stats(struct DB *db, struct DB_Cache_Stats *stats);
+/* LSN of the last operation and wait until it is on disk */
+unsigned db_last_lsn(struct DB *db);
+int db_wait_durable(struct DB *db, unsigned LSN);
+/* Ordered iteration, B+tree mode only. next/prev return 0, or 1 at the */
+/* end; returned pointers stay valid until the next cursor call. A cursor */
+/* is used by one thread at a time */
+struct DB_Cursor *db_cursor_open(struct DB *db);
+int db_cursor_seek(struct DB_Cursor *cursor, void *key, size_t key_len);
+int db_cursor_last(struct DB_Cursor *cursor);
+int db_cursor_next(struct DB_Cursor *cursor, void **key, size_t *key_len, void **val, size_t *val_len);
+int db_cursor_prev(struct DB_Cursor *cursor, void **key, size_t *key_len, void **val, size_t *val_len);
+/* Visit up to limit entries from the position on while key < to (no bound */
+/* if to is NULL); returns how many. visit must not call into the DB */
+size_t db_cursor_range(struct DB_Cursor *cursor, void *to, size_t to_len, size_t limit,
+                       void (*visit)(void *arg, void *key, size_t key_len, void *val, size_t val_len),
+                       void *arg);
+void db_cursor_close(struct DB_Cursor *cursor);
+/* Consistent reads of the tree as of db_snapshot_open, in either tree */
+/* mode. Opening waits for running operations; reads then take no latch. */
+/* range visits up to limit entries from from (the start if NULL) while */
+/* key < to (no bound if NULL); visit may call into the DB. Snapshots must */
+/* be closed before the DB. While one is open, the first change to each */
+/* chunk it can reach keeps the old image, so a long snapshot over busy */
+/* writers grows toward the size of the tree. Images are held in memory */
+/* up to a quarter of mem_size over all snapshots, then in a temporary */
+/* file beside the log, and freed on close */
+struct DB_Snapshot *db_snapshot_open(struct DB *db);
+int db_snapshot_get(struct DB_Snapshot *snap, void *key, size_t key_len, void **val, size_t *val_len);
+size_t db_snapshot_range(struct DB_Snapshot *snap, void *from, size_t from_len, void *to, size_t to_len,
+                         size_t limit,
+                         void (*visit)(void *arg, void *key, size_t key_len, void *val, size_t val_len),
+                         void *arg);
+void db_snapshot_close(struct DB_Snapshot *snap);
+/* Sharded handle over count DBs in <file>.0 .. <file>.<count - 1>, the */
+/* layout kept in file. Keys are hashed unless count - 1 increasing split */
+/* keys are given; shard i then holds keys from split key i - 1 up to split */
+/* key i. Each shard gets mem_size / count of cache and its own log. NULL */
+/* if the split keys do not increase or a file cannot be written or read */
+struct DB_Shards *db_shards_create(char *file, struct DBC conf, size_t count, void **bounds, size_t *bound_lens);
+struct DB_Shards *db_shards_open(char *file);
+int db_shards_close(struct DB_Shards *shards);
+int db_shards_sync(struct DB_Shards *shards);
+/* Shard owning the key, for the calls that have no sharded form */
+struct DB *db_shard(struct DB_Shards *shards, void *key, size_t key_len);
+int db_shards_put(struct DB_Shards *shards, void *key, size_t key_len, void *val, size_t val_len);
+int db_shards_get(struct DB_Shards *shards, void *key, size_t key_len, void **val, size_t *val_len);
+int db_shards_del(struct DB_Shards *shards, void *key, size_t key_len);
+size_t db_shards_multi_get(struct DB_Shards *shards, size_t count, void **keys, size_t *key_lens,
+                           void **vals, size_t *val_lens);
+/* Each shard applies its part as one batch: atomic within a shard only */
+int db_shards_write_batch(struct DB_Shards *shards, struct DB_Write *writes, size_t count);
+/* Check every chunk reachable in the file of a cleanly closed DB, with */
+/* the given number of threads (0 for one per CPU). Returns 0 if none is */
+/* corrupt or malformed and the tree is well formed; underfull nodes are */
+/* only counted, and so are leaked chunks unless there are more of them */
+/* than a sixteenth of the chunks reached, which means a lost subtree */
+int db_verify(char *file, int threads, struct DB_Verify_Report *report);